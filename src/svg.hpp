@@ -10,6 +10,26 @@
 #define SVG_TYPE_CHECK static_assert(std::is_base_of<Element, T>::value, "Child must be an SVG element.")
 #define APPROX_EQUALS(x, y, tol) bool(abs(x - y) < tol)
 
+// Vectorized kernels are used when the compiler targets AVX or SSE2
+#if defined(__AVX__)
+#define SVG_USE_AVX
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#define SVG_USE_SSE2
+#include <emmintrin.h>
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h> // _BitScanForward
+#endif
+
+#if !defined(_WIN32)
+#include <fcntl.h>    // open
+#include <sys/mman.h> // mmap
+#include <sys/stat.h> // fstat
+#include <unistd.h>   // close
+#endif
+
 #include <iostream>
 #include <algorithm> // min, max
 #include <fstream>   // ofstream
@@ -24,14 +44,29 @@
 #include <type_traits> // is_base_of
 #include <typeinfo>
 #include <list>
+#include <set>
+#include <unordered_map>
+#include <thread>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>  // snprintf
+#include <cstdlib> // strtod
+#include <cstring> // memchr
+#include <stdexcept> // length_error
+#include <cctype>  // isdigit, isalpha
+#include <chrono>
+#include <functional>
 
 namespace SVG {
     /** @namespace SVG
      *  @brief Main namespace for SVG for C++
      */
     class AttributeMap;
+    class Element;
     class SVG;
     class Shape;
+    std::unique_ptr<SVG> parse_lazy(std::shared_ptr<const std::string> markup);
+    std::unique_ptr<SVG> parse(const std::string& markup, size_t threads);
 
     struct QuadCoord {
         double x1;
@@ -40,18 +75,41 @@ namespace SVG {
         double y2;
     };
 
-    using SelectorProperties = std::map<std::string, AttributeMap>;
-    using SVGAttrib = std::map<std::string, std::string>;
+    // Transparent comparators allow lookups by string literal (or string_view)
+    // without constructing a temporary std::string
+    using SelectorProperties = std::map<std::string, AttributeMap, std::less<>>;
+    using SVGAttrib = std::map<std::string, std::string, std::less<>>;
     using Point = std::pair<double, double>;
     using Margins = QuadCoord;
     const static Margins DEFAULT_MARGINS { 10, 10, 10, 10 };
     const static Margins NO_MARGINS { 0, 0, 0, 0 };
 
+    /** @struct Color
+     *  @brief A color packed into 32 bits as 0xRRGGBBAA
+     */
+    struct Color {
+        uint32_t rgba {0x000000ff};
+
+        Color() = default;
+        explicit Color(const uint32_t _rgba) : rgba(_rgba) {};
+        Color(const uint8_t r, const uint8_t g, const uint8_t b, const uint8_t a = 255) :
+            rgba((uint32_t)r << 24 | (uint32_t)g << 16 | (uint32_t)b << 8 | a) {};
+
+        uint8_t red() const { return (uint8_t)(this->rgba >> 24); }
+        uint8_t green() const { return (uint8_t)(this->rgba >> 16); }
+        uint8_t blue() const { return (uint8_t)(this->rgba >> 8); }
+        uint8_t alpha() const { return (uint8_t)this->rgba; }
+
+        bool operator==(const Color& other) const { return this->rgba == other.rgba; }
+        bool operator!=(const Color& other) const { return this->rgba != other.rgba; }
+    };
+
     inline std::string to_string(const double& value);
     inline std::string to_string(const Point& point);
-    inline std::string to_string(const std::map<std::string, AttributeMap>& css, const size_t indent_level=0);
+    inline std::string to_string(const Color& color);
+    inline std::string to_string(const SelectorProperties& css, const size_t indent_level=0);
 
-    std::vector<Point> bounding_polygon(const std::vector<Shape*>& shapes);
+    inline std::vector<Point> bounding_polygon(const std::vector<Shape*>& shapes);
     SVG frame_animate(std::vector<SVG>& frames, const double fps);
     SVG merge(SVG& left, SVG& right, const Margins& margins = DEFAULT_MARGINS);
     SVG merge(std::vector<SVG>& frames, const double width, const int max_frame_width);
@@ -65,6 +123,23 @@ namespace SVG {
         };
 
         inline std::vector<Point> polar_points(int n, int a, int b, double radius);
+
+        template<typename Map, typename Key>
+        inline typename Map::iterator find_or_emplace(Map& map, const Key& key) {
+            /** Find key in map, inserting a default value if it is missing,
+             *  and only construct a std::string key in the latter case
+             */
+            auto it = map.find(key);
+            if (it == map.end())
+                it = map.emplace_hint(it, std::string(key), typename Map::mapped_type());
+            return it;
+        }
+
+        template<typename Map, typename Key>
+        inline typename Map::mapped_type& find_or_insert(Map& map, const Key& key) {
+            /** Like map[key], but only constructs a std::string key if it is missing */
+            return find_or_emplace(map, key)->second;
+        }
         
         template<typename T>
         inline T min_or_not_nan(T first, T second) {
@@ -135,6 +210,838 @@ namespace SVG {
             return hull;
         }
 
+        /** @class PointBuffer
+         *  @brief A flat (structure of arrays) set of points
+         */
+        struct PointBuffer {
+            std::vector<double> x;
+            std::vector<double> y;
+
+            size_t size() const { return x.size(); }
+            void reserve(const size_t n) { x.reserve(n); y.reserve(n); }
+            void clear() { x.clear(); y.clear(); }
+            void push_back(const double _x, const double _y) {
+                x.push_back(_x);
+                y.push_back(_y);
+            }
+        };
+
+#if defined(SVG_USE_AVX) || defined(SVG_USE_SSE2)
+        /** @namespace simd
+         *  @brief Thin wrappers over the vector instructions used by the kernels below
+         */
+        namespace simd {
+#if defined(SVG_USE_AVX)
+            using Vec = __m256d;
+            const size_t LANES {4};
+            inline Vec load(const double* p) { return _mm256_loadu_pd(p); }
+            inline void store(double* p, Vec a) { _mm256_storeu_pd(p, a); }
+            inline Vec set1(const double a) { return _mm256_set1_pd(a); }
+            inline Vec add(Vec a, Vec b) { return _mm256_add_pd(a, b); }
+            inline Vec sub(Vec a, Vec b) { return _mm256_sub_pd(a, b); }
+            inline Vec mul(Vec a, Vec b) { return _mm256_mul_pd(a, b); }
+            inline Vec min(Vec a, Vec b) { return _mm256_min_pd(a, b); }
+            inline Vec max(Vec a, Vec b) { return _mm256_max_pd(a, b); }
+            inline Vec greater(Vec a, Vec b) { return _mm256_cmp_pd(a, b, _CMP_GT_OQ); }
+            inline Vec both(Vec a, Vec b) { return _mm256_and_pd(a, b); }
+            inline Vec either(Vec a, Vec b) { return _mm256_or_pd(a, b); }
+            inline int mask(Vec a) { return _mm256_movemask_pd(a); }
+            inline void truncate(int32_t* p, Vec a) { _mm_storeu_si128((__m128i*)p, _mm256_cvttpd_epi32(a)); }
+#else
+            using Vec = __m128d;
+            const size_t LANES {2};
+            inline Vec load(const double* p) { return _mm_loadu_pd(p); }
+            inline void store(double* p, Vec a) { _mm_storeu_pd(p, a); }
+            inline Vec set1(const double a) { return _mm_set1_pd(a); }
+            inline Vec add(Vec a, Vec b) { return _mm_add_pd(a, b); }
+            inline Vec sub(Vec a, Vec b) { return _mm_sub_pd(a, b); }
+            inline Vec mul(Vec a, Vec b) { return _mm_mul_pd(a, b); }
+            inline Vec min(Vec a, Vec b) { return _mm_min_pd(a, b); }
+            inline Vec max(Vec a, Vec b) { return _mm_max_pd(a, b); }
+            inline Vec greater(Vec a, Vec b) { return _mm_cmpgt_pd(a, b); }
+            inline Vec both(Vec a, Vec b) { return _mm_and_pd(a, b); }
+            inline Vec either(Vec a, Vec b) { return _mm_or_pd(a, b); }
+            inline int mask(Vec a) { return _mm_movemask_pd(a); }
+            inline void truncate(int32_t* p, Vec a) { _mm_storel_epi64((__m128i*)p, _mm_cvttpd_epi32(a)); }
+#endif
+        }
+#endif
+
+        template<bool diagonals>
+        inline void minmax_kernel(const double* xs, const double* ys, const size_t n,
+            double (&lo)[4], double (&hi)[4]) {
+            /** Compute the smallest and largest values of x, y and (if requested)
+             *  x + y and y - x over n > 0 points stored as two flat arrays
+             *
+             *  @param[out] lo Minimums in the order x, y, x + y, y - x
+             *  @param[out] hi Maximums in the same order
+             */
+            lo[0] = hi[0] = xs[0]; lo[1] = hi[1] = ys[0];
+            lo[2] = hi[2] = xs[0] + ys[0]; lo[3] = hi[3] = ys[0] - xs[0];
+            size_t i {0};
+
+#if defined(SVG_USE_AVX) || defined(SVG_USE_SSE2)
+            using namespace simd;
+            if (n >= LANES) {
+                Vec x = load(xs), y = load(ys);
+                Vec v_lo[4] = { x, y, add(x, y), sub(y, x) },
+                    v_hi[4] = { x, y, v_lo[2], v_lo[3] };
+
+                for (i = LANES; i + LANES <= n; i += LANES) {
+                    x = load(xs + i);
+                    y = load(ys + i);
+                    v_lo[0] = min(v_lo[0], x); v_hi[0] = max(v_hi[0], x);
+                    v_lo[1] = min(v_lo[1], y); v_hi[1] = max(v_hi[1], y);
+                    if (diagonals) {
+                        const Vec sum = add(x, y), diff = sub(y, x);
+                        v_lo[2] = min(v_lo[2], sum); v_hi[2] = max(v_hi[2], sum);
+                        v_lo[3] = min(v_lo[3], diff); v_hi[3] = max(v_hi[3], diff);
+                    }
+                }
+
+                // Reduce lanes
+                double buf[LANES];
+                for (int k {0}; k < (diagonals ? 4 : 2); k++) {
+                    store(buf, v_lo[k]);
+                    for (size_t j {0}; j < LANES; j++) lo[k] = std::min(lo[k], buf[j]);
+                    store(buf, v_hi[k]);
+                    for (size_t j {0}; j < LANES; j++) hi[k] = std::max(hi[k], buf[j]);
+                }
+            }
+#endif
+
+            // Remaining points (or all of them without SIMD support)
+            for (; i < n; i++) {
+                lo[0] = std::min(lo[0], xs[i]); hi[0] = std::max(hi[0], xs[i]);
+                lo[1] = std::min(lo[1], ys[i]); hi[1] = std::max(hi[1], ys[i]);
+                if (diagonals) {
+                    lo[2] = std::min(lo[2], xs[i] + ys[i]); hi[2] = std::max(hi[2], xs[i] + ys[i]);
+                    lo[3] = std::min(lo[3], ys[i] - xs[i]); hi[3] = std::max(hi[3], ys[i] - xs[i]);
+                }
+            }
+        }
+
+        inline QuadCoord extents(const double* xs, const double* ys, const size_t n) {
+            /** Return the smallest and largest coordinates of n points
+             *  stored as two flat arrays, as { min x, max x, min y, max y }
+             */
+            if (!n) return { NAN, NAN, NAN, NAN };
+
+            double lo[4], hi[4];
+            minmax_kernel<false>(xs, ys, n, lo, hi);
+            return { lo[0], hi[0], lo[1], hi[1] };
+        }
+
+        inline void extreme_points(const double* xs, const double* ys, const size_t n, size_t (&ext)[8]) {
+            /** Find the indices of the leftmost, bottom left, bottommost, bottom right,
+             *  rightmost, top right, topmost and top left points (in that order) among
+             *  n > 0 points stored as two flat arrays
+             *
+             *  The points are scanned in chunks with the min/max kernel, and only the
+             *  chunks holding an extreme value are searched again for its index.
+             */
+            const size_t CHUNK_SIZE {4096};
+            const int order[4] = { 0, 2, 1, 3 }; // Kernel order --> counterclockwise order
+            double lo[4], hi[4];
+            size_t lo_chunk[4] = { 0 }, hi_chunk[4] = { 0 };
+            minmax_kernel<true>(xs, ys, std::min(n, CHUNK_SIZE), lo, hi);
+
+            for (size_t start {CHUNK_SIZE}; start < n; start += CHUNK_SIZE) {
+                double chunk_lo[4], chunk_hi[4];
+                minmax_kernel<true>(xs + start, ys + start, std::min(n - start, CHUNK_SIZE), chunk_lo, chunk_hi);
+                for (int k {0}; k < 4; k++) {
+                    if (chunk_lo[k] < lo[k]) { lo[k] = chunk_lo[k]; lo_chunk[k] = start; }
+                    if (chunk_hi[k] > hi[k]) { hi[k] = chunk_hi[k]; hi_chunk[k] = start; }
+                }
+            }
+
+            auto value = [xs, ys](const int k, const size_t i) {
+                const double values[4] = { xs[i], ys[i], xs[i] + ys[i], ys[i] - xs[i] };
+                return values[k];
+            };
+
+            for (int k {0}; k < 4; k++) {
+                size_t i = lo_chunk[k];
+                while (value(k, i) != lo[k]) i++;
+                ext[order[k]] = i;
+
+                i = hi_chunk[k];
+                while (value(k, i) != hi[k]) i++;
+                ext[order[k] + 4] = i;
+            }
+        }
+
+        inline void discard_interior(PointBuffer& points) {
+            /** Remove points which lie strictly inside the octagon spanned by the
+             *  extreme points in the x, y and diagonal directions, since they
+             *  can never be part of the convex hull (Akl-Toussaint heuristic)
+             */
+            const size_t n = points.size();
+            if (n < 16) return;
+
+            double *xs = points.x.data(), *ys = points.y.data();
+            size_t ext[8];
+            extreme_points(xs, ys, n, ext);
+
+            double qx[8], qy[8], dx[8], dy[8];
+            for (int e {0}; e < 8; e++) {
+                qx[e] = xs[ext[e]];
+                qy[e] = ys[ext[e]];
+            }
+            for (int e {0}; e < 8; e++) {
+                dx[e] = qx[(e + 1) % 8] - qx[e];
+                dy[e] = qy[(e + 1) % 8] - qy[e];
+            }
+
+            // A point is inside if it is strictly to the left of every edge
+            auto inside_octagon = [&](const double x, const double y, const bool closed) {
+                bool inside = true;
+                for (int e {0}; e < 8; e++) {
+                    const double side = dx[e] * (y - qy[e]) - dy[e] * (x - qx[e]);
+                    inside &= closed ? side >= 0 : side > 0;
+                }
+                return inside;
+            };
+
+            // Most points can be discarded by testing them against a rectangle
+            // contained in the octagon first
+            double rx1 = std::max(qx[1], qx[7]), rx2 = std::min(qx[3], qx[5]),
+                ry1 = std::max(qy[1], qy[3]), ry2 = std::min(qy[5], qy[7]);
+            if (!(inside_octagon(rx1, ry1, true) && inside_octagon(rx2, ry1, true) &&
+                inside_octagon(rx1, ry2, true) && inside_octagon(rx2, ry2, true)))
+                rx1 = rx2 = ry1 = ry2 = 0; // Empty rectangle
+
+            size_t kept {0}, i {0};
+#if defined(SVG_USE_AVX) || defined(SVG_USE_SSE2)
+            using namespace simd;
+            const int all_inside = (1 << LANES) - 1;
+            const Vec v_rx1 = set1(rx1), v_rx2 = set1(rx2), v_ry1 = set1(ry1), v_ry2 = set1(ry2);
+            Vec v_qx[8], v_qy[8], v_dx[8], v_dy[8];
+            for (int e {0}; e < 8; e++) {
+                v_qx[e] = set1(qx[e]); v_qy[e] = set1(qy[e]);
+                v_dx[e] = set1(dx[e]); v_dy[e] = set1(dy[e]);
+            }
+
+            double bx[LANES], by[LANES];
+            for (; i + LANES <= n; i += LANES) {
+                Vec x = load(xs + i), y = load(ys + i);
+                const Vec in_rect = both(both(greater(x, v_rx1), greater(v_rx2, x)),
+                    both(greater(y, v_ry1), greater(v_ry2, y)));
+
+                int m = mask(in_rect);
+                if (m == all_inside) continue;
+
+                Vec in_octagon = greater(set1(1), set1(0));
+                for (int e {0}; e < 8; e++) {
+                    Vec side = sub(mul(v_dx[e], sub(y, v_qy[e])), mul(v_dy[e], sub(x, v_qx[e])));
+                    in_octagon = both(in_octagon, greater(side, set1(0)));
+                }
+
+                m = mask(either(in_rect, in_octagon));
+                if (m == all_inside) continue;
+
+                store(bx, x);
+                store(by, y);
+                for (size_t j {0}; j < LANES; j++) {
+                    if (m & (1 << j)) continue;
+                    xs[kept] = bx[j];
+                    ys[kept] = by[j];
+                    kept++;
+                }
+            }
+#endif
+            for (; i < n; i++) {
+                const bool inside = (xs[i] > rx1 && xs[i] < rx2 && ys[i] > ry1 && ys[i] < ry2) ||
+                    inside_octagon(xs[i], ys[i], false);
+
+                xs[kept] = xs[i];
+                ys[kept] = ys[i];
+                kept += !inside;
+            }
+
+            points.x.resize(kept);
+            points.y.resize(kept);
+        }
+
+        inline std::vector<Point> convex_hull(PointBuffer& points) {
+            /** Compute the convex hull of a flat set of points via Andrew's
+             *  monotone chain algorithm, after discarding points that cannot be on it
+             *
+             *  The hull starts at the leftmost point and has the same orientation as
+             *  the hull returned by convex_hull(std::vector<Point>&). The buffer is
+             *  modified in the process.
+             */
+            discard_interior(points);
+
+            std::vector<Point> sorted;
+            sorted.reserve(points.size());
+            for (size_t i {0}; i < points.size(); i++)
+                sorted.push_back(Point(points.x[i], points.y[i]));
+
+            std::sort(sorted.begin(), sorted.end());
+            sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+            if (sorted.size() < 3) return {}; // Need at least three points
+
+            auto cross = [](const Point& o, const Point& a, const Point& b) {
+                return (a.first - o.first) * (b.second - o.second) -
+                    (a.second - o.second) * (b.first - o.first);
+            };
+
+            // Lower hull followed by upper hull
+            std::vector<Point> chain(2 * sorted.size());
+            size_t k {0};
+            for (size_t i {0}; i < sorted.size(); i++) {
+                while (k >= 2 && cross(chain[k - 2], chain[k - 1], sorted[i]) <= 0) k--;
+                chain[k++] = sorted[i];
+            }
+            for (size_t i = sorted.size() - 1, lower = k + 1; i > 0; i--) {
+                while (k >= lower && cross(chain[k - 2], chain[k - 1], sorted[i - 1]) <= 0) k--;
+                chain[k++] = sorted[i - 1];
+            }
+            chain.resize(k - 1); // Last point is the first one again
+            if (chain.size() < 3) return {}; // All points are colinear
+
+            // Traverse in the opposite direction, starting from the leftmost point
+            std::reverse(chain.begin() + 1, chain.end());
+            return chain;
+        }
+
+        /** @class IncrementalHull
+         *  @brief A convex hull which can be grown one point (or batch) at a time
+         *
+         *  The upper and lower chains are kept in ordered maps keyed by x, so
+         *  adding k points to a hull of n points takes O(k log n) amortized time.
+         */
+        class IncrementalHull {
+        public:
+            bool insert(const double x, const double y) {
+                /** Add a point, returning whether the hull changed */
+                const bool upper_changed = insert(this->upper, x, y),
+                    lower_changed = insert(this->lower, x, -y);
+                return upper_changed || lower_changed;
+            }
+
+            bool insert(PointBuffer& points) {
+                /** Add a batch of points, returning whether the hull changed
+                 *  (the buffer is modified in the process)
+                 */
+                discard_interior(points); // Can't be on the hull of the batch either
+                bool changed = false;
+                for (size_t i {0}; i < points.size(); i++)
+                    changed |= this->insert(points.x[i], points.y[i]);
+                return changed;
+            }
+
+            std::vector<Point> points() const {
+                /** Return the vertices of the hull, starting from the leftmost point
+                 *  with the same orientation as convex_hull()
+                 */
+                std::vector<Point> ret;
+                if (this->lower.empty()) return ret;
+
+                // Counterclockwise: lower chain left to right, then upper chain back
+                for (auto& pt : this->lower) ret.push_back(Point(pt.first, -pt.second));
+                for (auto it = this->upper.rbegin(); it != this->upper.rend(); ++it)
+                    if (ret.back() != Point(*it)) ret.push_back(*it);
+                if (ret.size() > 1 && ret.back() == ret.front()) ret.pop_back();
+                if (ret.size() < 3) return {}; // All points are colinear
+
+                std::reverse(ret.begin() + 1, ret.end());
+                return ret;
+            }
+
+        private:
+            std::map<double, double> upper; /**< Upper chain (x --> y) */
+            std::map<double, double> lower; /**< Lower chain, stored as an upper chain of (x, -y) */
+
+            static double cross(const Point& o, const Point& a, const Point& b) {
+                return (a.first - o.first) * (b.second - o.second) -
+                    (a.second - o.second) * (b.first - o.first);
+            }
+
+            static bool insert(std::map<double, double>& chain, const double x, const double y) {
+                /** Insert a point into an upper chain unless it lies on or below it */
+                const Point pt(x, y);
+                auto it = chain.lower_bound(x);
+                if (it != chain.end() && it->first == x) {
+                    if (it->second >= y) return false;
+                    it->second = y;
+                }
+                else {
+                    if (it != chain.end() && it != chain.begin() &&
+                        cross(*std::prev(it), *it, pt) <= 0) return false;
+                    it = chain.insert(it, pt);
+                }
+
+                // Remove neighbors which are no longer convex
+                while (it != chain.begin() && std::prev(it) != chain.begin()) {
+                    auto prev = std::prev(it);
+                    if (cross(*std::prev(prev), *prev, pt) < 0) break;
+                    chain.erase(prev);
+                }
+                while (std::next(it) != chain.end() && std::next(it, 2) != chain.end()) {
+                    auto next = std::next(it);
+                    if (cross(pt, *next, *std::next(next)) < 0) break;
+                    chain.erase(next);
+                }
+
+                return true;
+            }
+        };
+
+        inline uint64_t hilbert_index(uint32_t x, uint32_t y, const int order=16) {
+            /** Return the distance along a Hilbert curve filling a 2^order by 2^order
+             *  grid of the cell (x, y)
+             *
+             *  Ref: https://en.wikipedia.org/wiki/Hilbert_curve
+             */
+            const uint32_t n = 1u << order;
+            uint64_t d {0};
+            for (uint32_t s = n / 2; s > 0; s /= 2) {
+                const uint32_t rx = (x & s) > 0, ry = (y & s) > 0;
+                d += (uint64_t)s * s * ((3 * rx) ^ ry);
+
+                // Rotate quadrant
+                if (ry == 0) {
+                    if (rx == 1) {
+                        x = n - 1 - x;
+                        y = n - 1 - y;
+                    }
+                    std::swap(x, y);
+                }
+            }
+
+            return d;
+        }
+
+        template<typename Iter, typename Compare>
+        inline void parallel_sort(Iter begin, Iter end, Compare comp, const size_t min_chunk=1 << 16) {
+            /** Sort a range by sorting chunks of at least min_chunk items on
+             *  separate threads, and then merging them pairwise
+             */
+            const size_t n = (size_t)(end - begin);
+            const size_t chunks = std::min((size_t)std::max(1u, std::thread::hardware_concurrency()),
+                n / std::max((size_t)1, min_chunk));
+            if (chunks <= 1) {
+                std::sort(begin, end, comp);
+                return;
+            }
+
+            std::vector<Iter> bounds;
+            for (size_t i {0}; i < chunks; i++) bounds.push_back(begin + n * i / chunks);
+            bounds.push_back(end);
+
+            std::vector<std::thread> workers;
+            for (size_t i {0}; i < chunks; i++)
+                workers.emplace_back([&bounds, &comp, i]() { std::sort(bounds[i], bounds[i + 1], comp); });
+            for (auto& worker : workers) worker.join();
+
+            for (size_t width {1}; width < chunks; width *= 2) {
+                workers.clear();
+                for (size_t i {0}; i + width < chunks; i += 2 * width) {
+                    Iter lo = bounds[i], mid = bounds[i + width], hi = bounds[std::min(i + 2 * width, chunks)];
+                    workers.emplace_back([lo, mid, hi, &comp]() { std::inplace_merge(lo, mid, hi, comp); });
+                }
+                for (auto& worker : workers) worker.join();
+            }
+        }
+
+        inline bool any_overlap(std::vector<QuadCoord> boxes) {
+            /** Determine if the interiors of any two boxes intersect, using a sweep
+             *  line over x with the active boxes ordered by their top edge
+             *  (boxes which only touch do not overlap)
+             */
+            struct Event {
+                double x;
+                int type; // 0: close, 1: open, 2: close a box without width
+                size_t box;
+                bool operator<(const Event& other) const {
+                    return x < other.x || (x == other.x && type < other.type);
+                }
+            };
+
+            std::vector<Event> events;
+            events.reserve(2 * boxes.size());
+            for (size_t i {0}; i < boxes.size(); i++) {
+                auto& box = boxes[i];
+                if (box.x1 > box.x2) std::swap(box.x1, box.x2);
+                if (box.y1 > box.y2) std::swap(box.y1, box.y2);
+                events.push_back({ box.x1, 1, i });
+                events.push_back({ box.x2, box.x1 < box.x2 ? 0 : 2, i });
+            }
+            std::sort(events.begin(), events.end());
+
+            // Active boxes are pairwise disjoint in y, so only neighbors need checking
+            std::set<std::pair<double, size_t>> active;
+            for (auto& event : events) {
+                const QuadCoord& box = boxes[event.box];
+                if (event.type != 1) {
+                    active.erase({ box.y1, event.box });
+                    continue;
+                }
+
+                auto it = active.insert({ box.y1, event.box }).first;
+                if (it != active.begin() && boxes[std::prev(it)->second].y2 > box.y1) return true;
+                if (std::next(it) != active.end() && std::next(it)->first < box.y2) return true;
+            }
+
+            return false;
+        }
+
+        inline void append_varint(std::string& out, uint64_t value) {
+            /** Append an unsigned integer using 7 bits per byte */
+            while (value >= 0x80) {
+                out += (char)((value & 0x7F) | 0x80);
+                value >>= 7;
+            }
+            out += (char)value;
+        }
+
+        inline uint64_t read_varint(const char*& p) {
+            /** Read an integer written by append_varint() and advance p past it */
+            uint64_t value {0};
+            for (int shift {0}; ; shift += 7) {
+                const uint8_t byte = (uint8_t)*p++;
+                value |= (uint64_t)(byte & 0x7F) << shift;
+                if (!(byte & 0x80)) return value;
+            }
+        }
+
+        inline void append_int(std::string& out, const long long value) {
+            /** Append the decimal representation of an integer to a string,
+             *  two digits at a time
+             */
+            static const char pairs[] =
+                "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+                "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+                "8081828384858687888990919293949596979899";
+
+            char buf[24];
+            char *end = buf + sizeof(buf), *p = end;
+            unsigned long long v = value < 0 ? 0ULL - (unsigned long long)value : (unsigned long long)value;
+            while (v >= 100) {
+                const size_t i = (size_t)(v % 100) * 2;
+                v /= 100;
+                *--p = pairs[i + 1];
+                *--p = pairs[i];
+            }
+            if (v >= 10) {
+                *--p = pairs[v * 2 + 1];
+                *--p = pairs[v * 2];
+            }
+            else *--p = (char)('0' + v);
+
+            if (value < 0) *--p = '-';
+            out.append(p, end);
+        }
+
+        inline void append_fixed(std::string& out, const double value) {
+            /** Append a number with two decimal places to a string, formatting it
+             *  on the stack rather than through a temporary string or stream
+             */
+            char buf[32];
+            const int length = std::snprintf(buf, sizeof(buf), "%.2f", value);
+            if (length >= (int)sizeof(buf)) {
+                // Very large magnitudes
+                std::string wide(length + 1, '\0');
+                std::snprintf(&wide[0], wide.size(), "%.2f", value);
+                out.append(wide, 0, length);
+            }
+            else out.append(buf, length);
+        }
+
+        inline bool eight_digits(const char* p) {
+            /** Return whether the 8 characters at p are all digits, testing them at once */
+            uint64_t v;
+            std::memcpy(&v, p, 8);
+            return (((v & 0xF0F0F0F0F0F0F0F0) | (((v + 0x0606060606060606) & 0xF0F0F0F0F0F0F0F0) >> 4))
+                == 0x3333333333333333);
+        }
+
+        inline uint32_t parse_eight_digits(const char* p) {
+            /** Convert 8 digits to an integer with three multiplications, combining
+             *  neighbouring digits, then pairs, then quadruples (little-endian only)
+             */
+            uint64_t v;
+            std::memcpy(&v, p, 8);
+            v = ((v & 0x0F0F0F0F0F0F0F0F) * 2561) >> 8;
+            v = ((v & 0x00FF00FF00FF00FF) * 6553601) >> 16;
+            return (uint32_t)(((v & 0x0000FFFF0000FFFF) * 42949672960001) >> 32);
+        }
+
+        inline const char* parse_number(const char* p, const char* end, double& value) {
+            /** Parse a decimal number such as "-12.5e3" at p, returning the position
+             *  after it, or nullptr if there isn't one
+             *
+             *  Numbers with up to 19 significant digits and small exponents are
+             *  converted exactly from an integer mantissa, reading 8 digits at a
+             *  time where possible. Others are left to strtod().
+             */
+            static const double powers[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+            const char* start = p;
+            const bool negative = (p < end && *p == '-');
+            if (p < end && (*p == '-' || *p == '+')) p++;
+
+            uint64_t mantissa {0};
+            int digits {0}, exponent {0};
+            auto read_digits = [&p, end, &mantissa, &digits]() {
+                const char* first = p;
+#if !defined(__BYTE_ORDER__) || __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+                while (end - p >= 8 && digits <= 11 && eight_digits(p)) {
+                    mantissa = mantissa * 100000000 + parse_eight_digits(p);
+                    digits += 8;
+                    p += 8;
+                }
+#endif
+                for (; p < end && isdigit((unsigned char)*p); p++, digits++)
+                    mantissa = mantissa * 10 + (uint64_t)(*p - '0');
+                return p - first;
+            };
+
+            ptrdiff_t count = read_digits();
+            if (p < end && *p == '.') {
+                p++;
+                const ptrdiff_t fraction = read_digits();
+                exponent -= (int)fraction;
+                count += fraction;
+            }
+            if (!count) return nullptr;
+
+            if (p < end && (*p == 'e' || *p == 'E')) {
+                const char* q = p + 1;
+                const bool negative_exp = (q < end && *q == '-');
+                if (q < end && (*q == '-' || *q == '+')) q++;
+                if (q < end && isdigit((unsigned char)*q)) {
+                    int exp {0};
+                    for (; q < end && isdigit((unsigned char)*q); q++)
+                        exp = std::min(exp * 10 + (*q - '0'), 100000);
+                    exponent += negative_exp ? -exp : exp;
+                    p = q;
+                }
+            }
+
+            if (digits <= 19 && mantissa <= (1ULL << 53) && exponent >= -22 && exponent <= 22) {
+                value = (double)mantissa;
+                value = exponent < 0 ? value / powers[-exponent] : value * powers[exponent];
+                if (negative) value = -value;
+                return p;
+            }
+
+            // Too many digits or too large an exponent to convert exactly
+            char buf[64];
+            std::string wide;
+            const char* text = buf;
+            if (p - start < (ptrdiff_t)sizeof(buf)) {
+                std::memcpy(buf, start, p - start);
+                buf[p - start] = '\0';
+            }
+            else text = (wide = std::string(start, p)).c_str();
+            value = std::strtod(text, nullptr);
+            return p;
+        }
+
+        inline void append_color(std::string& out, const uint32_t rgba) {
+            /** Append the red, green and blue of a packed color as "#rrggbb",
+             *  looking up two hex digits per byte
+             */
+            static const char hex[] =
+                "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f"
+                "202122232425262728292a2b2c2d2e2f303132333435363738393a3b3c3d3e3f"
+                "404142434445464748494a4b4c4d4e4f505152535455565758595a5b5c5d5e5f"
+                "606162636465666768696a6b6c6d6e6f707172737475767778797a7b7c7d7e7f"
+                "808182838485868788898a8b8c8d8e8f909192939495969798999a9b9c9d9e9f"
+                "a0a1a2a3a4a5a6a7a8a9aaabacadaeafb0b1b2b3b4b5b6b7b8b9babbbcbdbebf"
+                "c0c1c2c3c4c5c6c7c8c9cacbcccdcecfd0d1d2d3d4d5d6d7d8d9dadbdcdddedf"
+                "e0e1e2e3e4e5e6e7e8e9eaebecedeeeff0f1f2f3f4f5f6f7f8f9fafbfcfdfeff";
+            char buf[7] = { '#' };
+            for (int i {0}; i < 3; i++)
+                std::memcpy(buf + 1 + 2 * i, hex + 2 * ((rgba >> (24 - 8 * i)) & 0xff), 2);
+            out.append(buf, 7);
+        }
+
+        inline void append_short(std::string& out, const double value) {
+            /** Append a number with two decimal places at most and without trailing zeros */
+            const double hundredths = std::round(value * 100);
+            const bool negative = (hundredths < 0);
+            if (!(std::fabs(hundredths) < 1e15)) {
+                // Too large to format via integers
+                append_fixed(out, value);
+                while (out.back() == '0') out.pop_back();
+                if (out.back() == '.') out.pop_back();
+                return;
+            }
+
+            long long n = (long long)std::fabs(hundredths);
+            if (negative) out += '-';
+            append_int(out, n / 100);
+            if (n % 100) {
+                out += '.';
+                out += (char)('0' + n % 100 / 10);
+                if (n % 10) out += (char)('0' + n % 10);
+            }
+        }
+
+        inline void append_compact(std::string& out, const double value) {
+            /** Append a number as path data, separated from a preceding number only if needed */
+            if (!out.empty() && !isalpha((unsigned char)out.back()) && !(std::round(value * 100) < 0)) out += ' ';
+            append_short(out, value);
+        }
+
+        inline void append_fixed(std::string& out, const Point& point) {
+            /** Append a point as "x,y" */
+            append_fixed(out, point.first);
+            out += ',';
+            append_fixed(out, point.second);
+        }
+
+        template<typename Predicate>
+        inline std::string quantize_numbers(const std::string& value, const double scale, Predicate scaled) {
+            /** Multiply the numbers in a string by scale and round them to integers,
+             *  leaving everything else (separators, units, commands) untouched
+             *
+             *  @param[in] scaled Called with the word preceding a number (e.g. a path
+             *                    command or transform function) and the position of the
+             *                    number after that word; numbers for which it returns
+             *                    false are copied as is
+             */
+            std::string ret, word;
+            ret.reserve(value.size());
+            size_t index {0};
+            bool in_word = false;
+
+            for (const char *p = value.c_str(); *p; ) {
+                const bool number_start = isdigit(*p) || (*p == '.' && isdigit(p[1])) ||
+                    ((*p == '-' || *p == '+') && (isdigit(p[1]) || (p[1] == '.' && isdigit(p[2]))));
+
+                if (number_start) {
+                    char* end;
+                    const double number = std::strtod(p, &end);
+                    if (scaled(word, index++)) append_int(ret, std::llround(number * scale));
+                    else ret.append(p, (size_t)(end - p));
+                    p = end;
+                    in_word = false;
+                    continue;
+                }
+
+                if (isalpha(*p)) {
+                    if (!in_word) {
+                        word.clear();
+                        index = 0;
+                    }
+                    word += *p;
+                    in_word = true;
+                }
+                else in_word = false;
+
+                ret += *p++;
+            }
+
+            return ret;
+        }
+
+        template<typename Include>
+        inline bool path_points(const std::string& d, Include include) {
+            /** Call include(x, y) with the absolute position of every end and
+             *  control point in path data (only end points for arcs)
+             *
+             *  @returns false if the data is malformed, after reporting the points before the error
+             */
+            static const std::string commands = "MLHVCSQTA", arguments = "221164427";
+            double x {0}, y {0}, start_x {0}, start_y {0}, args[7];
+            char cmd {0};
+
+            for (const char* p = d.c_str(); ; ) {
+                while (isspace((unsigned char)*p) || *p == ',') p++;
+                if (!*p) return true;
+                if (isalpha((unsigned char)*p)) {
+                    cmd = *p++;
+                    if (cmd == 'Z' || cmd == 'z') {
+                        x = start_x;
+                        y = start_y;
+                        cmd = 0; // Numbers can't follow
+                        continue;
+                    }
+                }
+                const size_t kind = commands.find((char)toupper(cmd));
+                if (!cmd || kind == std::string::npos) return false;
+
+                // Read one set of arguments, since commands may be repeated implicitly
+                const size_t count = (size_t)(arguments[kind] - '0');
+                for (size_t i {0}; i < count; i++) {
+                    while (isspace((unsigned char)*p) || *p == ',') p++;
+                    if (kind == 8 && (i == 3 || i == 4)) {
+                        // Arc flags need no separator, e.g. "a1 1 0 011 1"
+                        if (*p != '0' && *p != '1') return false;
+                        args[i] = *p++ - '0';
+                        continue;
+                    }
+                    char* end;
+                    args[i] = std::strtod(p, &end);
+                    if (end == p) return false;
+                    p = end;
+                }
+
+                const bool relative = islower((unsigned char)cmd);
+                const double dx = relative ? x : 0, dy = relative ? y : 0;
+                if (cmd == 'H' || cmd == 'h') x = dx + args[0];
+                else if (cmd == 'V' || cmd == 'v') y = dy + args[0];
+                else {
+                    for (size_t i {0}; kind != 8 && i + 2 < count; i += 2) include(dx + args[i], dy + args[i + 1]);
+                    x = dx + args[count - 2];
+                    y = dy + args[count - 1];
+                }
+                include(x, y);
+
+                if (kind == 0) {
+                    start_x = x;
+                    start_y = y;
+                    cmd = relative ? 'l' : 'L'; // Further pairs are lines
+                }
+            }
+        }
+
+        inline bool identity_transform(const std::string& value) {
+            /** Return whether a transform list has no effect, e.g. "" or "rotate(0, 5, 5)" */
+            const char* p = value.c_str();
+            while (true) {
+                while (isspace((unsigned char)*p) || *p == ',') p++;
+                if (!*p) return true;
+
+                const char* name = p;
+                while (isalpha((unsigned char)*p)) p++;
+                const std::string func(name, p);
+                while (isspace((unsigned char)*p)) p++;
+                if (func.empty() || *p++ != '(') return false;
+
+                std::vector<double> args;
+                while (true) {
+                    while (isspace((unsigned char)*p) || *p == ',') p++;
+                    if (*p == ')') break;
+                    char* end;
+                    args.push_back(std::strtod(p, &end));
+                    if (end == p) return false;
+                    p = end;
+                }
+                p++;
+                if (args.empty()) return false;
+
+                if (func == "translate") {
+                    for (const double arg : args) if (arg != 0) return false;
+                }
+                else if (func == "scale") {
+                    for (const double arg : args) if (arg != 1) return false;
+                }
+                else if (func == "rotate" || func == "skewX" || func == "skewY") {
+                    if (args[0] != 0) return false;
+                }
+                else if (func == "matrix") {
+                    if (args != std::vector<double>{ 1, 0, 0, 1, 0, 0 }) return false;
+                }
+                else return false;
+            }
+        }
+
         inline std::vector<Point> polar_points(int n, int a, int b, double radius) {
             /** Return n equidistant points (oriented counterclockwise) located on
              *  the perimeter of a circle of radius r centered at (a, b)  
@@ -155,16 +1062,24 @@ namespace SVG {
     }
 
     inline std::string to_string(const double& value) {
-        /** Trim off all but one decimal place when converting a double to string */
-        std::stringstream ss;
-        ss << std::fixed << std::setprecision(2);
-        ss << value;
-        return ss.str();
+        /** Trim off all but two decimal places when converting a double to string */
+        std::string ret;
+        util::append_fixed(ret, value);
+        return ret;
+    }
+
+    inline std::string to_string(const Color& color) {
+        /** Return a color as "#rrggbb", without its alpha */
+        std::string ret;
+        util::append_color(ret, color.rgba);
+        return ret;
     }
 
     inline std::string to_string(const Point& point) {
         /** Return a string representation of a point as "x,y" */
-        return to_string(point.first) + "," + to_string(point.second);
+        std::string ret;
+        util::append_fixed(ret, point);
+        return ret;
     }
 
     /** @class AttributeMap
@@ -174,11 +1089,18 @@ namespace SVG {
     public:
         struct AttrSetter {
             AttrSetter(SVGAttrib::mapped_type& _attr) : attr(_attr) {};
+            AttrSetter(AttributeMap& _owner, SVGAttrib::iterator it) :
+                attr(it->second), owner(&_owner), key(&(it->first)) {};
             SVGAttrib::mapped_type& attr;
+            AttributeMap* owner {nullptr}; /**< Notified of appends, if set */
+            const std::string* key {nullptr};
 
             template<typename T>
             AttrSetter& operator<<(T value) {
-                attr += to_string(value);
+                /** Append a number (or point) to the attribute in place */
+                const size_t old_size = this->attr.size();
+                util::append_fixed(attr, value);
+                if (this->owner && this->owner->watched) this->owner->attr_appended(*this->key, old_size);
                 return *this;
             }
         };
@@ -187,44 +1109,289 @@ namespace SVG {
         AttributeMap(SVGAttrib _attr) : attr(_attr) {};
         SVGAttrib attr;
 
-        template<typename T>
-        AttributeMap& set_attr(const std::string key, T value) {
-            this->attr[key] = to_string(value);
-            return *this;
+        bool operator==(const AttributeMap& other) const { return this->attr == other.attr; }
+        bool operator!=(const AttributeMap& other) const { return this->attr != other.attr; }
+
+        template<typename Key, typename T>
+        AttributeMap& set_attr(const Key& key, T value) {
+            /** Modify the attribute specified by key */
+            return this->update_attr(key, [&value](std::string& current) { current = to_string(value); });
+        }
+
+        template<typename Key>
+        AttributeMap& set_attr(const Key& key, const char* value) {
+            /** Modify the attribute specified by key, reusing its storage */
+            return this->update_attr(key, [value](std::string& current) { current.assign(value); });
+        }
+
+        template<typename Key>
+        AttributeMap& set_attr(const Key& key, const std::string& value) {
+            /** Modify the attribute specified by key, reusing its storage */
+            return this->update_attr(key, [&value](std::string& current) { current.assign(value); });
+        }
+
+        template<typename Key>
+        AttributeMap& set_attr(const Key& key, const Color value) {
+            /** Set a color, reusing the attribute's storage
+             *
+             *  For fill, stroke, stop-color and flood-color the matching opacity
+             *  attribute is also set, or removed if the color is opaque.
+             */
+            this->update_attr(key, [value](std::string& current) {
+                current.clear();
+                util::append_color(current, value.rgba);
+            });
+
+            static const std::map<std::string, std::string, std::less<>> opacities = {
+                { "fill", "fill-opacity" }, { "stroke", "stroke-opacity" },
+                { "stop-color", "stop-opacity" }, { "flood-color", "flood-opacity" }
+            };
+            auto opacity = opacities.find(key);
+            if (opacity == opacities.end()) return *this;
+            if (value.alpha() == 255) return this->remove_attr(opacity->second);
+            return this->update_attr(opacity->second, [value](std::string& current) {
+                current.clear();
+                util::append_short(current, value.alpha() / 255.0);
+            });
+        }
+
+        template<typename Key>
+        AttributeMap& set_attr(const Key& key, std::string&& value) {
+            /** Move a value into the attribute specified by key */
+            return this->update_attr(key, [&value](std::string& current) { current = std::move(value); });
         }
 
-        AttrSetter set_attr(const std::string key) {
-            if (this->attr.find(key) == this->attr.end()) this->attr[key] = "";
-            return AttrSetter(this->attr.at(key));
+        template<typename Key>
+        AttrSetter set_attr(const Key& key) {
+            /** Return an object which appends to the attribute specified by key */
+            bool existed {true};
+            auto it = this->attr.find(key);
+            if (it == this->attr.end()) {
+                it = this->attr.emplace_hint(it, std::string(key), std::string());
+                existed = false;
+            }
+
+            if (!existed && this->watched) this->attr_changed(it->first, nullptr);
+            return AttrSetter(*this, it);
         };
+
+        template<typename Key>
+        AttributeMap& remove_attr(const Key& key) {
+            /** Remove the attribute specified by key, if it exists */
+            auto it = this->attr.find(key);
+            if (it == this->attr.end()) return *this;
+            if (this->watched) {
+                const std::string name = it->first, old = std::move(it->second);
+                this->attr.erase(it);
+                this->attr_changed(name, &old);
+            }
+            else this->attr.erase(it);
+            return *this;
+        }
+
+    protected:
+        bool watched {false}; /**< Whether changes are reported through attr_changed() */
+
+        virtual void attr_changed(const std::string&, const std::string*) {} /**< Called after changes with the old value */
+        virtual void attr_appended(const std::string&, const size_t) {} /**< Called after appends with the old length */
+
+        template<typename Key, typename Assign>
+        AttributeMap& update_attr(const Key& key, Assign assign) {
+            /** Set an attribute through assign(), reporting the change if anybody is listening */
+            bool existed {true};
+            auto it = this->attr.find(key);
+            if (it == this->attr.end()) {
+                it = this->attr.emplace_hint(it, std::string(key), std::string());
+                existed = false;
+            }
+
+            if (!this->watched) {
+                assign(it->second);
+                return *this;
+            }
+
+            const std::string old = existed ? it->second : std::string();
+            assign(it->second);
+            this->attr_changed(it->first, existed ? &old : nullptr);
+            return *this;
+        }
+
+        template<typename Key, typename Append>
+        AttributeMap& append_attr(const Key& key, Append append) {
+            /** Extend an attribute through append(), which only costs reporting
+             *  its old length if anybody is listening
+             */
+            auto it = this->attr.find(key);
+            const bool existed = (it != this->attr.end());
+            if (!existed) it = this->attr.emplace_hint(it, std::string(key), std::string());
+
+            const size_t old_size = it->second.size();
+            append(it->second);
+            if (!this->watched) return *this;
+            if (existed) this->attr_appended(it->first, old_size);
+            else this->attr_changed(it->first, nullptr);
+            return *this;
+        }
     };
 
     template<>
     inline AttributeMap::AttrSetter& AttributeMap::AttrSetter::operator<<(const char * value) {
+        const size_t old_size = this->attr.size();
         attr += value;
+        if (this->owner && this->owner->watched) this->owner->attr_appended(*this->key, old_size);
         return *this;
     }
 
-    template<>
-    inline AttributeMap& AttributeMap::set_attr(const std::string key, const double value) {
-        /** Modify the attribute specified by key */
-        this->attr[key] = to_string(value);
-        return *this;
-    }
+    /** @class Keyframes
+     *  @brief The stops of a CSS animation, ordered by their offset in percent
+     */
+    class Keyframes {
+    public:
+        using Stop = std::pair<double, AttributeMap>;
+        using iterator = std::vector<Stop>::iterator;
+        using const_iterator = std::vector<Stop>::const_iterator;
+
+        AttributeMap& operator[](const double offset) {
+            /** Return the properties at the given offset (in percent), adding a stop if necessary */
+            auto it = this->lower_bound(offset);
+            if (it == this->stops.end() || it->first != offset)
+                it = this->stops.insert(it, Stop(offset, AttributeMap()));
+            return it->second;
+        }
 
-    template<>
-    inline AttributeMap& AttributeMap::set_attr(const std::string key, const char * value) {
-        /** Modify the attribute specified by key */
-        this->attr[key] = value;
-        return *this;
-    }
+        AttributeMap& operator[](const std::string& offset) {
+            /** Return the properties at an offset such as "12.5%", "from" or "to" */
+            if (offset == "from") return (*this)[0.0];
+            if (offset == "to") return (*this)[100.0];
+            return (*this)[std::strtod(offset.c_str(), nullptr)];
+        }
 
-    template<>
-    inline AttributeMap& AttributeMap::set_attr(const std::string key, const std::string value) {
-        /** Modify the attribute specified by key */
-        this->attr[key] = value;
-        return *this;
-    }
+        AttributeMap* find(const double offset) {
+            /** Return the properties at the given offset, or nullptr if there is no such stop */
+            auto it = this->lower_bound(offset);
+            return (it != this->stops.end() && it->first == offset) ? &(it->second) : nullptr;
+        }
+
+        static std::string format_offset(const double offset, const int decimals = 4) {
+            /** Format an offset as a percentage without trailing zeros, e.g. "12.5%" */
+            std::string ret((size_t)std::snprintf(nullptr, 0, "%.*f", decimals, offset), '\0');
+            std::snprintf(&ret[0], ret.size() + 1, "%.*f", decimals, offset);
+            if (ret.find('.') != std::string::npos) {
+                ret.erase(ret.find_last_not_of('0') + 1);
+                if (ret.back() == '.') ret.pop_back();
+            }
+            return ret + "%";
+        }
+
+        int decimals() const {
+            /** Return the number of decimals (at least 4) which format_offset()
+             *  needs to tell all stops apart
+             */
+            const int MAX_DECIMALS {40};
+            for (int digits {4}; digits < MAX_DECIMALS; digits++) {
+                bool distinct {true};
+                for (size_t i {1}; i < this->stops.size() && distinct; i++)
+                    distinct = format_offset(this->stops[i - 1].first, digits) != format_offset(this->stops[i].first, digits);
+                if (distinct) return digits;
+            }
+            return MAX_DECIMALS;
+        }
+
+        bool operator==(const Keyframes& other) const { return this->stops == other.stops; }
+        bool operator!=(const Keyframes& other) const { return this->stops != other.stops; }
+
+        iterator begin() { return this->stops.begin(); }
+        iterator end() { return this->stops.end(); }
+        const_iterator begin() const { return this->stops.begin(); }
+        const_iterator end() const { return this->stops.end(); }
+        size_t size() const { return this->stops.size(); }
+        bool empty() const { return this->stops.empty(); }
+
+    protected:
+        std::vector<Stop> stops; /**< Stops sorted by offset */
+
+        iterator lower_bound(const double offset) {
+            return std::lower_bound(this->stops.begin(), this->stops.end(), offset,
+                [](const Stop& stop, const double value) { return stop.first < value; });
+        }
+    };
+
+    /** Kinds of changes to a document reported to the SVGs containing them */
+    enum Mutation {
+        SET_ATTR, INSERT_CHILD, REMOVE_CHILD,
+        APPEND_ATTR /**< Text was added to the end of an attribute */
+    };
+
+    /** @class Handle
+     *  @brief A 32-bit reference to an element in a document's node table
+     *
+     *  The low 24 bits index the table and the high 8 bits hold the slot's
+     *  generation, so handles to destroyed elements are detected instead of
+     *  dangling. Handles are resolved with SVG::resolve().
+     *
+     *  This limits a document to 16,777,216 (2^24) elements with handles at
+     *  once. Each slot can be reused 255 times, after which it is retired
+     *  rather than wrapping its generation around. SVG::handle() throws
+     *  std::length_error once no slot is left.
+     */
+    template<typename T = Element>
+    class Handle {
+    public:
+        Handle() = default;
+        explicit Handle(const uint32_t _bits) : bits(_bits) {};
+
+        template<typename U, typename = typename std::enable_if<std::is_base_of<T, U>::value>::type>
+        Handle(const Handle<U>& other) : bits(other.bits) {}; /**< Allow conversion to handles of base classes */
+
+        uint32_t index() const { return this->bits & 0xFFFFFF; }
+        uint32_t generation() const { return this->bits >> 24; }
+        explicit operator bool() const { return this->bits != 0; }
+        bool operator==(const Handle& other) const { return this->bits == other.bits; }
+        bool operator!=(const Handle& other) const { return this->bits != other.bits; }
+
+        uint32_t bits {0}; /**< Zero for null handles (generations start at 1) */
+    };
+
+    /** @class NodeTable
+     *  @brief Maps handles onto the elements they refer to
+     */
+    class NodeTable {
+    public:
+        NodeTable() = default;
+        NodeTable(const NodeTable&) = delete;
+        NodeTable& operator=(const NodeTable&) = delete;
+        ~NodeTable();
+
+        static constexpr uint32_t max_size = 0x1000000; /**< Number of slots a 24-bit index can address */
+
+        uint32_t insert(Element* node);
+        void erase(const uint32_t key);
+
+        Element* get(const uint32_t key) const {
+            /** Return the element referred to by a handle, or nullptr if it no longer exists */
+            const uint32_t index = key & 0xFFFFFF;
+            if (index >= this->slots.size() || this->slots[index].generation != (key >> 24)) return nullptr;
+            return this->slots[index].node;
+        }
+
+        void relocate(const uint32_t key, Element* node) {
+            /** Point an existing handle at the element's new address */
+            this->slots[key & 0xFFFFFF].node = node;
+        }
+
+        size_t size() const { return this->slots.size() - this->free_slots.size() - this->retired; }
+
+    protected:
+        struct Slot {
+            Element* node;
+            uint32_t generation; /**< Bumped whenever the slot is freed */
+        };
+
+        std::vector<Slot> slots;
+        std::vector<uint32_t> free_slots;
+        size_t retired {0}; /**< Slots whose generation is exhausted and aren't reused */
+        uint32_t capacity {max_size};
+    };
 
     /** @class Element
      *  @brief Abstract base class for all SVG elements
@@ -256,9 +1423,33 @@ namespace SVG {
 
         Element() = default;
         Element(const Element& other) = delete; // No copy constructor
-        Element(Element&& other) = default; // Move constructor
         Element& operator=(const Element&) = delete; // No copy assignment
-        Element& operator=(Element&& other) = default;
+
+        Element(Element&& other) : AttributeMap(std::move(other)) {
+            /** Move constructor: take over the other element's children and
+             *  handle, but not its place in the document
+             */
+            this->watched = false;
+            this->take_children(other);
+            this->take_handle(other);
+        }
+
+        Element& operator=(Element&& other) {
+            if (this != &other) {
+                this->clear_children();
+                const bool watched = this->watched;
+                AttributeMap::operator=(std::move(other));
+                this->watched = watched;
+                this->take_children(other);
+                this->take_handle(other);
+            }
+            return *this;
+        }
+
+        virtual ~Element() {
+            if (this->table) this->table->erase(this->table_key);
+            this->clear_children();
+        }
 
         Element(const char* id) : AttributeMap(
             SVGAttrib({ { "id", id } })) {};
@@ -271,18 +1462,77 @@ namespace SVG {
         T* add_child(Args&&... args) {
             /** Add an SVG element as a child and return a pointer to the element added */
             SVG_TYPE_CHECK;
-            this->children.push_back(std::make_unique<T>(std::forward<Args>(args)...));
-            return (T*)this->children.back().get();
+            return this->insert_before(std::make_unique<T>(std::forward<Args>(args)...));
         }
 
         template<typename T>
         Element& operator<<(T&& node) {
             /** Move an SVG element into this container */
-            SVG_TYPE_CHECK;
-            this->children.push_back(std::make_unique<T>(std::move(node)));
+            using U = typename std::decay<T>::type;
+            static_assert(std::is_base_of<Element, U>::value, "Child must be an SVG element.");
+            this->insert_before(std::make_unique<U>(std::move(node)));
             return *this;
         }
 
+        template<typename T>
+        T* insert_before(std::unique_ptr<T> node, Element* before = nullptr) {
+            /** Insert an element as a child in constant time and return a pointer to it
+             *
+             *  @param[in] node   An element which has no parent
+             *  @param[in] before A child of this element, or nullptr to append
+             */
+            SVG_TYPE_CHECK;
+            this->materialize();
+            T* ret = node.release();
+            Element* elem = ret;
+            Element* prev = before ? before->prev_node : this->last_node;
+
+            elem->parent_node = this;
+            elem->prev_node = prev;
+            elem->next_node = before;
+            (prev ? prev->next_node : this->first_node) = elem;
+            (before ? before->prev_node : this->last_node) = elem;
+            elem->watch(this->observing || this->watched);
+            elem->notify(INSERT_CHILD);
+            return ret;
+        }
+
+        std::unique_ptr<Element> detach() {
+            /** Remove this element from its parent in constant time and
+             *  return ownership of it (and its descendants)
+             *
+             *  Returns nullptr for elements without a parent, which aren't owned by the document
+             */
+            if (!this->parent_node) return nullptr;
+            this->notify(REMOVE_CHILD);
+            this->unlink();
+            this->watch(false);
+            return std::unique_ptr<Element>(this);
+        }
+
+        Element* reparent(Element* new_parent, Element* before = nullptr) {
+            /** Move this element (and its descendants) under another element
+             *
+             *  @param[in] new_parent The new parent, which must not be a descendant of this element
+             *  @param[in] before     A child of new_parent, or nullptr to append
+             *  @returns   This element, or nullptr if it was left in place because
+             *             the move would have created a cycle
+             */
+            if (!this->parent_node) return nullptr; // Not owned by a document
+            for (Element* ancestor = new_parent; ancestor; ancestor = ancestor->parent_node)
+                if (ancestor == this) return nullptr;
+
+            return new_parent->insert_before(this->detach(), before);
+        }
+
+        std::unique_ptr<Element> clone() { return this->clone_tree(nullptr); }
+
+        Element* parent() { return this->parent_node; }
+        Element* first_child() { this->materialize(); return this->first_node; }
+        Element* last_child() { this->materialize(); return this->last_node; }
+        Element* next_sibling() { return this->next_node; }
+        Element* prev_sibling() { return this->prev_node; }
+
         template<typename T>
         std::vector<T*> get_children() {
             /** Return all children of type T */
@@ -301,8 +1551,8 @@ namespace SVG {
             /** Return all immediate children of type T */
             SVG_TYPE_CHECK;
             std::vector<T*> ret;
-            for (auto& child : this->children)
-                if (typeid(child) == typeid(T)) ret.push_back((T*)child.get());
+            for (Element* child = this->first_child(); child; child = child->next_node)
+                if (typeid(*child) == typeid(T)) ret.push_back((T*)child);
 
             return ret;
         }
@@ -311,23 +1561,192 @@ namespace SVG {
         std::vector<Element*> get_elements_by_class(const std::string& clsname);
         void autoscale(const Margins& margins=DEFAULT_MARGINS);
         void autoscale(const double margin);
+        void fit_to(const BoundingBox& bbox, const Margins& margins=DEFAULT_MARGINS);
+        void spatial_sort(const bool force=false);
+        void quantize(const double tolerance);
         virtual BoundingBox get_bbox();
         ChildMap get_children();
 
     protected:
-        std::vector<std::unique_ptr<Element>> children; /** Smart pointers to child elements */
+        friend class NodeTable;
+        friend class SVG;
+        friend std::unique_ptr<SVG> parse_lazy(std::shared_ptr<const std::string> markup);
+        friend std::unique_ptr<SVG> parse(const std::string& markup, size_t threads);
+
+        /** Return a copy of this element without its children, or nullptr if it can't be copied */
+        virtual std::unique_ptr<Element> clone_node() { return nullptr; }
+        virtual void cloned() {} /**< Called on copies (and parsed elements) once their children exist */
+        std::unique_ptr<Element> clone_tree(std::vector<std::pair<Element*, Element*>>* pairs);
+
+        template<typename T>
+        std::unique_ptr<Element> clone_as() {
+            /** Copy an element whose only state is its attributes */
+            auto ret = std::make_unique<T>();
+            ret->attr = this->attr;
+            return ret;
+        }
+        NodeTable* table {nullptr}; /**< The node table this element has a handle in */
+        uint32_t table_key {0};     /**< Bits of this element's handle */
+
+        void take_handle(Element& other) {
+            /** Move other's handle over to this element */
+            if (this->table) this->table->erase(this->table_key);
+            this->table = other.table;
+            this->table_key = other.table_key;
+            other.table = nullptr;
+            if (this->table) this->table->relocate(this->table_key, this);
+        }
+
+        Element* parent_node {nullptr}; /**< The element owning this one */
+        Element* first_node {nullptr}; /**< First owned child element */
+        Element* last_node {nullptr};  /**< Last owned child element */
+        Element* prev_node {nullptr};  /**< Previous sibling */
+        Element* next_node {nullptr};  /**< Next sibling */
+
+        struct Deferred {
+            std::shared_ptr<const std::string> source; /**< The markup this element was read from */
+            const char* begin;   /**< Start of this element's content in source */
+            const char* end;     /**< End of this element's content in source */
+            bool failed {false}; /**< Whether the content turned out to be malformed */
+        };
+        std::unique_ptr<Deferred> deferred; /**< Children which haven't been read yet, see parse_lazy() */
+
+        void materialize() {
+            /** Create this element's children if they haven't been read yet */
+            if (this->deferred && !this->deferred->failed) this->read_deferred();
+        }
+        void read_deferred();
+
+        void take_children(Element& other) {
+            /** Move all children of other into this (childless) element */
+            for (Element* child = other.first_node; child; child = child->next_node)
+                child->notify(REMOVE_CHILD);
+
+            this->deferred = std::move(other.deferred);
+            this->first_node = other.first_node;
+            this->last_node = other.last_node;
+            other.first_node = other.last_node = nullptr;
+            for (Element* child = this->first_node; child; child = child->next_node) {
+                child->parent_node = this;
+                child->watch(this->observing || this->watched);
+                child->notify(INSERT_CHILD);
+            }
+        }
+
+        void clear_children() {
+            /** Delete all descendants, leaves first, without recursing */
+            this->deferred.reset();
+            for (Element* child = this->first_node; child; child = child->next_node)
+                child->notify(REMOVE_CHILD);
+
+            // Removal of the whole subtree has been reported, if necessary
+            Element* node = this->first_node;
+            while (node) {
+                if (node->first_node) {
+                    node = node->first_node;
+                    continue;
+                }
+
+                Element* parent = node->parent_node;
+                node->unlink();
+                delete node;
+                node = (parent == this) ? this->first_node : parent;
+            }
+        }
+
+        void unlink() {
+            /** Remove this element from its parent's list of children */
+            (this->prev_node ? this->prev_node->next_node : this->parent_node->first_node) = this->next_node;
+            (this->next_node ? this->next_node->prev_node : this->parent_node->last_node) = this->prev_node;
+            this->parent_node = this->prev_node = this->next_node = nullptr;
+        }
+
+        void notify(const Mutation kind, const std::string& key = std::string(), const std::string* old = nullptr,
+            const size_t old_size = 0) {
+            /** Report a change to this element to all of its observing ancestors
+             *
+             *  @param[in] key      The attribute changed (SET_ATTR and APPEND_ATTR only)
+             *  @param[in] old      The attribute's previous value, or nullptr if it was unset
+             *  @param[in] old_size The attribute's previous length (APPEND_ATTR only)
+             */
+            if (!this->watched) return;
+            for (Element* node = this->parent_node; node; node = node->parent_node)
+                if (node->observing) node->observe(kind, this, key, old, old_size);
+        }
+
+        bool observing {false}; /**< Whether observe() should be called for changes to descendants */
+
+        void watch(const bool value) {
+            /** Set whether an ancestor is observing this element, and update its descendants to match */
+            if (this->watched == value) return;
+            this->watched = value;
+            for (Element* node = this->first_node; node; node = node->first_node ? node->first_node : node->next_outside(this))
+                node->watched = node->parent_node->observing || node->parent_node->watched;
+        }
+
+        /** Called when a descendant changes */
+        virtual void observe(const Mutation, Element*, const std::string&, const std::string*, const size_t) {}
+        void attr_changed(const std::string& key, const std::string* old) override { this->notify(SET_ATTR, key, old); }
+        void attr_appended(const std::string& key, const size_t old_size) override {
+            this->notify(APPEND_ATTR, key, nullptr, old_size);
+        }
+
+        static bool precedes(const Element* a, const Element* b) {
+            /** Return whether a comes before b in document order, given that both are in the same tree */
+            std::vector<const Element*> path_a, path_b;
+            for (; a; a = a->parent_node) path_a.push_back(a);
+            for (; b; b = b->parent_node) path_b.push_back(b);
+
+            // Find where the paths from the root diverge
+            auto it_a = path_a.rbegin(), it_b = path_b.rbegin();
+            while (it_a != path_a.rend() && it_b != path_b.rend() && *it_a == *it_b) ++it_a, ++it_b;
+            if (it_a == path_a.rend() || it_b == path_b.rend()) return it_a == path_a.rend(); // Ancestors come first
+
+            for (const Element* node = (*it_a)->next_node; node; node = node->next_node)
+                if (node == *it_b) return true;
+            return false;
+        }
+
+        Element* next_in_subtree(const Element* root) {
+            /** Return the element after this one in a pre-order traversal of root's subtree */
+            this->materialize();
+            if (this->first_node) return this->first_node;
+            return this->next_outside(root);
+        }
+
+        Element* next_outside(const Element* root) {
+            /** Return the element after this one's subtree in a pre-order traversal of root's subtree */
+            for (Element* node = this; node != root; node = node->parent_node)
+                if (node->next_node) return node->next_node;
+            return nullptr;
+        }
+
         std::vector<Element*> get_children_helper();
         void get_bbox(Element::BoundingBox&);
-        virtual std::string svg_to_string(const size_t indent_level); /** SVG string corresponding to this element */
+        std::string svg_to_string(const size_t indent_level); /** SVG string corresponding to this element */
+        virtual bool write_start(std::string& out, const size_t indent_level);
+        virtual void write_end(std::string& out, const size_t indent_level);
         virtual std::string tag() = 0; /** The SVG tag of this element */
+        virtual void quantize_attrs(const double scale) {
+            if (!this->watched) return quantize_map(this->attr, scale);
+
+            // Report every attribute which was rounded
+            const SVGAttrib old = this->attr;
+            quantize_map(this->attr, scale);
+            for (auto& pair : old)
+                if (this->attr.find(pair.first)->second != pair.second) this->attr_changed(pair.first, &pair.second);
+        }
+        static void quantize_map(SVGAttrib& attr, const double scale);
 
-        double find_numeric(const std::string& key) {
+        template<typename Key>
+        double find_numeric(const Key& key) {
             /** Return the numeric attribute (if it exists) or NAN
              *
              *  @param[in] key Name of the attribute
              */
-            if (attr.find(key) != attr.end())
-                return std::stof(attr[key]);
+            auto it = attr.find(key);
+            if (it != attr.end())
+                return std::stod(it->second);
             return NAN;
         }
     };
@@ -336,17 +1755,107 @@ namespace SVG {
     inline Element::ChildList Element::get_immediate_children() {
         /** Return all immediate children, regardless of type, as Element pointers */
         Element::ChildList ret;
-        for (auto& child : this->children) ret.push_back(child.get());
+        for (Element* child = this->first_child(); child; child = child->next_node) ret.push_back(child);
         return ret;
     }
 
+    inline std::unique_ptr<Element> Element::clone_tree(std::vector<std::pair<Element*, Element*>>* pairs) {
+        /** Copy this element and its descendants, skipping any that can't be copied
+         *
+         *  @param[out] pairs If not null, filled with every (original, copy) pair in document order
+         */
+        auto root = this->clone_node();
+        if (!root) return nullptr;
+        if (pairs) pairs->push_back({ this, root.get() });
+        if (this->deferred) root->deferred = std::make_unique<Deferred>(*this->deferred);
+
+        Element* src = this->first_node;
+        Element* dst_parent = root.get(); // Copy of src's parent
+        while (src) {
+            auto copy = src->clone_node();
+            if (copy && src->deferred) copy->deferred = std::make_unique<Deferred>(*src->deferred);
+            Element* dst = copy ? dst_parent->insert_before(std::move(copy)) : nullptr;
+            if (dst && pairs) pairs->push_back({ src, dst });
+
+            if (dst && src->first_node) {
+                dst_parent = dst;
+                src = src->first_node;
+                continue;
+            }
+
+            while (!src->next_node) {
+                src = src->parent_node;
+                if (src == this) {
+                    src = nullptr;
+                    break;
+                }
+                dst_parent = dst_parent->parent_node;
+            }
+            if (src) src = src->next_node;
+        }
+
+        // Unread content is shared with the original rather than read here
+        for (Element* node = root.get(); node; node = node->first_node ? node->first_node : node->next_outside(root.get()))
+            node->cloned();
+        return root;
+    }
+
+    inline NodeTable::~NodeTable() {
+        /** Unregister elements which outlive their table */
+        for (auto& slot : this->slots)
+            if (slot.node) slot.node->table = nullptr;
+    }
+
+    inline uint32_t NodeTable::insert(Element* node) {
+        /** Register an element and return the bits of its new handle
+         *
+         *  Throws std::length_error if every slot is in use or retired.
+         */
+        uint32_t index;
+        if (!this->free_slots.empty()) {
+            index = this->free_slots.back();
+            this->free_slots.pop_back();
+        }
+        else if (this->slots.size() < this->capacity) {
+            index = (uint32_t)this->slots.size();
+            this->slots.push_back(Slot{ nullptr, 1 });
+        }
+        else throw std::length_error("SVG::NodeTable: no free handles left");
+
+        this->slots[index].node = node;
+        const uint32_t key = (this->slots[index].generation << 24) | index;
+        node->table = this;
+        node->table_key = key;
+        return key;
+    }
+
+    inline void NodeTable::erase(const uint32_t key) {
+        /** Invalidate a handle and free its slot */
+        const uint32_t index = key & 0xFFFFFF;
+        Slot& slot = this->slots[index];
+        if (slot.node->table == this) slot.node->table = nullptr;
+        slot.node = nullptr;
+
+        if (++slot.generation < 256) this->free_slots.push_back(index);
+        else this->retired++;
+    }
+
     inline Element* Element::get_element_by_id(const std::string &id) {
-        /** Return the SVG element that has a certain id */
-        auto child_elems = this->get_children_helper();
-        for (auto& current: child_elems)
-            if (current->attr.find("id") != current->attr.end() && 
-                current->attr.find("id")->second == id) return current;
-        
+        /** Return the first descendant (in document order) that has a certain id
+         *
+         *  Subtrees which haven't been read yet are skipped unless their markup contains the id.
+         */
+        Element* node = this->first_child();
+        while (node) {
+            auto current = node->attr.find("id");
+            if (current != node->attr.end() && current->second == id) return node;
+
+            const Deferred* unread = node->deferred.get();
+            if (unread && std::search(unread->begin, unread->end, id.begin(), id.end()) == unread->end)
+                node = node->next_outside(this);
+            else node = node->next_in_subtree(this);
+        }
+
         return nullptr;
     }
 
@@ -382,7 +1891,10 @@ namespace SVG {
         }
 
         virtual std::vector<Point> points() {
-            /** Return a set of points used for calculating a bounding polygon for this object */
+            /** Return a set of points used for calculating a bounding polygon for this object
+             *
+             *  Overrides must be matched by an override of append_points().
+             */
             auto bbox = this->get_bbox();
             return {
                 Point(bbox.x1, bbox.y1), // Top left
@@ -392,6 +1904,22 @@ namespace SVG {
             };
         }
 
+        virtual void append_points(util::PointBuffer& buffer) {
+            /** Write the same points as points() directly into a flat buffer,
+             *  skipping shapes whose bounding box is not defined
+             *
+             *  Subclasses which override points() must override this as well.
+             */
+            auto bbox = this->get_bbox();
+            if (isnan(bbox.x1) || isnan(bbox.x2) || isnan(bbox.y1) || isnan(bbox.y2))
+                return;
+
+            buffer.push_back(bbox.x1, bbox.y1);
+            buffer.push_back(bbox.x2, bbox.y1);
+            buffer.push_back(bbox.x1, bbox.y2);
+            buffer.push_back(bbox.x2, bbox.y2);
+        }
+
         virtual double x() { return this->find_numeric("x"); }
         virtual double y() { return this->find_numeric("y"); }
         virtual double width() {
@@ -408,6 +1936,141 @@ namespace SVG {
         }
     };
 
+    /** @class Defs
+     *  @brief Container for gradients, patterns, filters and other reusable definitions
+     */
+    class Defs : public Element {
+    public:
+        using Element::Element;
+    protected:
+        std::string tag() override { return "defs"; }
+        std::unique_ptr<Element> clone_node() override { return this->clone_as<Defs>(); }
+    };
+
+    /** @class MutationLog
+     *  @brief A compact record of the changes made to a document, see SVG::start_log()
+     *
+     *  Entries are packed into a byte string, referring to elements by the
+     *  handles of the document which owns the log.
+     */
+    class MutationLog {
+    public:
+        struct Entry {
+            Mutation kind;
+            uint32_t target {0};     /**< The element changed, inserted or removed */
+            uint32_t parent {0};     /**< Parent of an inserted or removed element */
+            uint32_t before {0};     /**< Next sibling of an inserted or removed element */
+            size_t slot {0};         /**< Storage for the subtree of an inserted or removed element */
+            size_t old_size {0};     /**< Length of an attribute before an append */
+            std::string key, old_value, new_value; /**< new_value holds only the text appended by APPEND_ATTR */
+            bool had_old {false};    /**< Whether the attribute was set before */
+            bool has_new {false};    /**< Whether the attribute is set afterwards */
+        };
+
+        size_t size() const { return this->offsets.size(); }
+        size_t position() const { return this->cursor; } /**< Number of entries which are applied */
+        size_t bytes() const { return this->data.size(); }
+
+        Entry read(const size_t index) const {
+            /** Decode an entry */
+            Entry entry;
+            const char* p = this->data.data() + this->offsets[index];
+            auto read_string = [&p](std::string& out) {
+                const size_t length = (size_t)util::read_varint(p);
+                out.assign(p, length);
+                p += length;
+            };
+
+            entry.kind = (Mutation)*p++;
+            entry.target = (uint32_t)util::read_varint(p);
+            if (entry.kind == SET_ATTR) {
+                const char flags = *p++;
+                entry.had_old = flags & 1;
+                entry.has_new = flags & 2;
+                read_string(entry.key);
+                if (entry.had_old) read_string(entry.old_value);
+                if (entry.has_new) read_string(entry.new_value);
+            }
+            else if (entry.kind == APPEND_ATTR) {
+                read_string(entry.key);
+                entry.old_size = (size_t)util::read_varint(p);
+                read_string(entry.new_value);
+            }
+            else {
+                entry.parent = (uint32_t)util::read_varint(p);
+                entry.before = (uint32_t)util::read_varint(p);
+                entry.slot = (size_t)util::read_varint(p);
+            }
+            return entry;
+        }
+
+    protected:
+        friend class SVG;
+
+        struct Snapshot {
+            std::unique_ptr<Element> copy;  /**< An inserted subtree as it was when inserted */
+            std::vector<uint32_t> handles;  /**< Handles of the originals in document order */
+        };
+
+        std::string data;
+        std::vector<size_t> offsets;     /**< Start of each entry in data */
+        size_t cursor {0};
+        std::vector<std::unique_ptr<Element>> parked; /**< Subtrees taken out by undo(), redo() or remove() */
+        std::vector<Snapshot> snapshots; /**< By slot, for replay() */
+        std::vector<uint32_t> base;      /**< Handles of all elements when logging started, in document order */
+        size_t last_removal {SIZE_MAX};  /**< Slot of the latest removal */
+        bool applying {false};           /**< Whether changes are made by undo() or redo() */
+
+        void append(const Entry& entry) {
+            /** Add an entry, discarding any which have been undone */
+            this->truncate();
+            this->offsets.push_back(this->data.size());
+            this->data += (char)entry.kind;
+            util::append_varint(this->data, entry.target);
+
+            auto write_string = [this](const std::string& value) {
+                util::append_varint(this->data, value.size());
+                this->data += value;
+            };
+
+            if (entry.kind == SET_ATTR) {
+                this->data += (char)(entry.had_old | (entry.has_new << 1));
+                write_string(entry.key);
+                if (entry.had_old) write_string(entry.old_value);
+                if (entry.has_new) write_string(entry.new_value);
+            }
+            else if (entry.kind == APPEND_ATTR) {
+                write_string(entry.key);
+                util::append_varint(this->data, entry.old_size);
+                write_string(entry.new_value);
+            }
+            else {
+                util::append_varint(this->data, entry.parent);
+                util::append_varint(this->data, entry.before);
+                util::append_varint(this->data, entry.slot);
+            }
+            this->cursor++;
+        }
+
+        void truncate() {
+            /** Discard undone entries and the subtrees they hold */
+            if (this->cursor == this->size()) return;
+            size_t slots = this->parked.size();
+            for (size_t i = this->cursor; i < this->size(); i++) {
+                auto entry = this->read(i);
+                if (entry.kind == INSERT_CHILD || entry.kind == REMOVE_CHILD) {
+                    slots = std::min(slots, entry.slot);
+                    break;
+                }
+            }
+
+            this->data.resize(this->offsets[this->cursor]);
+            this->offsets.resize(this->cursor);
+            this->parked.resize(slots);
+            this->snapshots.resize(slots);
+        }
+    };
+
     class SVG : public Shape {
     public:
         class Style : public Element {
@@ -415,46 +2078,315 @@ namespace SVG {
             Style() = default;
             using Element::Element;
             SelectorProperties css; /**< Basic CSS styling */
-            std::map<std::string, SelectorProperties> keyframes; /**< CSS animations */
+            std::map<std::string, Keyframes, std::less<>> keyframes; /**< CSS animations */
 
         protected:
-            std::string svg_to_string(const size_t) override;
+            bool write_start(std::string& out, const size_t indent_level) override;
             std::string tag() override { return "style"; };
+            std::unique_ptr<Element> clone_node() override {
+                auto ret = std::make_unique<Style>();
+                ret->attr = this->attr;
+                ret->css = this->css;
+                ret->keyframes = this->keyframes;
+                return ret;
+            }
+            void quantize_attrs(const double scale) override {
+                for (auto& selector : this->css) quantize_map(selector.second.attr, scale);
+            }
         };
 
         SVG(SVGAttrib _attr =
                 {{"xmlns", "http://www.w3.org/2000/svg"}}
         ) : Shape(_attr) {}; /**< Create an <svg> with specified attributes */
 
-        AttributeMap& style(const std::string& key) { return this->css->css[key]; }
+        SVG(SVG&& other) : Shape(std::move(other.silenced())) { this->take_state(other); }
+        SVG& operator=(SVG&& other) {
+            if (this != &other) {
+                this->silenced();
+                Shape::operator=(std::move(other.silenced()));
+                this->take_state(other);
+            }
+            return *this;
+        }
+
+        /** @class Transaction
+         *  @brief Defers maintenance of a document's indexes while it is open
+         *
+         *  Changes made through set_attr(), add_child(), operator<< and detach()
+         *  are journaled, and the indexes are rebuilt once when the last open
+         *  transaction is committed (or destroyed). The document must not be
+         *  moved while a transaction is open.
+         */
+        class Transaction {
+        public:
+            Transaction(SVG& _doc) : doc(&_doc) { doc->open_transactions++; doc->update_observer(); }
+            Transaction(Transaction&& other) : doc(other.doc) { other.doc = nullptr; }
+            Transaction(const Transaction&) = delete;
+            Transaction& operator=(const Transaction&) = delete;
+            ~Transaction() { this->commit(); }
+
+            void commit() {
+                /** Apply all journaled changes to the document's indexes */
+                if (this->doc && --this->doc->open_transactions == 0) this->doc->commit();
+                this->doc = nullptr;
+            }
+
+        private:
+            SVG* doc;
+        };
+
+        Transaction transaction() { return Transaction(*this); }
+
+        struct PassReport {
+            std::string name;
+            double milliseconds;  /**< Time taken by the pass */
+            long long bytes_saved; /**< Reduction in the size of the markup */
+        };
+
+        /** @class Optimizer
+         *  @brief An ordered list of passes which simplify a document before export
+         *
+         *  Passes may delete elements, so pointers into the document (other
+         *  than to the element optimized) should not be kept across run().
+         */
+        class Optimizer {
+        public:
+            using Pass = std::function<void(Element&)>;
+
+            Optimizer& add(const std::string& name, Pass pass) {
+                /** Append a pass, which is run after all previously added ones */
+                this->passes.push_back({ name, std::move(pass) });
+                return *this;
+            }
+
+            std::vector<PassReport> run(Element& root) const;
+            static Optimizer defaults();
+
+            static void drop_empty_groups(Element& root);
+            static void remove_defaults(Element& root);
+            static void collapse_groups(Element& root);
+            static void merge_transforms(Element& root);
+            static void merge_shapes(Element& root);
+            static void prune_styles(Element& root);
+
+        protected:
+            std::vector<std::pair<std::string, Pass>> passes;
+        };
+
+        std::vector<PassReport> optimize(const Optimizer& optimizer = Optimizer::defaults()) {
+            /** Run a set of optimization passes over this document */
+            return optimizer.run(*this);
+        }
+
+        void start_log();
+        void stop_log() { this->mutation_log.reset(); this->update_observer(); }
+        const MutationLog* mutations() const { return this->mutation_log.get(); }
+        std::unique_ptr<Element> remove(Element* elem);
+        bool undo();
+        bool redo();
+        bool replay(Element& replica);
+        std::vector<Element*> changed_since(const size_t position);
+
+        size_t pending_changes() const { return this->journal.size(); }
+        Element* get_element_by_id(const std::string& id);
+
+        template<typename T>
+        Handle<T> handle(T* elem) {
+            /** Return a handle to an element, valid until the element is destroyed
+             *  or given a handle by another document
+             */
+            SVG_TYPE_CHECK;
+            if (!this->nodes) this->nodes = std::make_unique<NodeTable>();
+            if (elem->table == this->nodes.get()) return Handle<T>(elem->table_key);
+
+            // Only give up the old handle once the new one exists
+            NodeTable* previous = elem->table;
+            const uint32_t previous_key = elem->table_key;
+            const uint32_t key = this->nodes->insert(elem);
+            if (previous) previous->erase(previous_key);
+            return Handle<T>(key);
+        }
+
+        template<typename T>
+        T* resolve(const Handle<T> handle) const {
+            /** Return the element referred to by a handle, or nullptr if it is stale */
+            return this->nodes ? (T*)this->nodes->get(handle.bits) : nullptr;
+        }
+
+        template<typename T>
+        std::vector<Handle<T>> get_handles() {
+            /** Return handles to all children of type T */
+            std::vector<Handle<T>> ret;
+            for (auto& child : this->get_children<T>()) ret.push_back(this->handle(child));
+            return ret;
+        }
+
+        template<typename Key>
+        AttributeMap& style(const Key& key) {
+            /** Add or modify a CSS rule
+             *
+             *  @param[in] key A CSS selector
+             */
+            return util::find_or_insert(this->stylesheet()->css, key);
+        }
 
-        std::map<std::string, AttributeMap>& keyframes(const std::string& key) {
+        template<typename Key>
+        Keyframes& keyframes(const Key& key) {
             /** Add or modify an animation keyframe
              *
              *  @param[in] key The name of the animation
              */
-            if (!this->css) this->css = this->add_child<Style>();
-            return this->css->keyframes[key];
+            return util::find_or_insert(this->stylesheet()->keyframes, key);
+        }
+
+        void hoist_styles();
+
+        template<typename T>
+        std::string define(T&& def) {
+            /** Move a gradient, pattern, filter or any other definition into this
+             *  document's <defs> and return a reference to it, e.g. "url(#def_1a2b)"
+             *
+             *  Definitions are deduplicated by content: defining something identical
+             *  to an existing definition returns a reference to that one instead.
+             *  Any id already set on the definition is replaced.
+             */
+            using U = typename std::decay<T>::type;
+            static_assert(std::is_base_of<Element, U>::value, "Definition must be an SVG element.");
+
+            U node(std::move(def));
+            node.attr.erase("id");
+            const std::string content = node;
+            const size_t hash = std::hash<std::string>()(content);
+
+            // Check for identical definitions
+            size_t same_hash {0};
+            auto range = this->def_index.equal_range(hash);
+            for (auto it = range.first; it != range.second; ++it, same_hash++) {
+                Element* existing = it->second;
+                const std::string id = existing->attr["id"];
+                existing->attr.erase("id");
+                const bool identical = (std::string(*existing) == content);
+                existing->attr["id"] = id;
+                if (identical) return "url(#" + id + ")";
+            }
+
+            std::stringstream id;
+            id << "def_" << std::hex << hash;
+            if (same_hash) id << "_" << same_hash;
+            node.attr["id"] = id.str();
+
+            if (!this->defs) {
+                // Place definitions ahead of everything but the stylesheet
+                Element* before = (this->css && this->first_child() == this->css) ?
+                    this->css->next_sibling() : this->first_child();
+                this->defs = this->insert_before(std::make_unique<Defs>(), before);
+            }
+
+            this->def_index.insert({ hash, this->defs->add_child<U>(std::move(node)) });
+            return "url(#" + id.str() + ")";
         }
 
-        Style* css {this->add_child<Style>()}; /**< This item's associated CSS stylesheet */
+        Style* css {nullptr}; /**< This item's associated CSS stylesheet (created on first use) */
+        Defs* defs {nullptr}; /**< Definitions added via define() */
 
     protected:
+        struct Change {
+            Mutation kind;
+            bool reindex; /**< Whether the id index is affected */
+        };
+
+        std::unique_ptr<NodeTable> nodes; /**< Handles given out by handle() */
+        std::unordered_map<std::string, Element*> id_index; /**< Descendants by id */
+        bool indexed {false};      /**< Whether id_index has been built */
+        bool index_stale {false};  /**< Whether id_index is missing journaled changes */
+        size_t open_transactions {0};
+        std::vector<Change> journal; /**< Changes made during the open transactions */
+
+        std::unique_ptr<MutationLog> mutation_log; /**< Changes since start_log(), if logging */
+
+        void update_observer() {
+            /** Start or stop hearing about changes to descendants, which costs
+             *  nothing for documents that don't need to
+             */
+            const bool value = this->indexed || this->open_transactions || this->mutation_log;
+            if (value == this->observing) return;
+            this->observing = value;
+            for (Element* child = this->first_node; child; child = child->next_node)
+                child->watch(value || this->watched);
+        }
+        void take_state(SVG& other);
+
+        SVG& silenced() {
+            /** Ignore changes to descendants which are about to be moved to another SVG */
+            this->observing = false;
+            return *this;
+        }
+        void record(const Mutation kind, Element* target, const std::string& key, const std::string* old, const size_t old_size);
+        bool apply(const MutationLog::Entry& entry, const bool forward);
+        void rebuild_index();
+        void index_id(const std::string& id, Element* node);
+        void commit();
+        void observe(const Mutation kind, Element* target, const std::string& key, const std::string* old,
+            const size_t old_size) override;
+
+        Style* stylesheet() {
+            /** Return this item's stylesheet, creating it as the first child if necessary */
+            if (!this->css) {
+                this->css = this->insert_before(std::make_unique<Style>(), this->first_child());
+            }
+            return this->css;
+        }
+
+        std::unordered_multimap<size_t, Element*> def_index; /**< Content hash --> definition */
         std::string tag() override { return "svg"; }
+        std::unique_ptr<Element> clone_node() override { return this->clone_as<SVG>(); }
+
+        void cloned() override {
+            /** Find the copied stylesheet and definitions */
+            for (Element* child = this->first_node; child; child = child->next_node) {
+                if (!this->css && typeid(*child) == typeid(Style)) this->css = (Style*)child;
+                else if (!this->defs && typeid(*child) == typeid(Defs)) this->defs = (Defs*)child;
+            }
+
+            if (!this->defs) return;
+            for (Element* def = this->defs->first_node; def; def = def->next_node) {
+                auto id = def->attr.find("id");
+                if (id == def->attr.end()) continue;
+                const std::string name = id->second;
+                def->attr.erase(id);
+                this->def_index.insert({ std::hash<std::string>()(std::string(*def)), def });
+                def->attr["id"] = name;
+            }
+        }
     };
 
     class Path : public Shape {
     public:
+        Path() = default;
         using Shape::Shape;
 
+        Path(SVGAttrib _attr) : Shape(_attr) {
+            /** Create a path from its attributes (e.g. when parsed), finding the extents of d */
+            auto d = this->attr.find("d");
+            if (d == this->attr.end()) return;
+            this->from_origin = false;
+            util::path_points(d->second, [this](const double x, const double y) { this->include(x, y); });
+        }
+
         template<typename T>
         inline void start(T x, T y) {
             /** Start line at (x, y)
              *  This function overwrites the current path if it exists
              */
-            this->attr["d"] = "M " + to_string(x) + " " + to_string(y);
-            this->points.clear();
-            this->points.push_back(std::make_pair(x, y));
+            this->update_attr("d", [x, y](std::string& d) {
+                d.assign("M ");
+                util::append_fixed(d, x);
+                d += ' ';
+                util::append_fixed(d, y);
+            });
+            this->extents = Element::BoundingBox(INFINITY, -INFINITY, INFINITY, -INFINITY);
+            this->include(x, y);
+            this->from_origin = true;
         }
 
         inline void start(std::pair<double, double> coord) {
@@ -472,8 +2404,13 @@ namespace SVG {
                 start(x, y);
             else
             {
-                this->attr["d"] += " L " + to_string(x) + " " + to_string(y);
-                this->points.push_back(std::make_pair(x, y));
+                this->append_attr("d", [x, y](std::string& d) {
+                    d += " L ";
+                    util::append_fixed(d, x);
+                    d += ' ';
+                    util::append_fixed(d, y);
+                });
+                this->include(x, y);
             }
         }
 
@@ -492,8 +2429,23 @@ namespace SVG {
                 start(x, y);
             else
             {
-                this->attr["d"] += " A " + to_string(rx) + " " + to_string(ry) + " " + to_string(r) + " " + std::to_string(bf) + " " + std::to_string(af) + " " + to_string(x) + " " + to_string(y);
-                this->points.push_back(std::make_pair(x, y));
+                this->append_attr("d", [&](std::string& path) {
+                    path += " A ";
+                    util::append_fixed(path, rx);
+                    path += ' ';
+                    util::append_fixed(path, ry);
+                    path += ' ';
+                    util::append_fixed(path, r);
+                    path += ' ';
+                    util::append_int(path, bf);
+                    path += ' ';
+                    util::append_int(path, af);
+                    path += ' ';
+                    util::append_fixed(path, x);
+                    path += ' ';
+                    util::append_fixed(path, y);
+                });
+                this->include(x, y);
             }
         }
 
@@ -503,15 +2455,138 @@ namespace SVG {
 
         inline void to_origin() {
             /** Draw a line back to the origin */
-            this->attr["d"] += " Z ";
+            this->append_attr("d", [](std::string& d) { d += " Z "; });
         }
 
-    protected:
+        void add_circle(double cx, double cy, double r) {
+            /** Append a circle as a separate subpath, drawn as two arcs */
+            this->append_attr("d", [&](std::string& d) {
+                this->subpath(d, cx - r, cy);
+                for (const double dx : { 2 * r, -2 * r }) {
+                    d += 'a';
+                    for (const double value : { r, r, 0.0, 1.0, 0.0, dx, 0.0 }) util::append_compact(d, value);
+                }
+                d += 'z';
+            });
+            this->include(cx - r, cy - r);
+            this->include(cx + r, cy + r);
+        }
+
+        void add_rect(double x, double y, double width, double height) {
+            /** Append a rectangle as a separate subpath */
+            this->append_attr("d", [&](std::string& d) {
+                this->subpath(d, x, y);
+                d += 'h';
+                util::append_compact(d, width);
+                d += 'v';
+                util::append_compact(d, height);
+                d += 'h';
+                util::append_compact(d, -width);
+                d += 'z';
+            });
+            this->include(x + width, y + height);
+        }
+
+        void add_line(double x1, double y1, double x2, double y2) {
+            /** Append a line segment as a separate subpath */
+            this->append_attr("d", [&](std::string& d) {
+                this->subpath(d, x1, y1);
+                d += 'L';
+                util::append_compact(d, x2);
+                util::append_compact(d, y2);
+            });
+            this->include(x2, y2);
+        }
+
+        void line_through(const double* xs, const double* ys, const size_t n) {
+            /** Continue the path through n points, starting it at the first one if
+             *  it's empty, and leaving a gap wherever a coordinate is NAN
+             */
+            this->append_attr("d", [&](std::string& d) {
+                if (d.empty()) this->from_origin = false;
+                d.reserve(d.size() + n * 12);
+
+                bool gap {d.empty()};
+                for (size_t i {0}; i < n; i++) {
+                    if (isnan(xs[i]) || isnan(ys[i])) {
+                        gap = true;
+                        continue;
+                    }
+
+                    // Consecutive pairs after 'L' are also drawn as lines
+                    if (gap || !i) d += gap ? 'M' : 'L';
+                    util::append_compact(d, xs[i]);
+                    util::append_compact(d, ys[i]);
+                    this->include(xs[i], ys[i]);
+                    gap = false;
+                }
+            });
+        }
+
+        void add_path(const Path& other) {
+            /** Append the subpaths of another path */
+            auto d = other.attr.find("d");
+            if (d == other.attr.end() || d->second.empty()) return;
+            this->append_attr("d", [&](std::string& path) {
+                this->from_origin = path.empty() ? other.from_origin : (this->from_origin || other.from_origin);
+                path += d->second; // Which starts with a command
+            });
+            this->include(other.extents.x1, other.extents.y1);
+            this->include(other.extents.x2, other.extents.y2);
+        }
+
+        void add_polyline(const double* xs, const double* ys, const size_t n, const bool closed = false) {
+            /** Append n points as a separate subpath, closed back to the first if requested */
+            if (!n) return;
+            this->append_attr("d", [&](std::string& d) {
+                this->subpath(d, xs[0], ys[0]);
+                if (n > 1) d += 'L';
+                for (size_t i {1}; i < n; i++) {
+                    util::append_compact(d, xs[i]);
+                    util::append_compact(d, ys[i]);
+                    this->include(xs[i], ys[i]);
+                }
+                if (closed) d += 'z';
+            });
+        }
+
+    protected:
         Element::BoundingBox get_bbox() override;
         std::string tag() override { return "path"; }
+        std::unique_ptr<Element> clone_node() override {
+            auto ret = std::make_unique<Path>();
+            ret->attr = this->attr;
+            ret->extents = this->extents;
+            ret->from_origin = this->from_origin;
+            return ret;
+        }
+
+        void quantize_attrs(const double scale) override {
+            Shape::quantize_attrs(scale);
+            for (double* value : { &extents.x1, &extents.x2, &extents.y1, &extents.y2 })
+                *value = std::round(*value * scale);
+        }
 
     private:
-        std::list<Point> points;
+        Element::BoundingBox extents { INFINITY, -INFINITY, INFINITY, -INFINITY }; /**< Extents of the points drawn so far */
+        bool from_origin {true}; /**< Whether the bounding box extends to the origin (unless built by add_*()) */
+
+        void include(const double x, const double y) {
+            /** Grow the extents to include (x, y), so get_bbox() doesn't rescan the path */
+            if (x < this->extents.x1) this->extents.x1 = x;
+            if (x > this->extents.x2) this->extents.x2 = x;
+            if (y < this->extents.y1) this->extents.y1 = y;
+            if (y > this->extents.y2) this->extents.y2 = y;
+        }
+
+        void subpath(std::string& d, double x, double y) {
+            /** Start a new subpath in d at (x, y) without overwriting the current path */
+            if (d.empty()) this->from_origin = false;
+            d += 'M';
+            util::append_compact(d, x);
+            util::append_compact(d, y);
+            this->include(x, y);
+        }
     };
 
     class Text : public Element {
@@ -528,10 +2603,37 @@ namespace SVG {
         Text(std::pair<double, double> xy, std::string _content) :
                 Text(xy.first, xy.second, _content) {};
 
+        std::string content; /**< Markup inside this element, written as is */
+
     protected:
-        std::string content;
-        std::string svg_to_string(const size_t) override;
+        bool write_start(std::string& out, const size_t indent_level) override;
         std::string tag() override { return "text"; }
+        std::unique_ptr<Element> clone_node() override {
+            auto ret = std::make_unique<Text>();
+            ret->attr = this->attr;
+            ret->content = this->content;
+            return ret;
+        }
+    };
+
+    /** @class Generic
+     *  @brief An element of any other kind (e.g. one read by parse()), written
+     *         with its tag name and, if it has any, its raw content
+     */
+    class Generic : public Element {
+    public:
+        Generic(const std::string& _name, SVGAttrib _attr = {}, const std::string& _content = "") :
+            Element(_attr), name(_name), content(_content) {};
+
+        std::string name;
+        std::string content; /**< Markup inside this element, written instead of any children */
+
+    protected:
+        bool write_start(std::string& out, const size_t indent_level) override;
+        std::string tag() override { return this->name; }
+        std::unique_ptr<Element> clone_node() override {
+            return std::make_unique<Generic>(this->name, this->attr, this->content);
+        }
     };
 
     class Group : public Element {
@@ -539,6 +2641,141 @@ namespace SVG {
         using Element::Element;
     protected:
         std::string tag() override { return "g"; }
+        std::unique_ptr<Element> clone_node() override { return this->clone_as<Group>(); }
+    };
+
+    /** @class Stop
+     *  @brief A color stop of a gradient
+     */
+    class Stop : public Element {
+    public:
+        Stop() = default;
+        using Element::Element;
+
+        Stop(const double offset, const std::string& color, const double opacity=1) {
+            set_attr("offset", offset).set_attr("stop-color", color);
+            if (opacity != 1) set_attr("stop-opacity", opacity);
+        }
+
+    protected:
+        std::string tag() override { return "stop"; }
+        std::unique_ptr<Element> clone_node() override { return this->clone_as<Stop>(); }
+    };
+
+    /** @class Gradient
+     *  @brief Base class for gradients, which are made up of color stops
+     */
+    class Gradient : public Element {
+    public:
+        using Element::Element;
+
+    protected:
+        void stop(const double offset, const std::string& color, const double opacity) {
+            this->add_child<Stop>(offset, color, opacity);
+        }
+    };
+
+    /** @class LinearGradient
+     *  @brief A gradient along a line, to be registered with SVG::define()
+     */
+    class LinearGradient : public Gradient {
+    public:
+        LinearGradient() = default;
+        using Gradient::Gradient;
+
+        LinearGradient(const double x1, const double y1, const double x2, const double y2) {
+            /** Create a gradient from (x1, y1) to (x2, y2), as fractions of the
+             *  bounding box of the element it's applied to
+             */
+            set_attr("x1", x1).set_attr("y1", y1).set_attr("x2", x2).set_attr("y2", y2);
+        }
+
+        LinearGradient& add_stop(const double offset, const std::string& color, const double opacity=1) {
+            /** Add a color stop at offset (between 0 and 1) */
+            this->stop(offset, color, opacity);
+            return *this;
+        }
+
+    protected:
+        std::string tag() override { return "linearGradient"; }
+        std::unique_ptr<Element> clone_node() override { return this->clone_as<LinearGradient>(); }
+    };
+
+    /** @class RadialGradient
+     *  @brief A gradient radiating from a point, to be registered with SVG::define()
+     */
+    class RadialGradient : public Gradient {
+    public:
+        RadialGradient() = default;
+        using Gradient::Gradient;
+
+        RadialGradient(const double cx, const double cy, const double r) {
+            /** Create a gradient centered at (cx, cy) with radius r, as fractions
+             *  of the bounding box of the element it's applied to
+             */
+            set_attr("cx", cx).set_attr("cy", cy).set_attr("r", r);
+        }
+
+        RadialGradient& add_stop(const double offset, const std::string& color, const double opacity=1) {
+            /** Add a color stop at offset (between 0 and 1) */
+            this->stop(offset, color, opacity);
+            return *this;
+        }
+
+    protected:
+        std::string tag() override { return "radialGradient"; }
+        std::unique_ptr<Element> clone_node() override { return this->clone_as<RadialGradient>(); }
+    };
+
+    /** @class Pattern
+     *  @brief A tile of child elements used as a fill, to be registered with SVG::define()
+     */
+    class Pattern : public Element {
+    public:
+        Pattern() = default;
+        using Element::Element;
+
+        Pattern(const double x, const double y, const double width, const double height) {
+            /** Create a pattern whose tiles are width by height user units */
+            set_attr("x", x).set_attr("y", y).set_attr("width", width).set_attr("height", height)
+                .set_attr("patternUnits", "userSpaceOnUse");
+        }
+
+    protected:
+        std::string tag() override { return "pattern"; }
+        std::unique_ptr<Element> clone_node() override { return this->clone_as<Pattern>(); }
+    };
+
+    /** @class FilterPrimitive
+     *  @brief A filter effect such as feGaussianBlur, feOffset or feBlend
+     */
+    class FilterPrimitive : public Element {
+    public:
+        FilterPrimitive(const std::string& _name, SVGAttrib _attr = {}) :
+            Element(_attr), name(_name) {};
+
+    protected:
+        std::string name;
+        std::string tag() override { return this->name; }
+        std::unique_ptr<Element> clone_node() override { return std::make_unique<FilterPrimitive>(this->name, this->attr); }
+    };
+
+    /** @class Filter
+     *  @brief A chain of filter primitives, to be registered with SVG::define()
+     */
+    class Filter : public Element {
+    public:
+        using Element::Element;
+
+        Filter& add_effect(const std::string& name, SVGAttrib attributes = {}) {
+            /** Append a filter primitive, e.g. add_effect("feGaussianBlur", {{ "stdDeviation", "2" }}) */
+            this->add_child<FilterPrimitive>(name, attributes);
+            return *this;
+        }
+
+    protected:
+        std::string tag() override { return "filter"; }
+        std::unique_ptr<Element> clone_node() override { return this->clone_as<Filter>(); }
     };
 
     class Line : public Shape {
@@ -573,6 +2810,7 @@ namespace SVG {
     protected:
         Element::BoundingBox get_bbox() override;   
         std::string tag() override { return "line"; }
+        std::unique_ptr<Element> clone_node() override { return this->clone_as<Line>(); }
     };
 
     class Rect : public Shape {
@@ -593,6 +2831,7 @@ namespace SVG {
         Element::BoundingBox get_bbox() override;
     protected:
         std::string tag() override { return "rect"; }
+        std::unique_ptr<Element> clone_node() override { return this->clone_as<Rect>(); }
     };
 
     class Circle : public Shape {
@@ -618,6 +2857,248 @@ namespace SVG {
 
     protected:
         std::string tag() override { return "circle"; }
+        std::unique_ptr<Element> clone_node() override { return this->clone_as<Circle>(); }
+    };
+
+    /** @class Column
+     *  @brief A read-only view of a numeric array owned elsewhere,
+     *  e.g. by the caller or a memory-mapped ArrowFile
+     */
+    class Column {
+    public:
+        enum Type : uint8_t { NONE, INT8, UINT8, INT16, UINT16, INT32, UINT32, INT64, UINT64, FLOAT32, FLOAT64 };
+
+        Column() = default;
+
+        template<typename T>
+        Column(const T* _values, const size_t _size, std::shared_ptr<const void> _owner = nullptr) :
+            Column(type_of(_values), _values, _size, nullptr, std::move(_owner)) {};
+
+        template<typename T>
+        Column(const std::vector<T>& values) : Column(values.data(), values.size()) {}; /**< The vector isn't copied */
+
+        Column(const Type _type, const void* _values, const size_t _size,
+            const uint8_t* _validity = nullptr, std::shared_ptr<const void> _owner = nullptr) :
+            values(_values), validity(_validity), length(_size), kind(_values ? _type : NONE), owner(std::move(_owner)) {};
+
+        explicit operator bool() const { return this->kind != NONE; }
+        Type type() const { return this->kind; }
+        size_t size() const { return this->length; }
+
+        bool valid(const size_t i) const {
+            /** Return whether the value at i isn't null */
+            return !this->validity || (this->validity[i >> 3] >> (i & 7)) & 1;
+        }
+
+        double operator[](const size_t i) const {
+            switch (this->kind) {
+            case INT8: return ((const int8_t*)this->values)[i];
+            case UINT8: return ((const uint8_t*)this->values)[i];
+            case INT16: return ((const int16_t*)this->values)[i];
+            case UINT16: return ((const uint16_t*)this->values)[i];
+            case INT32: return ((const int32_t*)this->values)[i];
+            case UINT32: return ((const uint32_t*)this->values)[i];
+            case INT64: return (double)((const int64_t*)this->values)[i];
+            case UINT64: return (double)((const uint64_t*)this->values)[i];
+            case FLOAT32: return ((const float*)this->values)[i];
+            case FLOAT64: return ((const double*)this->values)[i];
+            default: return NAN;
+            }
+        }
+
+        uint32_t rgba(const size_t i) const {
+            /** Return the value at i as a color packed as 0xRRGGBBAA */
+            switch (this->kind) {
+            case INT32: case UINT32: return ((const uint32_t*)this->values)[i];
+            case INT64: case UINT64: return (uint32_t)((const uint64_t*)this->values)[i];
+            default: return (uint32_t)(*this)[i];
+            }
+        }
+
+        const double* doubles() const {
+            /** Return the values if they are doubles without nulls, or nullptr */
+            return (this->kind == FLOAT64 && !this->validity) ? (const double*)this->values : nullptr;
+        }
+
+    protected:
+        static Type type_of(const int8_t*) { return INT8; }
+        static Type type_of(const uint8_t*) { return UINT8; }
+        static Type type_of(const int16_t*) { return INT16; }
+        static Type type_of(const uint16_t*) { return UINT16; }
+        static Type type_of(const int32_t*) { return INT32; }
+        static Type type_of(const uint32_t*) { return UINT32; }
+        static Type type_of(const int64_t*) { return INT64; }
+        static Type type_of(const uint64_t*) { return UINT64; }
+        static Type type_of(const float*) { return FLOAT32; }
+        static Type type_of(const double*) { return FLOAT64; }
+
+        const void* values {nullptr};
+        const uint8_t* validity {nullptr}; /**< Bit i is set if value i isn't null, or nullptr if none are */
+        size_t length {0};
+        Type kind {NONE};
+        std::shared_ptr<const void> owner; /**< Keeps the storage alive, if set */
+    };
+
+    /** @class ArrowFile
+     *  @brief The numeric columns of an Arrow IPC file (also known as Feather V2),
+     *  read in place rather than copied
+     *
+     *  Only uncompressed, little-endian files are supported. Columns of other
+     *  types (e.g. strings or lists) are skipped.
+     */
+    class ArrowFile {
+    public:
+        static std::unique_ptr<ArrowFile> open(const std::string& filename);
+        static std::unique_ptr<ArrowFile> read(const char* data, const size_t size, std::shared_ptr<const void> owner = nullptr);
+
+        const std::vector<std::string>& names() const { return this->fields; }
+        size_t batches() const { return this->columns.size(); }
+
+        size_t rows() const {
+            size_t total {0};
+            for (auto& batch : this->batch_rows) total += batch;
+            return total;
+        }
+
+        Column column(const size_t batch, const std::string& name) const {
+            /** Return the named column of a record batch, or an empty column
+             *  if there is no such numeric column
+             */
+            auto it = std::find(this->fields.begin(), this->fields.end(), name);
+            if (batch >= this->columns.size() || it == this->fields.end()) return Column();
+            return this->columns[batch][it - this->fields.begin()];
+        }
+
+    protected:
+        std::vector<std::string> fields;          /**< Names of the top-level fields */
+        std::vector<std::vector<Column>> columns; /**< Columns of each record batch, by field */
+        std::vector<size_t> batch_rows;           /**< Length of each record batch */
+    };
+
+    /** @class Colormap
+     *  @brief Maps numbers to colors through a 256-entry lookup table
+     *
+     *  Values are scaled linearly or logarithmically from range() onto the
+     *  table and clamped to its ends. NaNs (and nulls) become missing.
+     */
+    class Colormap {
+    public:
+        enum Scale { LINEAR, LOG };
+
+        Color missing {0}; /**< Color of NaN or null values */
+
+        Colormap(const std::vector<Color>& stops);
+        static Colormap viridis();
+        static Colormap magma();
+        static Colormap inferno();
+        static Colormap plasma();
+        static Colormap cividis();
+
+        Colormap& range(const double _lo, const double _hi, const Scale _scale = LINEAR) {
+            /** Set the values mapped to the ends of the table
+             *
+             *  A LOG scale needs positive values: a non-positive lo is raised to
+             *  six decades below hi, and if hi isn't positive either the scale
+             *  stays linear.
+             */
+            this->lo = _lo;
+            this->hi = _hi;
+            this->scale = (_scale == LOG && _hi > 0) ? LOG : LINEAR;
+            if (this->scale == LOG && _lo <= 0) this->lo = _hi * 1e-6;
+            return *this;
+        }
+
+        Color operator()(const double value) const {
+            uint32_t out;
+            this->map(&value, 1, &out);
+            return Color(out);
+        }
+
+        void map(const double* values, const size_t n, uint32_t* out) const;
+        Column map(const Column& values) const;
+
+    protected:
+        void map_linear(const double* values, const size_t n, const double lo, const double hi, uint32_t* out) const;
+
+        uint32_t table[256];
+        double lo {0};
+        double hi {1};
+        Scale scale {LINEAR};
+    };
+
+    /** @class Scatter
+     *  @brief A group of circles whose centers, radii and colors are read
+     *  from columns when the document is written
+     *
+     *  Nothing is copied or created per point, so documents with many
+     *  millions of points can be built from memory-mapped data. Colors are
+     *  packed as 0xRRGGBBAA. Points with a null coordinate are left out.
+     */
+    class Scatter : public Element {
+    public:
+        using Element::Element;
+        double radius {1}; /**< Radius of points without a size */
+
+        bool add(Column x, Column y, Column size = Column(), Column color = Column()) {
+            /** Add a batch of points, returning false if a coordinate column
+             *  is missing or the columns' lengths differ
+             */
+            const size_t n = x.size();
+            if (!x || !y || y.size() != n || (size && size.size() != n) || (color && color.size() != n))
+                return false;
+            this->batches.push_back({ std::move(x), std::move(y), std::move(size), std::move(color) });
+            this->measure(this->batches.back());
+            return true;
+        }
+
+        bool add(const ArrowFile& file, const std::string& x, const std::string& y,
+            const std::string& size = "", const std::string& color = "") {
+            /** Add every record batch of an Arrow file, using the named columns */
+            for (size_t i {0}; i < file.batches(); i++) {
+                if (!this->add(file.column(i, x), file.column(i, y),
+                    size.empty() ? Column() : file.column(i, size),
+                    color.empty() ? Column() : file.column(i, color))) return false;
+            }
+            return true;
+        }
+
+        size_t size() const {
+            /** Return the number of points, including any with null coordinates */
+            size_t total {0};
+            for (auto& batch : this->batches) total += batch.x.size();
+            return total;
+        }
+
+        Element::BoundingBox get_bbox() override;
+
+    protected:
+        struct Batch {
+            Column x, y, size, color;
+            Element::BoundingBox centers {NAN, NAN, NAN, NAN}; /**< Extents of the points drawn with the default radius */
+            Element::BoundingBox circles {NAN, NAN, NAN, NAN}; /**< Extents of the circles with a size */
+        };
+        std::vector<Batch> batches;
+
+        static void measure(Batch& batch);
+        double scale {1};      /**< Factor applied by quantize() */
+        bool integers {false}; /**< Whether quantize() was applied */
+
+        std::string tag() override { return "g"; }
+        bool write_start(std::string& out, const size_t indent_level) override;
+        void quantize_attrs(const double _scale) override {
+            Element::quantize_attrs(_scale);
+            this->scale *= _scale;
+            this->integers = true;
+        }
+
+        std::unique_ptr<Element> clone_node() override {
+            auto ret = std::make_unique<Scatter>(this->attr);
+            ret->radius = this->radius;
+            ret->batches = this->batches;
+            ret->scale = this->scale;
+            ret->integers = this->integers;
+            return ret;
+        }
     };
 
     class Polygon : public Element {
@@ -628,14 +3109,274 @@ namespace SVG {
         Polygon(const std::vector<Point>& points) {
             // Quick and dirty
             std::string& point_str = this->attr["points"];
-            for (auto& pt : points)
-                point_str += to_string(pt) + " ";
+            point_str.reserve(points.size() * 16);
+            for (auto& pt : points) {
+                util::append_fixed(point_str, pt);
+                point_str += ' ';
+            }
         };
 
     protected:
         std::string tag() override { return "polygon"; }
+        std::unique_ptr<Element> clone_node() override { return this->clone_as<Polygon>(); }
+    };
+
+    /** @class ConvexHull
+     *  @brief A polygon which is kept as the convex hull of every point or shape added to it
+     *
+     *  The points attribute is only rewritten when the hull has changed
+     *  since it was last serialized.
+     */
+    class ConvexHull : public Polygon {
+    public:
+        ConvexHull() = default;
+        using Polygon::Polygon;
+
+        ConvexHull(const std::vector<Point>& points) { this->add_points(points); }
+
+        ConvexHull& add_points(const std::vector<Point>& points) {
+            /** Merge a batch of points into the hull */
+            util::PointBuffer buffer;
+            buffer.reserve(points.size());
+            for (auto& pt : points) buffer.push_back(pt.first, pt.second);
+            return this->add_points(buffer);
+        }
+
+        ConvexHull& add_points(util::PointBuffer& points) {
+            /** Merge a batch of points into the hull (modifies the buffer) */
+            this->changed |= this->hull.insert(points);
+            return *this;
+        }
+
+        ConvexHull& add_shapes(const std::vector<Shape*>& shapes) {
+            /** Merge the bounding points of several shapes into the hull */
+            util::PointBuffer buffer;
+            buffer.reserve(4 * shapes.size());
+            for (auto& shp : shapes) shp->append_points(buffer);
+            return this->add_points(buffer);
+        }
+
+        std::vector<Point> points() const { return this->hull.points(); }
+
+    protected:
+        util::IncrementalHull hull;
+        bool changed {false}; /**< Whether the points attribute is out of date */
+
+        bool write_start(std::string& out, const size_t indent_level) override {
+            if (this->changed) {
+                this->update_attr("points", [this](std::string& point_str) {
+                    point_str.clear();
+                    for (auto& pt : this->hull.points()) {
+                        util::append_fixed(point_str, pt);
+                        point_str += ' ';
+                    }
+                });
+                this->changed = false;
+            }
+
+            return Polygon::write_start(out, indent_level);
+        }
+
+        void quantize_attrs(const double scale) override {
+            Polygon::quantize_attrs(scale);
+
+            util::IncrementalHull scaled;
+            this->update_attr("points", [&](std::string& point_str) {
+                point_str.clear();
+                for (auto& pt : this->hull.points()) {
+                    const double x = std::round(pt.first * scale), y = std::round(pt.second * scale);
+                    scaled.insert(x, y);
+                    util::append_int(point_str, (long long)x);
+                    point_str += ",";
+                    util::append_int(point_str, (long long)y);
+                    point_str += " ";
+                }
+            });
+
+            this->hull = std::move(scaled);
+            this->changed = false;
+        }
+
+        std::unique_ptr<Element> clone_node() override {
+            auto ret = std::make_unique<ConvexHull>();
+            ret->attr = this->attr;
+            ret->hull = this->hull;
+            ret->changed = this->changed;
+            return ret;
+        }
+    };
+
+    /** @class SpatialGrid
+     *  @brief A uniform grid over the centers of a set of shapes, for fast
+     *         nearest neighbor and radius queries
+     *
+     *  Shapes are bucketed by cell with a counting sort, so building (or
+     *  rebuilding) the grid takes two linear passes. Modifying the shapes
+     *  afterwards requires a rebuild.
+     */
+    template<typename T=Shape>
+    class SpatialGrid {
+    public:
+        SpatialGrid() = default;
+        SpatialGrid(const std::vector<T*>& shapes, const double cell_size=NAN) {
+            this->build(shapes, cell_size);
+        }
+
+        void build(const std::vector<T*>& shapes, double cell_size=NAN);
+        T* nearest(const double x, const double y) const;
+        std::vector<T*> within(const double x, const double y, const double radius) const;
+
+        size_t size() const { return this->shapes.size(); }
+        double cell_size() const { return this->cell; }
+
+    private:
+        static_assert(std::is_base_of<Shape, T>::value, "SpatialGrid elements must be shapes.");
+
+        double x0 {0}, y0 {0}, cell {1};
+        long cols {0}, rows {0};
+        std::vector<size_t> cell_start; /**< Offset of each cell's first shape, plus an end marker */
+        std::vector<double> xs, ys;     /**< Centers, ordered by cell */
+        std::vector<T*> shapes;         /**< Shapes, ordered by cell */
+
+        static long clamp_index(const double i, const long count) {
+            // Clamped before the cast, which is undefined for NaN and out of range values
+            if (!(i > 0)) return 0;
+            return i >= (double)(count - 1) ? count - 1 : (long)i;
+        }
+
+        long col_of(const double x) const {
+            return clamp_index(std::floor((x - x0) / cell), cols);
+        }
+
+        long row_of(const double y) const {
+            return clamp_index(std::floor((y - y0) / cell), rows);
+        }
     };
 
+    template<typename T>
+    inline void SpatialGrid<T>::build(const std::vector<T*>& input, double cell_size) {
+        /** (Re)build the grid from a set of shapes, skipping those without a finite center
+         *
+         *  @param[in] cell_size Width and height of each cell; if NAN, it is chosen
+         *                       so that each cell holds about two shapes on average
+         */
+        util::PointBuffer centers;
+        std::vector<T*> valid;
+        centers.reserve(input.size());
+        valid.reserve(input.size());
+
+        for (auto& shp : input) {
+            const double x = shp->x(), y = shp->y();
+            if (!std::isfinite(x) || !std::isfinite(y)) continue;
+            centers.push_back(x, y);
+            valid.push_back(shp);
+        }
+
+        const size_t n = valid.size();
+        const QuadCoord ext = util::extents(centers.x.data(), centers.y.data(), n);
+        const double width = n ? ext.x2 - ext.x1 : 0, height = n ? ext.y2 - ext.y1 : 0;
+        if (isnan(cell_size) || cell_size <= 0) {
+            // Also keep the number of cells linear in n for very thin extents
+            const double count = (double)std::max((size_t)1, n);
+            cell_size = std::max(std::sqrt(2 * width * height / count),
+                std::max(width, height) / (2 * count));
+            if (!(cell_size > 0)) cell_size = 1; // All centers coincide
+        }
+
+        this->x0 = n ? ext.x1 : 0;
+        this->y0 = n ? ext.y1 : 0;
+        this->cell = cell_size;
+        this->cols = (long)(width / cell_size) + 1;
+        this->rows = (long)(height / cell_size) + 1;
+
+        // Counting sort by cell
+        std::vector<size_t> cell_of(n);
+        this->cell_start.assign((size_t)(this->cols * this->rows) + 1, 0);
+        for (size_t i {0}; i < n; i++) {
+            cell_of[i] = (size_t)(this->row_of(centers.y[i]) * this->cols + this->col_of(centers.x[i]));
+            this->cell_start[cell_of[i] + 1]++;
+        }
+        for (size_t c {1}; c < this->cell_start.size(); c++)
+            this->cell_start[c] += this->cell_start[c - 1];
+
+        std::vector<size_t> next(this->cell_start.begin(), this->cell_start.end() - 1);
+        this->xs.resize(n);
+        this->ys.resize(n);
+        this->shapes.resize(n);
+        for (size_t i {0}; i < n; i++) {
+            const size_t pos = next[cell_of[i]]++;
+            this->xs[pos] = centers.x[i];
+            this->ys[pos] = centers.y[i];
+            this->shapes[pos] = valid[i];
+        }
+    }
+
+    template<typename T>
+    inline T* SpatialGrid<T>::nearest(const double x, const double y) const {
+        /** Return the shape whose center is closest to (x, y), or nullptr if
+         *  the grid is empty or (x, y) is not finite
+         *
+         *  Rings of cells around (x, y) are searched until no unsearched
+         *  cell can contain anything closer than the best match.
+         */
+        if (this->shapes.empty() || !std::isfinite(x) || !std::isfinite(y)) return nullptr;
+
+        const long col = this->col_of(x), row = this->row_of(y);
+        T* best = nullptr;
+        double best_dist = INFINITY;
+
+        for (long r {0}; ; r++) {
+            const long c1 = col - r, c2 = col + r, r1 = row - r, r2 = row + r;
+            for (long j = std::max(r1, 0L); j <= std::min(r2, rows - 1); j++) {
+                // Only the border of the ring is new
+                const bool full_row = (j == r1 || j == r2);
+                for (long i = std::max(c1, 0L); i <= std::min(c2, cols - 1);
+                    i += (full_row || i == c2) ? 1 : std::max(1L, c2 - i)) {
+                    const size_t c = (size_t)(j * cols + i);
+                    for (size_t k = cell_start[c]; k < cell_start[c + 1]; k++) {
+                        const double dist = (xs[k] - x) * (xs[k] - x) + (ys[k] - y) * (ys[k] - y);
+                        if (!best || dist < best_dist) {
+                            best_dist = dist;
+                            best = shapes[k];
+                        }
+                    }
+                }
+            }
+
+            // Distance from (x, y) to the edge of the searched region
+            const double margin = std::min(
+                std::min(x - (x0 + c1 * cell), x0 + (c2 + 1) * cell - x),
+                std::min(y - (y0 + r1 * cell), y0 + (r2 + 1) * cell - y));
+            const bool covered = c1 <= 0 && r1 <= 0 && c2 >= cols - 1 && r2 >= rows - 1;
+            if (covered || (best && margin > 0 && best_dist <= margin * margin))
+                return best;
+        }
+    }
+
+    template<typename T>
+    inline std::vector<T*> SpatialGrid<T>::within(const double x, const double y, const double radius) const {
+        /** Return all shapes whose centers are within radius of (x, y), or
+         *  none if (x, y) is not finite or radius is NAN
+         */
+        std::vector<T*> ret;
+        if (this->shapes.empty() || !std::isfinite(x) || !std::isfinite(y) || isnan(radius))
+            return ret;
+
+        const double r2 = radius * radius;
+        const long col1 = this->col_of(x - radius), col2 = this->col_of(x + radius),
+            row1 = this->row_of(y - radius), row2 = this->row_of(y + radius);
+
+        for (long j = row1; j <= row2; j++) {
+            for (size_t k = cell_start[(size_t)(j * cols + col1)],
+                end = cell_start[(size_t)(j * cols + col2) + 1]; k < end; k++) {
+                if ((xs[k] - x) * (xs[k] - x) + (ys[k] - y) * (ys[k] - y) <= r2)
+                    ret.push_back(shapes[k]);
+            }
+        }
+
+        return ret;
+    }
+
 inline Element::BoundingBox Line::get_bbox() {
     return { x1(), x2(), y1(), y2() };
 }
@@ -644,16 +3385,15 @@ inline Element::BoundingBox Line::get_bbox() {
 //always works for straight lines, but sometimes not for curves
 inline Element::BoundingBox Path::get_bbox()
 {
-    Element::BoundingBox tmp{0, 0, 0, 0};
-    for(auto p : points)
-    {
-        if(p.first < tmp.x1) tmp.x1 = p.first;
-        if(p.second < tmp.y1) tmp.y1 = p.second;
-        if(p.first > tmp.x2) tmp.x2 = p.first;
-        if(p.second > tmp.y2) tmp.y2 = p.second;
-    }
+    if(!from_origin && extents.x1 <= extents.x2)
+        return extents;
 
-    return tmp;
+    return {
+        std::min(0.0, extents.x1),
+        std::max(0.0, extents.x2),
+        std::min(0.0, extents.y1),
+        std::max(0.0, extents.y2)
+    };
 }
 
 inline Element::BoundingBox Rect::get_bbox() {
@@ -673,12 +3413,218 @@ inline Element::BoundingBox Circle::get_bbox() {
     };
 }
 
-    inline std::pair<double, double> Line::along(double percent) {
-        /** Return the coordinates required to place an element along
-         *   this line
-         */
-
-        double x_pos, y_pos;
+    inline Colormap::Colormap(const std::vector<Color>& stops) {
+        /** Interpolate evenly spaced stops into the lookup table */
+        for (size_t i {0}; i < 256; i++) {
+            if (stops.size() < 2) {
+                this->table[i] = stops.empty() ? 0 : stops[0].rgba;
+                continue;
+            }
+
+            const double t = i / 255.0 * (stops.size() - 1);
+            const size_t j = std::min((size_t)t, stops.size() - 2);
+            const double f = t - j;
+            uint32_t rgba {0};
+            for (int shift {24}; shift >= 0; shift -= 8) {
+                const double a = (stops[j].rgba >> shift) & 0xff, b = (stops[j + 1].rgba >> shift) & 0xff;
+                rgba |= (uint32_t)(a + (b - a) * f + 0.5) << shift;
+            }
+            this->table[i] = rgba;
+        }
+    }
+
+    inline Colormap Colormap::viridis() {
+        return Colormap({ Color(0x440154ff), Color(0x48186aff), Color(0x472d7bff), Color(0x424086ff),
+            Color(0x3b528bff), Color(0x33638dff), Color(0x2c728eff), Color(0x26828eff), Color(0x21918cff),
+            Color(0x1fa088ff), Color(0x28ae80ff), Color(0x3fbc73ff), Color(0x5ec962ff), Color(0x84d44bff),
+            Color(0xaddc30ff), Color(0xd8e219ff), Color(0xfde725ff) });
+    }
+
+    inline Colormap Colormap::magma() {
+        return Colormap({ Color(0x000004ff), Color(0x0a0822ff), Color(0x1d1147ff), Color(0x36106bff),
+            Color(0x51127cff), Color(0x6a1c81ff), Color(0x832681ff), Color(0x9c2e7fff), Color(0xb73779ff),
+            Color(0xd0416fff), Color(0xe75263ff), Color(0xf56b5cff), Color(0xfc8961ff), Color(0xfea772ff),
+            Color(0xfec488ff), Color(0xfde2a3ff), Color(0xfcfdbfff) });
+    }
+
+    inline Colormap Colormap::inferno() {
+        return Colormap({ Color(0x000004ff), Color(0x0b0724ff), Color(0x210c4aff), Color(0x3d0965ff),
+            Color(0x57106eff), Color(0x71196eff), Color(0x8a226aff), Color(0xa32c61ff), Color(0xbc3754ff),
+            Color(0xd24644ff), Color(0xe45a31ff), Color(0xf1731dff), Color(0xf98e09ff), Color(0xfcac11ff),
+            Color(0xf9cb35ff), Color(0xf2ea69ff), Color(0xfcffa4ff) });
+    }
+
+    inline Colormap Colormap::plasma() {
+        return Colormap({ Color(0x0d0887ff), Color(0x310597ff), Color(0x4c02a1ff), Color(0x6600a7ff),
+            Color(0x7e03a8ff), Color(0x9511a1ff), Color(0xaa2395ff), Color(0xbc3587ff), Color(0xcc4778ff),
+            Color(0xda5a6aff), Color(0xe66c5cff), Color(0xf0804eff), Color(0xf89540ff), Color(0xfdac33ff),
+            Color(0xfdc527ff), Color(0xf8df25ff), Color(0xf0f921ff) });
+    }
+
+    inline Colormap Colormap::cividis() {
+        return Colormap({ Color(0x00224eff), Color(0x002e6aff), Color(0x1a386fff), Color(0x32436dff),
+            Color(0x434e6cff), Color(0x535a6dff), Color(0x61656fff), Color(0x6f7073ff), Color(0x7d7c78ff),
+            Color(0x8c8878ff), Color(0x9b9476ff), Color(0xaba072ff), Color(0xbcae6cff), Color(0xcdbb63ff),
+            Color(0xdec958ff), Color(0xf0d846ff), Color(0xfee838ff) });
+    }
+
+    inline void Colormap::map_linear(const double* values, const size_t n,
+        const double lo, const double hi, uint32_t* out) const {
+        /** Look up the colors of values scaled linearly from [lo, hi] */
+        const double k = hi > lo ? 255 / (hi - lo) : 0;
+        size_t i {0};
+
+#if defined(SVG_USE_AVX) || defined(SVG_USE_SSE2)
+        // Scale and clamp a vector at a time; NaNs survive min() and max(),
+        // then truncate to a negative index
+        using namespace util::simd;
+        const Vec v_lo = set1(lo), v_k = set1(k), zero = set1(0), top = set1(255), half = set1(0.5);
+        int32_t index[LANES];
+        for (; i + LANES <= n; i += LANES) {
+            const Vec t = mul(sub(load(values + i), v_lo), v_k);
+            truncate(index, add(max(zero, min(top, t)), half));
+            for (size_t j {0}; j < LANES; j++)
+                out[i + j] = index[j] < 0 ? this->missing.rgba : this->table[index[j]];
+        }
+#endif
+        for (; i < n; i++) {
+            const double t = (values[i] - lo) * k;
+            out[i] = std::isnan(t) ? this->missing.rgba :
+                this->table[(int)(std::max(0.0, std::min(255.0, t)) + 0.5)];
+        }
+    }
+
+    inline void Colormap::map(const double* values, const size_t n, uint32_t* out) const {
+        /** Write the packed color of each of the n values to out */
+        if (this->scale == LINEAR) {
+            this->map_linear(values, n, this->lo, this->hi, out);
+            return;
+        }
+
+        // Take logarithms a block at a time (non-positive values become NaN or -inf)
+        double logs[256];
+        for (size_t i {0}; i < n; i += 256) {
+            const size_t count = std::min(n - i, (size_t)256);
+            for (size_t j {0}; j < count; j++)
+                logs[j] = values[i + j] > 0 ? std::log(values[i + j]) : (values[i + j] == 0 ? -INFINITY : NAN);
+            this->map_linear(logs, count, std::log(this->lo), std::log(this->hi), out + i);
+        }
+    }
+
+    inline Column Colormap::map(const Column& values) const {
+        /** Return an owned column of the packed colors of values,
+         *  e.g. for the color of a Scatter
+         */
+        auto colors = std::make_shared<std::vector<uint32_t>>(values.size());
+        uint32_t* out = colors->data();
+        if (const double* doubles = values.doubles())
+            this->map(doubles, values.size(), out);
+        else {
+            double buffer[256];
+            for (size_t i {0}; i < values.size(); i += 256) {
+                const size_t count = std::min(values.size() - i, (size_t)256);
+                for (size_t j {0}; j < count; j++)
+                    buffer[j] = values.valid(i + j) ? values[i + j] : NAN;
+                this->map(buffer, count, out + i);
+            }
+        }
+        return Column(out, colors->size(), colors);
+    }
+
+    inline void Scatter::measure(Scatter::Batch& batch) {
+        /** Find the extents of a new batch, so that get_bbox() doesn't need to scan it again */
+        const double *xs = batch.x.doubles(), *ys = batch.y.doubles();
+        if (xs && ys && !batch.size) {
+            // Common case: a vectorized scan of the coordinates
+            const QuadCoord ext = util::extents(xs, ys, batch.x.size());
+            batch.centers = Element::BoundingBox(ext.x1, ext.x2, ext.y1, ext.y2);
+            return;
+        }
+
+        double lo[4] = { INFINITY, INFINITY, INFINITY, INFINITY }, hi[4] = { -INFINITY, -INFINITY, -INFINITY, -INFINITY };
+        for (size_t i {0}; i < batch.x.size(); i++) {
+            if (!batch.x.valid(i) || !batch.y.valid(i)) continue;
+            const double x = batch.x[i], y = batch.y[i];
+            if (batch.size && batch.size.valid(i)) {
+                const double r = batch.size[i];
+                lo[2] = std::min(lo[2], x - r); hi[2] = std::max(hi[2], x + r);
+                lo[3] = std::min(lo[3], y - r); hi[3] = std::max(hi[3], y + r);
+            }
+            else {
+                lo[0] = std::min(lo[0], x); hi[0] = std::max(hi[0], x);
+                lo[1] = std::min(lo[1], y); hi[1] = std::max(hi[1], y);
+            }
+        }
+        if (lo[0] <= hi[0]) batch.centers = Element::BoundingBox(lo[0], hi[0], lo[1], hi[1]);
+        if (lo[2] <= hi[2]) batch.circles = Element::BoundingBox(lo[2], hi[2], lo[3], hi[3]);
+    }
+
+    inline Element::BoundingBox Scatter::get_bbox() {
+        /** Compute the extents of every point's circle */
+        Element::BoundingBox box(NAN, NAN, NAN, NAN);
+        for (auto& batch : this->batches) {
+            box = box + batch.circles + Element::BoundingBox(batch.centers.x1 - this->radius,
+                batch.centers.x2 + this->radius, batch.centers.y1 - this->radius, batch.centers.y2 + this->radius);
+        }
+        return box;
+    }
+
+    inline bool Scatter::write_start(std::string& out, const size_t indent_level) {
+        /** Write the group and all of its points */
+        out.append(indent_level, '\t');
+        out += "<g";
+        for (auto& pair: attr)
+            out += " " + pair.first + "=" + "\"" + pair.second + "\"";
+        if (!this->size()) {
+            out += " />";
+            return false;
+        }
+        out += ">\n";
+
+        auto number = [this, &out](const double value) {
+            if (this->integers) util::append_int(out, std::llround(value * this->scale));
+            else util::append_short(out, value);
+        };
+
+        for (auto& batch : this->batches) {
+            for (size_t i {0}; i < batch.x.size(); i++) {
+                if (!batch.x.valid(i) || !batch.y.valid(i)) continue;
+                out.append(indent_level + 1, '\t');
+                out += "<circle cx=\"";
+                number(batch.x[i]);
+                out += "\" cy=\"";
+                number(batch.y[i]);
+                out += '"';
+
+                if (batch.color && batch.color.valid(i)) {
+                    const uint32_t rgba = batch.color.rgba(i);
+                    out += " fill=\"";
+                    util::append_color(out, rgba);
+                    out += '"';
+                    if ((rgba & 0xff) != 0xff) {
+                        out += " fill-opacity=\"";
+                        util::append_short(out, (rgba & 0xff) / 255.0);
+                        out += '"';
+                    }
+                }
+
+                out += " r=\"";
+                number((batch.size && batch.size.valid(i)) ? batch.size[i] : this->radius);
+                out += "\" />\n";
+            }
+        }
+
+        out.append(indent_level, '\t');
+        out += "</g>";
+        return false;
+    }
+
+    inline std::pair<double, double> Line::along(double percent) {
+        /** Return the coordinates required to place an element along
+         *   this line
+         */
+
+        double x_pos, y_pos;
 
         if (x1() != x2()) {
             double length = percent * this->length();
@@ -707,34 +3653,80 @@ inline Element::BoundingBox Circle::get_bbox() {
 
     inline std::string Element::svg_to_string(const size_t indent_level) {
         /** Return the string representation of an SVG element
+         *
+         *  Descendants are visited by following sibling and parent links
+         *  rather than by recursion, so any nesting depth is supported.
          *
          *  @param[out] indent_level The current level of indentation
          */
-         
-        auto indent = std::string(indent_level, '\t');
-        std::string ret = indent + "<" + tag();
+        std::string ret;
+        if (!this->write_start(ret, indent_level)) return ret;
+
+        Element* node = this->first_node;
+        size_t depth = indent_level + 1;
+        while (true) {
+            const size_t mark = ret.size();
+            if (node->write_start(ret, depth)) {
+                node = node->first_node;
+                depth++;
+                continue;
+            }
 
-        // Set attributes
-        for (auto& pair: attr)
-            ret += " " + pair.first + "=" + "\"" + pair.second + "\"";
+            // Avoid adding empty strings
+            if (ret.size() != mark) ret += "\n";
+
+            // Close every element whose last child has been written
+            while (!node->next_node) {
+                node = node->parent_node;
+                node->write_end(ret, --depth);
+                if (node == this) return ret;
+                ret += "\n";
+            }
+            node = node->next_node;
+        }
+    }
 
-        if (!this->children.empty()) {
-            ret += ">\n";
+    inline bool Element::write_start(std::string& out, const size_t indent_level) {
+        /** Write this element's opening tag (or its only tag, if it has no children)
+         *
+         *  @returns Whether children should be written, followed by write_end()
+         */
+        out.append(indent_level, '\t');
+        out += "<" + tag();
 
-            // Recursively get strings for child elements
-            for (auto& child : children) {
-                // Avoid adding empty strings
-                auto str = child->svg_to_string(indent_level + 1);
-                if (str.size()) ret += str +"\n";
+        // Set attributes
+        for (auto& pair: attr)
+            out += " " + pair.first + "=" + "\"" + pair.second + "\"";
+
+        if (this->deferred) {
+            // Content which hasn't been read is written as is, followed by any
+            // children added after it turned out to be malformed
+            out += ">";
+            out.append(this->deferred->begin, this->deferred->end);
+            if (this->first_node) {
+                out += "\n";
+                return true;
             }
+            out += "</" + tag() + ">";
+            return false;
+        }
 
-            return ret += indent + "</" + tag() + ">";
+        if (this->first_node) {
+            out += ">\n";
+            return true;
         }
 
-        return ret += " />";
+        out += " />";
+        return false;
+    }
+
+    inline void Element::write_end(std::string& out, const size_t indent_level) {
+        /** Write this element's closing tag */
+        out.append(indent_level, '\t');
+        out += "</" + tag() + ">";
     }
 
-    inline std::string to_string(const std::map<std::string, AttributeMap>& css, const size_t indent_level) {
+    inline std::string to_string(const SelectorProperties& css, const size_t indent_level) {
         /** Print out a CSS attribute block */
         auto indent = std::string(indent_level, '\t'), ret = std::string();
         for (auto& selector : css) {
@@ -747,37 +3739,560 @@ inline Element::BoundingBox Circle::get_bbox() {
         return ret;
     }
 
-    inline std::string SVG::Style::svg_to_string(const size_t indent_level) {
-        /** Create a CSS stylesheet */
+    inline bool SVG::Style::write_start(std::string& out, const size_t indent_level) {
+        /** Write a CSS stylesheet, or nothing if it is empty */
         auto indent = std::string(indent_level, '\t');
 
         if (!this->css.empty() || !this->keyframes.empty()) {
-            std::string ret = indent + "<style type=\"text/css\">\n" +
+            out += indent + "<style type=\"text/css\">\n" +
                 indent + "\t<![CDATA[\n";
 
             // Begin CSS stylesheet
-            ret += to_string(this->css, indent_level);
+            out += to_string(this->css, indent_level);
 
-            // Animation frames
+            // Animation frames: stops with identical properties share one rule
             for (auto& anim : this->keyframes) {
-                ret += indent + "\t\t@keyframes " + anim.first + " {\n" +
-                    to_string(anim.second, indent_level + 1) +
-                    indent + "\t\t" + "}\n";
+                out += indent + "\t\t@keyframes " + anim.first + " {\n";
+                auto by_value = [](const SVGAttrib* left, const SVGAttrib* right) { return *left < *right; };
+                std::map<const SVGAttrib*, size_t, decltype(by_value)> index(by_value);
+                std::vector<std::pair<std::string, const SVGAttrib*>> rules;
+                const int decimals = anim.second.decimals();
+
+                for (auto& stop : anim.second) {
+                    auto found = index.insert({ &stop.second.attr, rules.size() });
+                    if (found.second)
+                        rules.push_back({ Keyframes::format_offset(stop.first, decimals), &stop.second.attr });
+                    else
+                        rules[found.first->second].first += ", " + Keyframes::format_offset(stop.first, decimals);
+                }
+
+                for (auto& rule : rules) {
+                    out += indent + "\t\t\t" + rule.first + " {\n";
+                    for (auto& attr : *rule.second)
+                        out += indent + "\t\t\t\t" + attr.first + ": " + attr.second + ";\n";
+                    out += indent + "\t\t\t" + "}\n";
+                }
+                out += indent + "\t\t" + "}\n";
             }
 
-            ret += indent + "\t]]>\n";
-            return ret + indent + "</style>";
+            out += indent + "\t]]>\n";
+            out += indent + "</style>";
         }
 
-        return "";
+        return false;
     }
 
-    inline std::string Text::svg_to_string(const size_t indent_level) {
-        auto indent = std::string(indent_level, '\t');
-        std::string ret = indent + "<text";
+    inline Element* SVG::get_element_by_id(const std::string& id) {
+        /** Return the descendant with a certain id, using an index which is
+         *  built on first use and kept up to date afterwards
+         */
+        if (!this->indexed) this->rebuild_index();
+        else if (this->index_stale) return Element::get_element_by_id(id); // Within a transaction
+
+        auto it = this->id_index.find(id);
+        if (it != this->id_index.end()) {
+            auto current = it->second->attr.find("id");
+            if (current != it->second->attr.end() && current->second == id) return it->second;
+            this->id_index.erase(it);
+        }
+
+        // Ids written to attr directly are not tracked
+        Element* found = Element::get_element_by_id(id);
+        if (found) this->id_index[id] = found;
+        return found;
+    }
+
+    inline void SVG::rebuild_index() {
+        /** Index all descendants by id, preferring the first in document order */
+        this->id_index.clear();
+        // Subtrees which haven't been read are left to the fallback search
+        for (Element* node = this->first_node; node; node = node->first_node ? node->first_node : node->next_outside(this)) {
+            auto id = node->attr.find("id");
+            if (id != node->attr.end()) this->id_index.emplace(id->second, node);
+        }
+
+        this->indexed = true;
+        this->index_stale = false;
+        this->update_observer();
+    }
+
+    inline void SVG::take_state(SVG& other) {
+        /** Take over the indexes, log and definitions of an SVG whose children were moved into this one */
+        this->css = other.css;
+        this->defs = other.defs;
+        other.css = nullptr;
+        other.defs = nullptr;
+        this->def_index = std::move(other.def_index);
+        this->nodes = std::move(other.nodes);
+        this->id_index = std::move(other.id_index);
+        this->indexed = other.indexed;
+        this->index_stale = false; // Documents aren't moved during transactions
+        this->mutation_log = std::move(other.mutation_log);
+        this->open_transactions = 0;
+        this->journal.clear();
+
+        other.def_index.clear();
+        other.id_index.clear();
+        other.indexed = other.index_stale = false;
+        this->update_observer();
+    }
+
+    inline void SVG::commit() {
+        /** Rebuild derived structures once for all changes made during a transaction */
+        if (this->index_stale) this->rebuild_index();
+        this->journal.clear();
+        this->update_observer();
+    }
+
+    inline void SVG::observe(const Mutation kind, Element* target, const std::string& key, const std::string* old,
+        const size_t old_size) {
+        /** Keep the id index and mutation log up to date with changes to descendants */
+        if (this->mutation_log && !this->mutation_log->applying) this->record(kind, target, key, old, old_size);
+
+        const bool attr_only = (kind == SET_ATTR || kind == APPEND_ATTR);
+        const bool reindex = this->indexed && (!attr_only || key == "id");
+        if (this->open_transactions) {
+            this->journal.push_back({ kind, reindex });
+            this->index_stale |= reindex;
+            return;
+        }
+        else if (!reindex) return;
+
+        if (attr_only) {
+            // Only target itself changed
+            auto id = target->attr.find("id");
+            const std::string previous = (kind == APPEND_ATTR) ? id->second.substr(0, old_size) : old ? *old : "";
+            if (kind == APPEND_ATTR || old) {
+                auto entry = this->id_index.find(previous);
+                if (entry != this->id_index.end() && entry->second == target) this->id_index.erase(entry);
+            }
+            if (id != target->attr.end()) this->index_id(id->second, target);
+            return;
+        }
+
+        for (Element* node = target; node; node = node->next_in_subtree(target)) {
+            auto id = node->attr.find("id");
+            if (id == node->attr.end()) continue;
+
+            if (kind == REMOVE_CHILD) {
+                auto entry = this->id_index.find(id->second);
+                if (entry != this->id_index.end() && entry->second == node) this->id_index.erase(entry);
+            }
+            else this->index_id(id->second, node);
+        }
+    }
+
+    inline void SVG::index_id(const std::string& id, Element* node) {
+        /** Add a descendant to the id index unless an element before it in
+         *  document order has the same id, like rebuild_index()
+         */
+        Element*& entry = this->id_index[id];
+        if (entry && entry != node) {
+            auto current = entry->attr.find("id");
+            if (current != entry->attr.end() && current->second == id && precedes(entry, node)) return;
+        }
+        entry = node;
+    }
+
+    inline void SVG::start_log() {
+        /** Start recording changes to this document's descendants in a new log
+         *
+         *  Recorded changes can be undone, redone, and replayed onto a copy of
+         *  the document made when logging started. Only one SVG in a tree should
+         *  log at a time, since logs refer to elements by handles.
+         */
+        this->mutation_log = std::make_unique<MutationLog>();
+        for (Element* node = this; node; node = node->next_in_subtree(this))
+            this->mutation_log->base.push_back(this->handle(node).bits);
+        this->update_observer();
+    }
+
+    inline void SVG::record(const Mutation kind, Element* target, const std::string& key, const std::string* old,
+        const size_t old_size) {
+        /** Append a change to the mutation log */
+        auto& log = *this->mutation_log;
+        MutationLog::Entry entry;
+        entry.kind = kind;
+
+        if (kind == SET_ATTR) {
+            entry.target = this->handle(target).bits;
+            entry.key = key;
+            entry.had_old = (old != nullptr);
+            if (old) entry.old_value = *old;
+
+            auto current = target->attr.find(key);
+            entry.has_new = (current != target->attr.end());
+            if (entry.has_new) entry.new_value = current->second;
+        }
+        else if (kind == APPEND_ATTR) {
+            // Only the text appended is kept, so building up an attribute costs linear space
+            entry.target = this->handle(target).bits;
+            entry.key = key;
+            entry.old_size = old_size;
+            entry.new_value = target->attr.find(key)->second.substr(old_size);
+        }
+        else {
+            entry.parent = this->handle(target->parent_node).bits;
+            entry.before = target->next_node ? this->handle(target->next_node).bits : 0;
+            log.truncate();
+            entry.slot = log.parked.size();
+            log.parked.emplace_back();
+            log.snapshots.emplace_back();
+
+            if (kind == INSERT_CHILD) {
+                // Keep a copy of the subtree for replay()
+                std::vector<std::pair<Element*, Element*>> pairs;
+                auto& snapshot = log.snapshots.back();
+                snapshot.copy = target->clone_tree(&pairs);
+                for (auto& pair : pairs) snapshot.handles.push_back(this->handle(pair.first).bits);
+            }
+            else log.last_removal = entry.slot;
+            entry.target = this->handle(target).bits;
+        }
+
+        log.append(entry);
+    }
+
+    inline std::unique_ptr<Element> SVG::remove(Element* elem) {
+        /** Detach an element such that its removal can be undone while logging
+         *
+         *  @returns The element, unless it is kept by the mutation log
+         */
+        auto node = elem->detach();
+        if (node && this->mutation_log && this->mutation_log->last_removal != SIZE_MAX) {
+            this->mutation_log->parked[this->mutation_log->last_removal] = std::move(node);
+            this->mutation_log->last_removal = SIZE_MAX;
+        }
+        return node;
+    }
+
+    inline bool SVG::apply(const MutationLog::Entry& entry, const bool forward) {
+        /** Apply (or revert) a logged change to this document */
+        auto& log = *this->mutation_log;
+        Element* target = this->resolve(Handle<>(entry.target));
+
+        if (entry.kind == SET_ATTR) {
+            if (!target) return false;
+            if (forward ? entry.has_new : entry.had_old)
+                target->set_attr(entry.key, forward ? entry.new_value : entry.old_value);
+            else target->remove_attr(entry.key);
+            return true;
+        }
+
+        if (entry.kind == APPEND_ATTR) {
+            auto current = target ? target->attr.find(entry.key) : SVGAttrib::iterator();
+            if (!target || current == target->attr.end() ||
+                current->second.size() != entry.old_size + (forward ? 0 : entry.new_value.size())) return false;
+            if (forward) target->set_attr(entry.key) << entry.new_value.c_str();
+            else target->update_attr(entry.key, [&entry](std::string& value) { value.resize(entry.old_size); });
+            return true;
+        }
+
+        // Insertions are reverted by removals and vice versa
+        if ((entry.kind == INSERT_CHILD) != forward) {
+            if (!target || !target->parent_node) return false;
+            log.parked[entry.slot] = target->detach();
+            return true;
+        }
+
+        Element* parent = this->resolve(Handle<>(entry.parent));
+        Element* before = entry.before ? this->resolve(Handle<>(entry.before)) : nullptr;
+        if (!log.parked[entry.slot] || !parent || (entry.before && !before)) return false;
+        parent->insert_before(std::move(log.parked[entry.slot]), before);
+        return true;
+    }
+
+    inline bool SVG::undo() {
+        /** Revert the latest logged change which hasn't been undone
+         *
+         *  Fails for removals made by calling detach() directly rather than remove(),
+         *  since the removed element isn't kept
+         */
+        if (!this->mutation_log || !this->mutation_log->cursor) return false;
+        auto& log = *this->mutation_log;
+        log.applying = true;
+        const bool success = this->apply(log.read(log.cursor - 1), false);
+        log.applying = false;
+        if (success) log.cursor--;
+        return success;
+    }
+
+    inline bool SVG::redo() {
+        /** Reapply the latest change reverted by undo() */
+        if (!this->mutation_log || this->mutation_log->cursor == this->mutation_log->size()) return false;
+        auto& log = *this->mutation_log;
+        log.applying = true;
+        const bool success = this->apply(log.read(log.cursor), true);
+        log.applying = false;
+        if (success) log.cursor++;
+        return success;
+    }
+
+    inline bool SVG::replay(Element& replica) {
+        /** Apply all logged changes which haven't been undone to a copy of this
+         *  document made (e.g. by clone()) when logging started
+         *
+         *  @returns false if replica doesn't match or a change couldn't be applied
+         */
+        if (!this->mutation_log) return false;
+        auto& log = *this->mutation_log;
+
+        std::unordered_map<uint32_t, Element*> elements;
+        size_t i {0};
+        for (Element* node = &replica; node; node = node->next_in_subtree(&replica), i++) {
+            if (i >= log.base.size()) return false;
+            elements[log.base[i]] = node;
+        }
+        if (i != log.base.size()) return false;
+
+        auto find = [&elements](const uint32_t key) -> Element* {
+            auto it = elements.find(key);
+            return it == elements.end() ? nullptr : it->second;
+        };
+
+        for (size_t k {0}; k < log.cursor; k++) {
+            auto entry = log.read(k);
+            Element* target = find(entry.target);
+            if (entry.kind == SET_ATTR) {
+                if (!target) return false;
+                if (entry.has_new) target->set_attr(entry.key, entry.new_value);
+                else target->remove_attr(entry.key);
+            }
+            else if (entry.kind == APPEND_ATTR) {
+                auto current = target ? target->attr.find(entry.key) : SVGAttrib::iterator();
+                if (!target || current == target->attr.end() || current->second.size() != entry.old_size) return false;
+                target->set_attr(entry.key) << entry.new_value.c_str();
+            }
+            else if (entry.kind == REMOVE_CHILD) {
+                if (!target) return false;
+                target->detach();
+                elements.erase(entry.target);
+            }
+            else {
+                Element* parent = find(entry.parent);
+                Element* before = entry.before ? find(entry.before) : nullptr;
+                auto& snapshot = log.snapshots[entry.slot];
+                if (!parent || (entry.before && !before) || !snapshot.copy) return false;
+
+                std::vector<std::pair<Element*, Element*>> pairs;
+                parent->insert_before(snapshot.copy->clone_tree(&pairs), before);
+                for (size_t j {0}; j < pairs.size(); j++) elements[snapshot.handles[j]] = pairs[j].second;
+            }
+        }
+
+        return true;
+    }
+
+    inline std::vector<Element*> SVG::changed_since(const size_t position) {
+        /** Return the outermost elements changed since a position in the mutation
+         *  log, i.e. the subtrees which need to be written again
+         */
+        std::vector<Element*> ret;
+        if (!this->mutation_log) return ret;
+
+        std::set<Element*> changed;
+        auto& log = *this->mutation_log;
+        for (size_t k = position; k < log.cursor; k++) {
+            auto entry = log.read(k);
+            const bool attr_only = (entry.kind == SET_ATTR || entry.kind == APPEND_ATTR);
+            Element* elem = this->resolve(Handle<>(attr_only ? entry.target : entry.parent));
+            if (elem) changed.insert(elem);
+        }
+
+        for (auto& elem : changed) {
+            // Skip elements nested in other changes or no longer in this document
+            bool outermost {true};
+            Element* ancestor = elem;
+            while (ancestor != this && ancestor->parent_node && outermost) {
+                ancestor = ancestor->parent_node;
+                outermost = !changed.count(ancestor);
+            }
+            if (outermost && (ancestor == this)) ret.push_back(elem);
+        }
+
+        return ret;
+    }
+
+    inline void SVG::hoist_styles() {
+        /** Move the stylesheets of all nested SVGs into this one, so that each
+         *  rule and animation is written once
+         *
+         *  Rules which are identical in every nested SVG that has them are
+         *  hoisted as is. Rules whose declarations differ between nested SVGs,
+         *  or from a rule this SVG already has, are scoped to each SVG by id.
+         *  Animations with conflicting definitions are renamed for every SVG
+         *  but the first, along with references to them in the nested
+         *  stylesheet and inline styles.
+         */
+        std::vector<SVG*> styled;
+        for (auto& child : this->get_children<SVG>())
+            if (child->css) styled.push_back(child);
+        if (styled.empty()) return;
+
+        auto scope_id = [&styled](SVG* child) {
+            /** Return the id of a nested SVG, assigning one if necessary */
+            if (child->attr.find("id") == child->attr.end()) {
+                const size_t index = std::find(styled.begin(), styled.end(), child) - styled.begin();
+                child->set_attr("id", "svg_" + std::to_string(index));
+            }
+            return child->attr["id"];
+        };
+
+        auto rename = [](std::string& value, const std::string& from, const std::string& to) {
+            /** Rename an animation in the value of an animation(-name) declaration */
+            std::stringstream tokens(value);
+            std::string token, renamed;
+            while (tokens >> token) {
+                const bool comma = token.back() == ',';
+                if (comma) token.pop_back();
+                renamed += (renamed.empty() ? "" : " ") + (token == from ? to : token) +
+                    (comma ? "," : "");
+            }
+            value = renamed;
+        };
+
+        auto rename_inline = [&rename](std::string& style, const std::string& from, const std::string& to) {
+            /** Rename an animation in an inline style attribute */
+            std::stringstream decls(style);
+            std::string decl, renamed;
+            while (std::getline(decls, decl, ';')) {
+                const size_t colon = decl.find(':');
+                if (colon != std::string::npos) {
+                    const size_t begin = decl.find_first_not_of(" \t\n"),
+                        end = decl.find_last_not_of(" \t\n", colon - 1);
+                    const std::string prop = (begin < colon) ? decl.substr(begin, end - begin + 1) : "";
+                    if (prop == "animation" || prop == "animation-name") {
+                        std::string value = decl.substr(colon + 1);
+                        rename(value, from, to);
+                        decl = decl.substr(0, colon + 1) + " " + value;
+                    }
+                }
+                renamed += (renamed.empty() ? "" : ";") + decl;
+            }
+            if (!style.empty() && style.back() == ';') renamed += ";";
+            style = renamed;
+        };
+
+        auto inline_styled = [this, &styled](SVG* child) {
+            /** Return child and its descendants with inline styles, except
+             *  those in another nested SVG with its own stylesheet
+             */
+            std::vector<Element*> ret, nodes = child->get_children_helper();
+            nodes.push_back(child);
+            for (auto& node : nodes) {
+                if (node->attr.find("style") == node->attr.end()) continue;
+                Element* owner = node;
+                while (owner && owner != this &&
+                    std::find(styled.begin(), styled.end(), owner) == styled.end())
+                    owner = owner->parent_node;
+                if (owner == child) ret.push_back(node);
+            }
+            return ret;
+        };
+
+        // Animations: rename conflicting definitions and their references,
+        // in both the nested stylesheet and inline styles
+        Style* root_css = this->stylesheet();
+        for (auto& child : styled) {
+            std::vector<Element*> inlined;
+            bool found_inline = false;
+            for (auto& anim : child->css->keyframes) {
+                auto existing = root_css->keyframes.find(anim.first);
+                if (existing == root_css->keyframes.end()) {
+                    root_css->keyframes[anim.first] = anim.second;
+                    continue;
+                }
+                else if (existing->second == anim.second) continue;
+
+                const std::string name = anim.first + "_" + scope_id(child);
+                root_css->keyframes[name] = anim.second;
+                for (auto& rule : child->css->css) {
+                    for (auto& decl : rule.second.attr)
+                        if (decl.first == "animation" || decl.first == "animation-name")
+                            rename(decl.second, anim.first, name);
+                }
+
+                if (!found_inline) {
+                    inlined = inline_styled(child);
+                    found_inline = true;
+                }
+                for (auto& node : inlined) {
+                    std::string style = node->attr["style"];
+                    rename_inline(style, anim.first, name);
+                    node->set_attr("style", std::move(style));
+                }
+            }
+        }
+
+        // Rules: hoist if all definitions agree, otherwise scope them
+        std::map<std::string, std::vector<std::pair<SVG*, AttributeMap*>>> rules;
+        for (auto& child : styled)
+            for (auto& rule : child->css->css)
+                rules[rule.first].push_back({ child, &rule.second });
+
+        for (auto& rule : rules) {
+            // Rules must also agree with one this SVG already has
+            auto& uses = rule.second;
+            auto existing = root_css->css.find(rule.first);
+            const bool agree = std::all_of(uses.begin(), uses.end(),
+                [&uses](const std::pair<SVG*, AttributeMap*>& use) { return *use.second == *uses[0].second; }) &&
+                (existing == root_css->css.end() || existing->second == *uses[0].second);
+
+            if (agree) {
+                for (auto& decl : uses[0].second->attr)
+                    root_css->css[rule.first].attr[decl.first] = decl.second;
+                continue;
+            }
+
+            for (auto& use : uses) {
+                // Prefix each selector in a selector list
+                const std::string prefix = "#" + scope_id(use.first) + " ";
+                std::stringstream selectors(rule.first);
+                std::string selector, scoped;
+                while (std::getline(selectors, selector, ',')) {
+                    selector.erase(0, selector.find_first_not_of(" \t\n"));
+                    scoped += (scoped.empty() ? "" : ", ") + prefix + selector;
+                }
+                root_css->css[scoped] = *use.second;
+            }
+        }
+
+        // Remove nested stylesheets
+        for (auto& child : styled) {
+            child->css->detach(); // Deleted by unique_ptr
+            child->css = nullptr;
+        }
+    }
+
+    inline bool Text::write_start(std::string& out, const size_t indent_level) {
+        out.append(indent_level, '\t');
+        out += "<text";
+        for (auto& pair: attr)
+            out += " " + pair.first + "=" + "\"" + pair.second + "\"";
+        out += ">" + this->content;
+        if (this->first_node) {
+            // Children added to the content, e.g. <tspan>s
+            out += "\n";
+            return true;
+        }
+        out += "</text>";
+        return false;
+    }
+
+    inline bool Generic::write_start(std::string& out, const size_t indent_level) {
+        if (this->content.empty()) return Element::write_start(out, indent_level);
+        out.append(indent_level, '\t');
+        out += "<" + this->name;
         for (auto& pair: attr)
-            ret += " " + pair.first + "=" + "\"" + pair.second + "\"";
-        return ret += ">" + this->content + "</text>";
+            out += " " + pair.first + "=" + "\"" + pair.second + "\"";
+        out += ">" + this->content;
+        if (this->first_node) {
+            // Children added after the content (e.g. to malformed markup read lazily)
+            out += "\n";
+            return true;
+        }
+        out += "</" + this->name + ">";
+        return false;
     }
 
     inline void Element::autoscale(const double margin) {
@@ -799,10 +4314,17 @@ inline Element::BoundingBox Circle::get_bbox() {
          *
          *  @param[in] margins Extra margins for the sides
          */
-        using std::stof;
-
         Element::BoundingBox bbox = this->get_bbox();
-        this->get_bbox(bbox); // Compute the bounding box (recursive)
+        this->get_bbox(bbox); // Include all descendants
+        this->fit_to(bbox, margins);
+    }
+
+    inline void Element::fit_to(const Element::BoundingBox& bbox, const Margins& margins) {
+        /** Set the width, height, and viewBox attribute of this item so that it
+         *  contains bbox, like autoscale() but for a box which is already known
+         *
+         *  @param[in] margins Extra margins for the sides
+         */
         double width = abs(bbox.x1) + abs(bbox.x2) + margins.x1 + margins.x2;
         double height = abs(bbox.y1) + abs(bbox.y2) + margins.y1 + margins.y2;
         double x1 = bbox.x1 - margins.x1;
@@ -822,11 +4344,191 @@ inline Element::BoundingBox Circle::get_bbox() {
         }
     }
 
+    inline void Element::spatial_sort(const bool force) {
+        /** Reorder sibling shapes along a Hilbert curve through their bounding box
+         *  centers, so that nearby shapes are written next to each other
+         *  (which compresses better and renders more incrementally)
+         *
+         *  Each run of consecutive children with a bounding box is sorted
+         *  separately, in this element and all of its descendants. Elements
+         *  which are (or contain) anything transformed end a run, since their
+         *  boxes don't show where they are drawn, and boxes are widened by the
+         *  width of any stroke (set by attributes) before checking for overlaps.
+         *
+         *  @param[in] force Also reorder runs containing overlapping shapes,
+         *                   whose stacking order may then change
+         */
+        auto containers = this->get_children_helper();
+        containers.push_back(this);
+
+        struct Stroke {
+            bool stroked {false};
+            double width {1}; /**< The widest stroke-width seen */
+        };
+        auto inspect = [](Element* node, Stroke& stroke) {
+            /** Note node's stroke, returning false if it's transformed */
+            auto it = node->attr.find("transform");
+            if (it != node->attr.end() && !util::identity_transform(it->second)) return false;
+            it = node->attr.find("style");
+            if (it != node->attr.end()) {
+                if (it->second.find("transform") != std::string::npos) return false;
+                if (it->second.find("stroke") != std::string::npos) stroke.width = INFINITY;
+            }
+            it = node->attr.find("stroke");
+            if (it != node->attr.end()) stroke.stroked |= (it->second != "none");
+            it = node->attr.find("stroke-width");
+            if (it != node->attr.end()) stroke.width = std::max(stroke.width, std::strtod(it->second.c_str(), nullptr));
+            return true;
+        };
+
+        for (auto& container : containers) {
+            // Strokes are inherited from the container and its ancestors, whose
+            // transforms apply to all of its children alike
+            Stroke inherited;
+            for (Element* node = container; node; node = node->parent_node) inspect(node, inherited);
+
+            Element* next = container->first_node;
+            while (next) {
+                // Find the next run of children with a bounding box
+                std::vector<Element*> run;
+                std::vector<QuadCoord> boxes;
+                for (; next; next = next->next_node) {
+                    auto box = next->get_bbox();
+                    if (isnan(box.x1) || isnan(box.x2) || isnan(box.y1) || isnan(box.y2)) break;
+
+                    Stroke stroke = inherited;
+                    bool plain {true};
+                    for (Element* node = next; node && plain; node = node->next_in_subtree(next))
+                        plain = inspect(node, stroke);
+                    if (!plain || std::isinf(stroke.width)) break;
+
+                    // Miters (up to the default limit) reach twice the stroke width past the outline
+                    const double margin = stroke.stroked ? 2 * stroke.width : 0;
+                    box = Element::BoundingBox(box.x1 - margin, box.x2 + margin, box.y1 - margin, box.y2 + margin);
+
+                    run.push_back(next);
+                    boxes.push_back(box);
+                }
+                if (next) next = next->next_node; // Skip the element ending the run
+
+                if (boxes.size() < 2 || (!force && util::any_overlap(boxes))) continue;
+
+                // Map centers onto the curve's grid
+                util::PointBuffer centers;
+                centers.reserve(boxes.size());
+                for (auto& box : boxes) centers.push_back((box.x1 + box.x2) / 2, (box.y1 + box.y2) / 2);
+                const QuadCoord ext = util::extents(centers.x.data(), centers.y.data(), centers.size());
+                const double grid = (double)((1 << 16) - 1),
+                    scale = grid / std::max(std::max(ext.x2 - ext.x1, ext.y2 - ext.y1), 1e-12);
+
+                std::vector<std::pair<uint64_t, size_t>> keys(boxes.size());
+                for (size_t i {0}; i < keys.size(); i++) {
+                    keys[i].first = util::hilbert_index(
+                        (uint32_t)std::min(grid, (centers.x[i] - ext.x1) * scale),
+                        (uint32_t)std::min(grid, (centers.y[i] - ext.y1) * scale));
+                    keys[i].second = i; // Ties keep their original order
+                }
+                util::parallel_sort(keys.begin(), keys.end(), std::less<std::pair<uint64_t, size_t>>());
+
+                // Relink the run in sorted order ahead of whatever followed it
+                Element* after = run.back()->next_node;
+                for (auto& key : keys) container->insert_before(run[key.second]->detach(), after);
+            }
+        }
+    }
+
+    inline void Element::quantize_map(SVGAttrib& attr, const double scale) {
+        /** Scale and round all coordinates and lengths in a set of attributes
+         *  (or CSS properties), leaving percentages as they are
+         */
+        static const std::set<std::string> lengths = {
+            "x", "y", "width", "height", "cx", "cy", "r", "rx", "ry", "x1", "x2", "y1", "y2",
+            "fx", "fy", "dx", "dy", "stroke-width", "stroke-dasharray", "stroke-dashoffset", "font-size"
+        };
+        auto all = [](const std::string&, size_t) { return true; };
+
+        for (auto& pair : attr) {
+            std::string& value = pair.second;
+            if (lengths.count(pair.first)) {
+                if (value.find('%') == std::string::npos)
+                    value = util::quantize_numbers(value, scale, all);
+            }
+            else if (pair.first == "points" || pair.first == "viewBox") {
+                value = util::quantize_numbers(value, scale, all);
+            }
+            else if (pair.first == "d") {
+                // Arcs: only the radii and end point are lengths
+                value = util::quantize_numbers(value, scale, [](const std::string& cmd, size_t i) {
+                    return !(cmd == "A" || cmd == "a") || i % 7 < 2 || i % 7 > 4;
+                });
+            }
+            else if (pair.first == "transform") {
+                value = util::quantize_numbers(value, scale, [](const std::string& func, size_t i) {
+                    return func == "translate" || (func == "rotate" && i > 0) || (func == "matrix" && i > 3);
+                });
+            }
+        }
+    }
+
+    inline void Element::quantize(const double tolerance) {
+        /** Rescale all coordinates so that they can be written as integers, moving
+         *  each one by at most tolerance, and adjust the viewBox to compensate
+         *
+         *  The scale is the smallest power of ten that satisfies the tolerance.
+         *  This should be called on the outermost element, after autoscale().
+         *  If there is no viewBox, one covering the width and height (or if those
+         *  are not set, the bounding box) is added first.
+         *
+         *  @param[in] tolerance Largest acceptable error for any coordinate; nothing
+         *                       is changed unless it is positive and finite
+         */
+        const double scale = std::pow(10.0, std::ceil(std::log10(0.5 / tolerance)));
+        if (!(tolerance > 0) || !(scale > 0) || !std::isfinite(scale)) return;
+
+        if (this->attr.find("viewBox") == this->attr.end()) {
+            auto to_px = [](const std::string& length) {
+                /** Convert an absolute length to user units, or NAN if that isn't possible */
+                static const std::map<std::string, double> units = {
+                    { "", 1 }, { "px", 1 }, { "mm", 96 / 25.4 }, { "cm", 96 / 2.54 },
+                    { "in", 96 }, { "pt", 96.0 / 72 }, { "pc", 16 }
+                };
+                char* end;
+                const double value = std::strtod(length.c_str(), &end);
+                auto unit = units.find(end);
+                return (end != length.c_str() && unit != units.end()) ? value * unit->second : NAN;
+            };
+
+            auto width = this->attr.find("width"), height = this->attr.find("height");
+            double w = NAN, h = NAN;
+            if (width != this->attr.end() && height != this->attr.end()) {
+                w = to_px(width->second);
+                h = to_px(height->second);
+            }
+
+            std::string viewbox = "0 0 ";
+            if (isnan(w) || isnan(h)) {
+                Element::BoundingBox bbox = this->get_bbox();
+                this->get_bbox(bbox);
+                viewbox = to_string(bbox.x1) + " " + to_string(bbox.y1) + " ";
+                w = bbox.x2 - bbox.x1;
+                h = bbox.y2 - bbox.y1;
+            }
+
+            this->set_attr("viewBox", viewbox + to_string(w) + " " + to_string(h));
+        }
+
+        // This element's own size and position are in its parent's units
+        auto all = [](const std::string&, size_t) { return true; };
+        this->update_attr("viewBox", [&](std::string& value) { value = util::quantize_numbers(value, scale, all); });
+
+        for (auto& child : this->get_children_helper())
+            child->quantize_attrs(scale);
+    }
+
     inline void Element::get_bbox(Element::BoundingBox& box) {
-        /** Recursively compute a bounding box */
-        auto this_bbox = this->get_bbox();
-        box = this_bbox + box; // Take union of both
-        for (auto& child: this->children) child->get_bbox(box); // Recursion
+        /** Compute a bounding box containing this element and all of its descendants */
+        for (Element* node = this; node; node = node->next_in_subtree(this))
+            box = node->get_bbox() + box; // Take union of both
     }
 
     inline Element::ChildMap Element::get_children() {
@@ -842,48 +4544,468 @@ inline Element::BoundingBox Circle::get_bbox() {
         std::deque<Element*> temp;
         std::vector<Element*> ret;
 
-        for (auto& child : this->children) { temp.push_back(child.get()); }
+        for (Element* child = this->first_child(); child; child = child->next_node) temp.push_back(child);
         while (!temp.empty()) {
             ret.push_back(temp.front());
-            for (auto& child : temp.front()->children) { temp.push_back(child.get()); }
+            for (Element* child = temp.front()->first_child(); child; child = child->next_node) temp.push_back(child);
             temp.pop_front();
         }
 
         return ret;
     }
 
-    inline SVG merge(SVG& left, SVG& right, const Margins& margins) {
-        /** Merge two SVG documents together horizontally with a uniform margin */
-        SVG ret;
+    inline std::vector<SVG::PassReport> SVG::Optimizer::run(Element& root) const {
+        /** Run all passes in order, timing each one and measuring how much
+         *  it shrinks the markup
+         */
+        std::vector<PassReport> reports;
+        long long size = (long long)std::string(root).size();
 
-        // Move items
-        ret << std::move(left) << std::move(right);
+        for (auto& pass : this->passes) {
+            auto start = std::chrono::steady_clock::now();
+            pass.second(root);
+            std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
 
-        // Set bounding box of individual pieces
-        for (auto& svg_child: ret.get_immediate_children<SVG>())
-            svg_child->autoscale(margins);
+            const long long new_size = (long long)std::string(root).size();
+            reports.push_back({ pass.first, elapsed.count(), size - new_size });
+            size = new_size;
+        }
 
-        // Set x position for child SVG elements, and compute width/height for this
-        double x {0}, height {0};
-        for (auto& svg_child: ret.get_immediate_children<SVG>()) {
-            svg_child->set_attr("x", x).set_attr("y", 0);
+        return reports;
+    }
+
+    inline SVG::Optimizer SVG::Optimizer::defaults() {
+        /** Return the built-in passes, in an order where each one can
+         *  take advantage of the previous ones
+         */
+        Optimizer ret;
+        ret.add("prune_styles", prune_styles)
+            .add("remove_defaults", remove_defaults)
+            .add("merge_transforms", merge_transforms)
+            .add("collapse_groups", collapse_groups)
+            .add("drop_empty_groups", drop_empty_groups);
+        return ret;
+    }
+
+    inline void SVG::Optimizer::drop_empty_groups(Element& root) {
+        /** Delete groups without children (and which have no id someone could refer to) */
+        std::vector<Element*> groups;
+        for (Element* node = root.first_child(); node; node = node->next_in_subtree(&root))
+            if (typeid(*node) == typeid(Group)) groups.push_back(node);
+
+        // Descendants come after their ancestors, so groups emptied by this pass are also removed
+        for (auto it = groups.rbegin(); it != groups.rend(); ++it) {
+            Element* group = *it;
+            if (!group->first_node && group->attr.find("id") == group->attr.end())
+                group->detach();
+        }
+    }
+
+    inline void SVG::Optimizer::remove_defaults(Element& root) {
+        /** Remove presentation attributes which are set to their initial value
+         *
+         *  Inherited properties are only removed if no ancestor (and no CSS rule
+         *  or inline style anywhere in the document) sets them.
+         */
+        struct Default {
+            const char* name;
+            const char* value;
+            bool inherited;
+        };
+        static const Default defaults[] = {
+            { "opacity", "1", false }, { "stop-opacity", "1", false }, { "transform", "", false },
+            { "fill-opacity", "1", true }, { "stroke", "none", true }, { "stroke-opacity", "1", true },
+            { "stroke-width", "1", true }, { "stroke-dasharray", "none", true },
+            { "stroke-dashoffset", "0", true }, { "stroke-linecap", "butt", true },
+            { "stroke-linejoin", "miter", true }, { "stroke-miterlimit", "4", true },
+            { "fill-rule", "nonzero", true }, { "clip-rule", "nonzero", true },
+            { "visibility", "visible", true }
+        };
+        const size_t count = sizeof(defaults) / sizeof(defaults[0]);
+        const uint32_t all = (1u << count) - 1;
+
+        auto is_default = [](const Default& def, const std::string& value) {
+            if (value == def.value) return true;
+            char* end;
+            const double number = std::strtod(value.c_str(), &end);
+            return *def.value && end != value.c_str() && *end == '\0' &&
+                number == std::strtod(def.value, nullptr);
+        };
+
+        auto properties = [&](const SVGAttrib& attr) {
+            /** Return which inherited properties are set by a set of attributes */
+            uint32_t mask {0};
+            for (size_t i {0}; i < count; i++)
+                if (defaults[i].inherited && attr.find(defaults[i].name) != attr.end()) mask |= 1u << i;
+            return mask;
+        };
+
+        // Properties set by CSS can't be removed anywhere
+        uint32_t css {0};
+        for (Element* node = &root; node; node = node->next_in_subtree(&root)) {
+            if (node->attr.find("style") != node->attr.end()) css = all;
+            if (typeid(*node) != typeid(Style)) continue;
+            for (auto& rule : ((Style*)node)->css) css |= properties(rule.second.attr);
+            for (auto& frames : ((Style*)node)->keyframes)
+                for (auto& stop : frames.second) css |= properties(stop.second.attr);
+        }
+
+        // Pre-order walk, tracking the properties set by each element's ancestors
+        std::vector<std::pair<Element*, uint32_t>> stack = { { &root, css } };
+        while (!stack.empty()) {
+            Element* node = stack.back().first;
+            uint32_t inherited = stack.back().second;
+            stack.pop_back();
+
+            for (size_t i {0}; i < count; i++) {
+                auto it = node->attr.find(defaults[i].name);
+                if (it == node->attr.end()) continue;
+                if ((!defaults[i].inherited || !(inherited & (1u << i))) && is_default(defaults[i], it->second))
+                    node->remove_attr(defaults[i].name);
+                else if (defaults[i].inherited) inherited |= 1u << i;
+            }
+
+            for (Element* child = node->last_child(); child; child = child->prev_node)
+                stack.push_back({ child, inherited });
+        }
+    }
+
+    inline void SVG::Optimizer::collapse_groups(Element& root) {
+        /** Replace groups without attributes nested in other groups by their children */
+        std::vector<Element*> groups;
+        for (Element* node = root.first_child(); node; node = node->next_in_subtree(&root))
+            if (typeid(*node) == typeid(Group) && node->attr.empty() &&
+                node->parent_node && typeid(*node->parent_node) == typeid(Group))
+                groups.push_back(node);
+
+        // Outermost first, so that every child is moved at most once
+        for (auto& group : groups) {
+            Element* parent = group->parent_node;
+            while (group->first_node) parent->insert_before(group->first_node->detach(), group);
+            group->detach();
+        }
+    }
+
+    inline void SVG::Optimizer::merge_transforms(Element& root) {
+        /** Fold groups which only apply a transform to a single child into that child */
+        auto transformable = [](Element* elem) {
+            const std::type_info& type = typeid(*elem);
+            return type == typeid(Group) || type == typeid(Path) || type == typeid(Rect) ||
+                type == typeid(Circle) || type == typeid(Line) || type == typeid(Polygon) ||
+                type == typeid(ConvexHull) || type == typeid(Text);
+        };
+
+        std::vector<Element*> groups;
+        for (Element* node = root.first_child(); node; node = node->next_in_subtree(&root))
+            if (typeid(*node) == typeid(Group) && node->attr.size() == 1 && node->attr.count("transform"))
+                groups.push_back(node);
+
+        // Outermost first, so chains of transforms end up on the innermost element
+        for (auto& group : groups) {
+            Element* child = group->first_node;
+            if (!child || child != group->last_node || !transformable(child)) continue;
+
+            auto it = child->attr.find("transform");
+            std::string transform = group->attr["transform"];
+            if (it != child->attr.end()) transform += " " + it->second;
+            child->set_attr("transform", std::move(transform));
+            group->parent_node->insert_before(child->detach(), group);
+            group->detach();
+        }
+    }
+
+    inline void SVG::Optimizer::prune_styles(Element& root) {
+        /** Shrink stylesheets: drop selectors which can't match any element,
+         *  animations which aren't used, and merge rules with identical declarations
+         *
+         *  Selectors are checked against indexes of the tags, ids and classes in
+         *  the document; pseudo-classes and attribute selectors are assumed to
+         *  match. Rules are only merged if that doesn't change the order of any
+         *  other rule setting one of their properties to a different value.
+         */
+        std::set<std::string> tags, ids, classes;
+        std::vector<Style*> sheets;
+        bool inline_animations {false};
+
+        for (Element* node = &root; node; node = node->next_in_subtree(&root)) {
+            tags.insert(node->tag());
+            if (typeid(*node) == typeid(Style)) sheets.push_back((Style*)node);
+
+            auto id = node->attr.find("id"), cls = node->attr.find("class"), style = node->attr.find("style");
+            if (id != node->attr.end()) ids.insert(id->second);
+            if (cls != node->attr.end()) {
+                std::stringstream names(cls->second);
+                std::string name;
+                while (names >> name) classes.insert(name);
+            }
+            if (style != node->attr.end() && style->second.find("animation") != std::string::npos)
+                inline_animations = true;
+        }
+
+        auto split = [](const std::string& selector) {
+            /** Split a selector list on commas outside of brackets */
+            std::vector<std::string> ret(1);
+            int depth {0};
+            for (const char c : selector) {
+                if (c == '(' || c == '[') depth++;
+                else if (c == ')' || c == ']') depth--;
+                if (c == ',' && !depth) ret.emplace_back();
+                else ret.back() += c;
+            }
+            for (auto& part : ret) {
+                part.erase(0, part.find_first_not_of(" \t\n"));
+                part.erase(part.find_last_not_of(" \t\n") + 1);
+            }
+            return ret;
+        };
+
+        auto may_match = [&](const std::string& selector) {
+            /** Whether every tag, id and class in a selector occurs in the document */
+            auto ident = [](const char c) { return isalnum((unsigned char)c) || c == '-' || c == '_'; };
+            for (size_t i {0}; i < selector.size();) {
+                const char c = selector[i];
+                if (c == ' ' || c == '>' || c == '+' || c == '~' || c == '*') { i++; continue; }
+                if (c == '[' || c == ':') {
+                    // Assume attribute selectors and pseudo-classes match
+                    int depth {0};
+                    for (i++; i < selector.size(); i++) {
+                        const char d = selector[i];
+                        if (d == '(' || d == '[') depth++;
+                        else if ((d == ')' || d == ']') && depth-- == 0) { i++; break; }
+                        else if (!depth && !ident(d) && d != ':') break;
+                    }
+                    continue;
+                }
+
+                const bool id = (c == '#'), cls = (c == '.');
+                if (!id && !cls && !ident(c)) return true; // Not understood
+                size_t end = i + (id || cls);
+                while (end < selector.size() && ident(selector[end])) end++;
+                if (end < selector.size() && selector[end] == '\\') return true;
+
+                const std::string name = selector.substr(i + (id || cls), end - i - (id || cls));
+                if (!(id ? ids : cls ? classes : tags).count(name)) return false;
+                i = end;
+            }
+            return true;
+        };
+
+        auto conflict = [](const SVGAttrib& a, const SVGAttrib& b) {
+            /** Whether two declaration blocks set a property to different values */
+            for (auto it = a.begin(), jt = b.begin(); it != a.end() && jt != b.end();) {
+                if (it->first < jt->first) ++it;
+                else if (jt->first < it->first) ++jt;
+                else if (it->second != jt->second) return true;
+                else ++it, ++jt;
+            }
+            return false;
+        };
+
+        for (auto& sheet : sheets) {
+            // Unmatched selectors
+            SelectorProperties kept;
+            for (auto& rule : sheet->css) {
+                if (rule.first.empty() || rule.first[0] == '@') {
+                    kept.insert(std::move(rule));
+                    continue;
+                }
+
+                std::string key;
+                for (auto& part : split(rule.first)) {
+                    if (!may_match(part)) continue;
+                    if (!key.empty()) key += ", ";
+                    key += part;
+                }
+                if (key.empty()) continue;
+                if (kept.count(key) || sheet->css.count(key)) key = rule.first; // Don't merge by accident
+                kept.insert({ key, std::move(rule.second) });
+            }
+
+            // Identical declarations: each rule covers a range of the original
+            // (sorted) rules, and may only move relative to rules it conflicts with
+            // if it doesn't change their order
+            struct Rule {
+                std::string key;
+                AttributeMap* block;
+                size_t lo, hi; /**< First and last original rule merged into this one */
+                bool alive;
+            };
+            std::vector<Rule> rules;
+            for (auto& rule : kept) rules.push_back({ rule.first, &rule.second, rules.size(), rules.size(), true });
+
+            auto by_value = [](const SVGAttrib* left, const SVGAttrib* right) { return *left < *right; };
+            std::map<const SVGAttrib*, std::vector<size_t>, decltype(by_value)> groups(by_value);
+            for (size_t i {0}; i < rules.size(); i++)
+                if (rules[i].key[0] != '@') groups[&rules[i].block->attr].push_back(i);
+
+            std::set<std::string> keys;
+            for (auto& rule : rules) keys.insert(rule.key);
+            for (auto& group : groups) {
+                auto& members = group.second;
+                if (members.size() < 2) continue;
+
+                std::string key = rules[members[0]].key;
+                for (size_t i {1}; i < members.size(); i++) key += ", " + rules[members[i]].key;
+                const size_t lo = members.front(), hi = members.back();
+                bool safe = !keys.count(key);
+
+                for (size_t j {0}; safe && j < rules.size(); j++) {
+                    const Rule& other = rules[j];
+                    if (!other.alive || std::binary_search(members.begin(), members.end(), j)) continue;
+                    if (!conflict(*group.first, other.block->attr)) continue;
+                    safe = (key < other.key) ? (hi < other.lo) : (lo > other.hi);
+                }
+                if (!safe) continue;
+
+                for (auto& i : members) rules[i].alive = false;
+                rules[members[0]] = { key, rules[members[0]].block, lo, hi, true };
+                keys.insert(key);
+            }
+
+            sheet->css.clear();
+            for (auto& rule : rules)
+                if (rule.alive) sheet->css.insert({ rule.key, std::move(*rule.block) });
+
+            // Unused animations
+            if (inline_animations) continue;
+            std::set<std::string> used;
+            for (auto& other : sheets) {
+                for (auto& rule : other->css) {
+                    for (auto& decl : rule.second.attr) {
+                        if (decl.first != "animation" && decl.first != "animation-name") continue;
+                        std::string token;
+                        for (const char c : decl.second + " ") {
+                            if (isalnum((unsigned char)c) || c == '-' || c == '_') token += c;
+                            else if (!token.empty()) {
+                                used.insert(token);
+                                token.clear();
+                            }
+                        }
+                    }
+                }
+            }
+
+            for (auto it = sheet->keyframes.begin(); it != sheet->keyframes.end();)
+                it = used.count(it->first) ? std::next(it) : sheet->keyframes.erase(it);
+        }
+    }
+
+    inline void SVG::Optimizer::merge_shapes(Element& root) {
+        /** Replace runs of consecutive sibling circles, rectangles and lines with
+         *  identical attributes (other than their geometry) by one compound path
+         *
+         *  This isn't one of the defaults: where merged shapes overlap, strokes
+         *  and translucent fills are painted once for the whole path rather than
+         *  shape by shape, and CSS rules selecting by tag no longer match.
+         *  Shapes with an id or a rotated rectangle's transform are left alone.
+         */
+        auto geometry = [](Element* elem, const std::string& key) {
+            /** Whether an attribute is part of an element's geometry */
+            const std::type_info& type = typeid(*elem);
+            if (type == typeid(Circle)) return key == "cx" || key == "cy" || key == "r";
+            if (type == typeid(Line)) return key == "x1" || key == "x2" || key == "y1" || key == "y2";
+            if (key == "transform") {
+                // Rectangles are created with a rotation, which is ignored if it's zero
+                const std::string& value = elem->attr.find(key)->second;
+                return value.compare(0, 7, "rotate(") == 0 && std::strtod(value.c_str() + 7, nullptr) == 0;
+            }
+            return key == "x" || key == "y" || key == "width" || key == "height";
+        };
+
+        auto mergeable = [](Element* elem) {
+            const std::type_info& type = typeid(*elem);
+            return (type == typeid(Circle) || type == typeid(Rect) || type == typeid(Line)) &&
+                !elem->attr.count("id") && !elem->attr.count("rx") && !elem->attr.count("ry");
+        };
+
+        auto same_style = [&geometry](Element* a, Element* b) {
+            /** Compare attributes, skipping each element's geometry */
+            auto it = a->attr.begin(), jt = b->attr.begin();
+            while (true) {
+                while (it != a->attr.end() && geometry(a, it->first)) ++it;
+                while (jt != b->attr.end() && geometry(b, jt->first)) ++jt;
+                if (it == a->attr.end() || jt == b->attr.end())
+                    return it == a->attr.end() && jt == b->attr.end();
+                if (*it != *jt) return false;
+                ++it, ++jt;
+            }
+        };
+
+        auto merge_run = [&geometry](Element* first, Element* end) {
+            Element* parent = first->parent_node;
+            auto path = parent->insert_before(std::make_unique<Path>(), first);
+            for (auto& pair : first->attr)
+                if (!geometry(first, pair.first)) path->attr.insert(pair);
+
+            for (Element* shape = first; shape != end;) {
+                Element* next = shape->next_node;
+                const std::type_info& type = typeid(*shape);
+                if (type == typeid(Circle)) {
+                    auto circle = (Circle*)shape;
+                    path->add_circle(circle->x(), circle->y(), circle->radius());
+                }
+                else if (type == typeid(Rect)) {
+                    auto rect = (Rect*)shape;
+                    path->add_rect(rect->x(), rect->y(), rect->width(), rect->height());
+                }
+                else {
+                    auto line = (Line*)shape;
+                    path->add_line(line->x1(), line->y1(), line->x2(), line->y2());
+                }
+                shape->detach();
+                shape = next;
+            }
+        };
+
+        for (Element* container = &root; container; container = container->next_in_subtree(&root)) {
+            // Find runs of shapes with the same style among this element's children
+            Element* child = container->first_child();
+            while (child) {
+                if (!mergeable(child)) {
+                    child = child->next_node;
+                    continue;
+                }
+
+                Element* end = child->next_node;
+                size_t length {1};
+                for (; end && mergeable(end) && same_style(child, end); end = end->next_node) length++;
+                if (length > 1) merge_run(child, end);
+                child = end;
+            }
+        }
+    }
+
+    inline SVG merge(SVG& left, SVG& right, const Margins& margins) {
+        /** Merge two SVG documents together horizontally with a uniform margin */
+        SVG ret;
+
+        // Move items
+        ret << std::move(left) << std::move(right);
+
+        // Set bounding box of individual pieces
+        for (auto& svg_child: ret.get_immediate_children<SVG>())
+            svg_child->autoscale(margins);
+
+        // Set x position for child SVG elements, and compute width/height for this
+        double x {0}, height {0};
+        for (auto& svg_child: ret.get_immediate_children<SVG>()) {
+            svg_child->set_attr("x", x).set_attr("y", 0);
             x += svg_child->width();
             height = std::max(height, svg_child->height());
         }
 
         ret.set_attr("width", x).set_attr("height", height);
+        ret.hoist_styles();
         return ret;
     }
 
-    inline std::vector<Point> bounding_polygon(std::vector<Shape*>& shapes) {
-        /* Convert shapes into sets of points, aggregate them, and then calculate
-         * convex hull for aggregate set
+    inline std::vector<Point> bounding_polygon(const std::vector<Shape*>& shapes) {
+        /* Write the points of every shape into one preallocated flat buffer,
+         * and then calculate convex hull for aggregate set
          */
-        std::vector<Point> points;
-        for (auto& shp : shapes) {
-            auto temp_points = shp->points();
-            std::move(temp_points.begin(), temp_points.end(), std::back_inserter(points));
-        }
+        util::PointBuffer points;
+        points.reserve(4 * shapes.size());
+        for (auto& shp : shapes) shp->append_points(points);
 
         return util::convex_hull(points);
     }
@@ -926,6 +5048,7 @@ inline Element::BoundingBox Circle::get_bbox() {
         // Set viewbox
         root.set_attr("viewBox") << 0 << " " << 0 << " " << total_width << " " << total_height;
         root.set_attr("width", total_width).set_attr("height", total_height);
+        root.hoist_styles();
         return root;
     }
 
@@ -946,22 +5069,22 @@ inline Element::BoundingBox Circle::get_bbox() {
 
         // Move frames into new SVG
         for (auto& frame : frames) {
-            std::string frame_id = "frame_" + to_string(current_frame);
+            std::string frame_id = "frame_" + std::to_string(current_frame);
             frame.set_attr("id", frame_id).set_attr("class", "animated");
             root.style("#" + frame_id).set_attr("animation-name",
-                "anim_" + to_string(current_frame));
+                "anim_" + std::to_string(current_frame));
             current_frame++;
             root << std::move(frame);
         }
 
         // Set animation frames
         for (size_t  i {0}, ilen = frames.size(); i < ilen; i++) {
-            auto& anim = root.keyframes("anim_" + to_string(i));
+            auto& anim = root.keyframes("anim_" + std::to_string(i));
             double begin_pct = (double)i / frames.size(),
                 end_pct = (double)(i + 1) / frames.size();
-            anim["0%"].set_attr("opacity", 0);
-            anim[to_string(begin_pct * 100) + "%"].set_attr("opacity", 1);
-            anim[to_string(end_pct * 100) + "%"].set_attr("opacity", 0);
+            anim[0.0].set_attr("opacity", 0);
+            anim[begin_pct * 100].set_attr("opacity", 1);
+            anim[end_pct * 100].set_attr("opacity", 0);
         }
 
         // Scale and center child SVGs
@@ -979,8 +5102,1501 @@ inline Element::BoundingBox Circle::get_bbox() {
         for (auto& child : root.get_immediate_children<SVG>())
             child->set_attr("x", (width - child->width())/2).set_attr("y", (height - child->height())/2);
 
+        root.hoist_styles();
+        return root;
+    }
+
+    namespace util {
+        inline int trailing_zeros(const unsigned value) {
+            /** Index of the lowest set bit of a non-zero value */
+#if defined(_MSC_VER)
+            unsigned long index;
+            _BitScanForward(&index, value);
+            return (int)index;
+#else
+            return __builtin_ctz(value);
+#endif
+        }
+
+        template<typename Function>
+        inline void parallel_for(const size_t count, const size_t threads, Function f) {
+            /** Call f(i) for every i < count, spread over up to threads threads */
+            std::atomic<size_t> next {0};
+            auto work = [&]() { for (size_t i; (i = next++) < count;) f(i); };
+            std::vector<std::thread> workers;
+            for (size_t t {1}; t < std::min(threads, count); t++) workers.emplace_back(work);
+            work();
+            for (auto& worker : workers) worker.join();
+        }
+
+        inline void structural_index(const char* data, const size_t size, std::vector<uint32_t>& out) {
+            /** Append the offsets of every '<', '>', '"' and '\'' in data (of at most 4 GiB) */
+            size_t i {0};
+#if defined(SVG_USE_AVX) || defined(SVG_USE_SSE2)
+            const __m128i lt = _mm_set1_epi8('<'), gt = _mm_set1_epi8('>'),
+                dq = _mm_set1_epi8('"'), sq = _mm_set1_epi8('\'');
+            for (; i + 16 <= size; i += 16) {
+                const __m128i block = _mm_loadu_si128((const __m128i*)(data + i));
+                unsigned mask = (unsigned)_mm_movemask_epi8(_mm_or_si128(
+                    _mm_or_si128(_mm_cmpeq_epi8(block, lt), _mm_cmpeq_epi8(block, gt)),
+                    _mm_or_si128(_mm_cmpeq_epi8(block, dq), _mm_cmpeq_epi8(block, sq))));
+                for (; mask; mask &= mask - 1) out.push_back((uint32_t)(i + trailing_zeros(mask)));
+            }
+#endif
+            for (; i < size; i++) {
+                const char c = data[i];
+                if (c == '<' || c == '>' || c == '"' || c == '\'') out.push_back((uint32_t)i);
+            }
+        }
+
+        inline bool starts_with(const char* p, const char* end, const char* literal) {
+            for (; *literal; p++, literal++)
+                if (p == end || *p != *literal) return false;
+            return true;
+        }
+
+        inline const char* skip_markup(const char* p, const char* end) {
+            /** Skip a comment, CDATA section, processing instruction or declaration
+             *  starting at p, returning nullptr if it isn't terminated
+             */
+            auto skip_past = [end](const char* from, const std::string& token) -> const char* {
+                const char* found = std::search(from, end, token.begin(), token.end());
+                return found == end ? nullptr : found + token.size();
+            };
+
+            if (starts_with(p, end, "<!--")) return skip_past(p + 4, "-->");
+            if (starts_with(p, end, "<![CDATA[")) return skip_past(p + 9, "]]>");
+            if (starts_with(p, end, "<?")) return skip_past(p + 2, "?>");
+            return skip_past(p + 2, ">"); // e.g. <!DOCTYPE svg>
+        }
+
+        inline const char* parse_tag(const char* p, const char* end,
+            std::string& name, SVGAttrib& attr, bool& closed) {
+            /** Parse the start tag at p, returning the position after it or nullptr if it's malformed
+             *
+             *  @param[out] closed Whether the tag is self-closing
+             */
+            auto space = [](const char c) { return c == ' ' || c == '\t' || c == '\n' || c == '\r'; };
+            const char* q = ++p;
+            while (q < end && !space(*q) && *q != '/' && *q != '>') q++;
+            if (q == p) return nullptr;
+            name.assign(p, q);
+
+            while (true) {
+                while (q < end && space(*q)) q++;
+                if (q == end) return nullptr;
+                if (*q == '>') {
+                    closed = false;
+                    return q + 1;
+                }
+                if (*q == '/') {
+                    closed = true;
+                    return (q + 1 < end && q[1] == '>') ? q + 2 : nullptr;
+                }
+
+                const char* key = q;
+                while (q < end && !space(*q) && *q != '=' && *q != '>' && *q != '/') q++;
+                const char* key_end = q;
+                while (q < end && space(*q)) q++;
+                if (q == end || *q != '=' || key == key_end) return nullptr;
+                for (q++; q < end && space(*q); q++);
+                if (q == end || (*q != '"' && *q != '\'')) return nullptr;
+
+                const char* value = q + 1;
+                q = (const char*)std::memchr(value, *q, end - value);
+                if (!q) return nullptr;
+                attr.emplace(std::string(key, key_end), std::string(value, q++));
+            }
+        }
+
+        inline const char* skip_tag(const char* p, const char* end, bool& closed) {
+            /** Skip the tag at p without reading it, returning the position after it or nullptr */
+            char quote {0};
+            for (p++; p < end; p++) {
+                if (quote) {
+                    if (*p == quote) quote = 0;
+                }
+                else if (*p == '"' || *p == '\'') quote = *p;
+                else if (*p == '>') {
+                    closed = (p[-1] == '/');
+                    return p + 1;
+                }
+            }
+            return nullptr;
+        }
+
+        inline const char* find_close(const char* p, const char* end, bool* text = nullptr) {
+            /** Return the start of the end tag closing the element whose content starts at p
+             *
+             *  @param[out] text If not null, set to whether there is text directly inside the element
+             */
+            size_t depth {0};
+            if (text) *text = false;
+            for (const char* lt; (lt = (const char*)std::memchr(p, '<', end - p)); ) {
+                if (text && !depth && !*text) {
+                    for (; p < lt && !*text; p++) *text = !isspace((unsigned char)*p);
+                    *text = *text || starts_with(lt, end, "<![CDATA[");
+                }
+
+                bool closed;
+                if (starts_with(lt, end, "<!") || starts_with(lt, end, "<?")) p = skip_markup(lt, end);
+                else if (starts_with(lt, end, "</")) {
+                    if (depth-- == 0) return lt;
+                    p = lt + 2;
+                }
+                else {
+                    p = skip_tag(lt, end, closed);
+                    if (p && !closed) depth++;
+                }
+                if (!p) return nullptr;
+            }
+            return nullptr;
+        }
+
+        inline const char* end_tag(const char* close, const char* end, const std::string& name) {
+            /** Check that the end tag at close is for name, returning the position after it or nullptr */
+            const char* gt = (const char*)std::memchr(close, '>', end - close);
+            if (!gt) return nullptr;
+            const char* name_end = gt;
+            while (name_end > close + 2 && isspace((unsigned char)name_end[-1])) name_end--;
+            return name.compare(0, std::string::npos, close + 2, name_end - close - 2) == 0 ? gt + 1 : nullptr;
+        }
+
+        inline const char* find_unquoted(const char* p, const char* end, const char* stops) {
+            /** Return the first of the characters in stops outside of quotes and
+             *  parentheses (e.g. in url(...)), or end if there is none
+             */
+            int depth {0};
+            for (char quote {0}; p < end; p++) {
+                if (quote) {
+                    if (*p == quote) quote = 0;
+                }
+                else if (*p == '"' || *p == '\'') quote = *p;
+                else if (*p == '(') depth++;
+                else if (*p == ')') depth--;
+                else if (depth <= 0 && std::strchr(stops, *p)) return p;
+            }
+            return end;
+        }
+
+        inline bool parse_css(const std::string& text, SelectorProperties& css,
+            std::map<std::string, Keyframes, std::less<>>& keyframes) {
+            /** Read a stylesheet of plain rules and @keyframes, like those written by SVG::Style
+             *
+             *  @returns false for anything which wouldn't be written back out the same,
+             *           e.g. comments, other at-rules, or rules which aren't in the order
+             *           they're written in (which could change the cascade)
+             */
+            auto trimmed = [](const char* begin, const char* stop) {
+                while (begin < stop && isspace((unsigned char)*begin)) begin++;
+                while (stop > begin && isspace((unsigned char)stop[-1])) stop--;
+                return std::string(begin, stop);
+            };
+
+            std::string body = trimmed(text.data(), text.data() + text.size());
+            if (body.compare(0, 9, "<![CDATA[") == 0 && body.size() >= 12 && body.compare(body.size() - 3, 3, "]]>") == 0)
+                body = body.substr(9, body.size() - 12);
+            if (body.find("/*") != std::string::npos || body.find('<') != std::string::npos) return false;
+            const char* p = body.data();
+            const char* end = p + body.size();
+
+            auto declarations = [&](AttributeMap& properties) {
+                /** Read declarations up to and including a closing brace */
+                while (true) {
+                    const char* stop = find_unquoted(p, end, ";{}");
+                    if (stop == end || *stop == '{') return false;
+                    const char* colon = std::find(p, stop, ':');
+                    const std::string name = trimmed(p, colon);
+                    if (colon != stop && !name.empty()) properties.set_attr(name, trimmed(colon + 1, stop));
+                    else if (!name.empty()) return false;
+                    p = stop + 1;
+                    if (*stop == '}') return true;
+                }
+            };
+
+            auto valid_offset = [](const std::string& offset) {
+                if (offset == "from" || offset == "to") return true;
+                char* number_end;
+                std::strtod(offset.c_str(), &number_end);
+                return number_end != offset.c_str() && std::string(number_end) == "%";
+            };
+
+            const std::string* last_selector {nullptr};
+            while (true) {
+                while (p < end && isspace((unsigned char)*p)) p++;
+                if (p == end) return true;
+                const char* brace = find_unquoted(p, end, "{};");
+                if (brace == end || *brace != '{') return false;
+                const std::string selector = trimmed(p, brace);
+                p = brace + 1;
+
+                if (selector.compare(0, 11, "@keyframes ") == 0) {
+                    const std::string name = trimmed(selector.data() + 11, selector.data() + selector.size());
+                    if (name.empty() || keyframes.count(name)) return false;
+                    Keyframes& animation = keyframes[name];
+
+                    while (true) {
+                        while (p < end && isspace((unsigned char)*p)) p++;
+                        if (p < end && *p == '}') {
+                            p++;
+                            break;
+                        }
+                        brace = find_unquoted(p, end, "{}");
+                        if (brace == end || *brace != '{') return false;
+                        const std::string offsets(p, brace);
+                        p = brace + 1;
+
+                        AttributeMap properties;
+                        if (!declarations(properties)) return false;
+                        for (size_t start {0}; start <= offsets.size(); ) {
+                            size_t comma = std::min(offsets.find(',', start), offsets.size());
+                            const std::string offset = trimmed(offsets.data() + start, offsets.data() + comma);
+                            if (!valid_offset(offset)) return false;
+                            for (auto& property : properties.attr) animation[offset].set_attr(property.first, property.second);
+                            start = comma + 1;
+                        }
+                    }
+                }
+                else if (selector.empty() || selector[0] == '@') return false;
+                else {
+                    // Rules are written in order of their selectors
+                    auto rule = css.emplace(selector, AttributeMap());
+                    if (!rule.second || (last_selector && !(*last_selector < selector))) return false;
+                    last_selector = &rule.first->first;
+                    if (!declarations(rule.first->second)) return false;
+                }
+            }
+        }
+
+        template<typename T>
+        std::unique_ptr<Element> make_element(SVGAttrib&& attr) { return std::make_unique<T>(std::move(attr)); }
+
+        inline std::unique_ptr<Element> make_element(const std::string& name, SVGAttrib&& attr) {
+            /** Create an element of the class for a tag, or a Generic one */
+            static const std::unordered_map<std::string, std::unique_ptr<Element>(*)(SVGAttrib&&)> classes = {
+                { "svg", make_element<SVG> }, { "g", make_element<Group> }, { "defs", make_element<Defs> },
+                { "circle", make_element<Circle> }, { "rect", make_element<Rect> },
+                { "line", make_element<Line> }, { "polygon", make_element<Polygon> },
+                { "path", make_element<Path> }, { "text", make_element<Text> },
+                { "stop", make_element<Stop> }, { "linearGradient", make_element<LinearGradient> },
+                { "radialGradient", make_element<RadialGradient> }, { "pattern", make_element<Pattern> },
+                { "filter", make_element<Filter> }
+            };
+
+            auto type = classes.find(name);
+            if (type == classes.end()) return std::make_unique<Generic>(name, std::move(attr));
+            return type->second(std::move(attr));
+        }
+
+        inline std::unique_ptr<Element> make_element(const std::string& name, SVGAttrib&& attr, std::string&& content) {
+            /** Create an element with text directly inside it: a <text>, a stylesheet
+             *  whose rules can be read, or a Generic one keeping the content as is
+             */
+            if (name == "text") {
+                auto text = std::make_unique<Text>(std::move(attr));
+                text->content = std::move(content);
+                return text;
+            }
+
+            auto type = attr.find("type");
+            if (name == "style" && attr.size() == (size_t)(type != attr.end()) &&
+                (type == attr.end() || type->second == "text/css")) {
+                // Written with type="text/css" and nothing else
+                auto style = std::make_unique<SVG::Style>();
+                if (parse_css(content, style->css, style->keyframes)) return style;
+            }
+            return std::make_unique<Generic>(name, std::move(attr), std::move(content));
+        }
+
+        inline bool parse_fragment(const char* p, const char* end, std::vector<std::unique_ptr<Element>>& out) {
+            /** Parse a run of complete elements into detached subtrees
+             *
+             *  An element with text directly inside it holds its content as is,
+             *  unless it is a stylesheet which could be read (see make_element()).
+             */
+            struct Open {
+                Element* elem;
+                std::string name;
+                const char* content; /**< Start of the element's content */
+            };
+            std::vector<Open> stack;
+            std::string name;
+
+            while (p < end) {
+                const char* lt = (const char*)std::memchr(p, '<', end - p);
+                bool text = lt && starts_with(lt, end, "<![CDATA[");
+                for (const char* c = p; c < (lt ? lt : end) && !text; c++) text = !isspace((unsigned char)*c);
+
+                if (text) {
+                    // Keep the current element's content as is
+                    if (stack.empty()) return false;
+                    Open& open = stack.back();
+                    const char* close = find_close(open.content, end);
+                    if (!close) return false;
+
+                    auto raw = make_element(open.name, std::move(open.elem->attr), std::string(open.content, close));
+                    if (stack.size() == 1) out.back() = std::move(raw);
+                    else {
+                        stack[stack.size() - 2].elem->insert_before(std::move(raw), open.elem);
+                        open.elem->detach();
+                    }
+
+                    if (!(p = end_tag(close, end, open.name))) return false;
+                    stack.pop_back();
+                    continue;
+                }
+
+                if (!lt) break;
+                if (starts_with(lt, end, "<!") || starts_with(lt, end, "<?")) {
+                    if (!(p = skip_markup(lt, end))) return false;
+                }
+                else if (starts_with(lt, end, "</")) {
+                    if (stack.empty() || !(p = end_tag(lt, end, stack.back().name))) return false;
+                    stack.pop_back();
+                }
+                else {
+                    SVGAttrib attr;
+                    bool closed;
+                    if (!(p = parse_tag(lt, end, name, attr, closed))) return false;
+
+                    auto elem = make_element(name, std::move(attr));
+                    Element* ptr = elem.get();
+                    if (stack.empty()) out.push_back(std::move(elem));
+                    else stack.back().elem->insert_before(std::move(elem));
+                    if (!closed) stack.push_back({ ptr, name, p });
+                }
+            }
+
+            return stack.empty();
+        }
+    }
+
+    inline void Element::read_deferred() {
+        /** Create this element's children from its unread content, leaving
+         *  theirs unread in turn
+         *
+         *  This doesn't count as a change to the document, so observers aren't
+         *  notified. Malformed content is kept (and written) as is.
+         */
+        using namespace util;
+        const Deferred& content = *this->deferred;
+        std::vector<std::unique_ptr<Element>> children;
+        std::string name;
+        auto read = [&]() {
+            for (const char* p = content.begin; p < content.end; ) {
+                const char* lt = (const char*)std::memchr(p, '<', content.end - p);
+                for (; p < (lt ? lt : content.end); p++)
+                    if (!isspace((unsigned char)*p)) return false;
+                if (!lt) break;
+
+                if (starts_with(lt, content.end, "<!") || starts_with(lt, content.end, "<?")) {
+                    if (!(p = skip_markup(lt, content.end))) return false;
+                    continue;
+                }
+
+                SVGAttrib attr;
+                bool closed, text;
+                if (starts_with(lt, content.end, "</") || !(p = parse_tag(lt, content.end, name, attr, closed)))
+                    return false;
+                if (closed) {
+                    children.push_back(make_element(name, std::move(attr)));
+                    continue;
+                }
+
+                const char* close = find_close(p, content.end, &text);
+                const char* next = close ? end_tag(close, content.end, name) : nullptr;
+                if (!next) return false;
+
+                if (text) children.push_back(make_element(name, std::move(attr), std::string(p, close)));
+                else {
+                    children.push_back(make_element(name, std::move(attr)));
+                    if (close != p) children.back()->deferred.reset(new Deferred{ content.source, p, close });
+                }
+                p = next;
+            }
+            return true;
+        };
+
+        if (!read()) {
+            this->deferred->failed = true;
+            return;
+        }
+
+        this->deferred.reset();
+        for (auto& child : children) {
+            Element* elem = child.release();
+            elem->parent_node = this;
+            elem->watched = this->observing || this->watched;
+            elem->prev_node = this->last_node;
+            (this->last_node ? this->last_node->next_node : this->first_node) = elem;
+            this->last_node = elem;
+        }
+        this->cloned(); // e.g. to find an SVG's stylesheet
+    }
+
+    inline std::unique_ptr<SVG> parse(const std::string& markup, size_t threads = 0) {
+        /** Read an SVG document
+         *
+         *  The input is first indexed by the positions of its angle brackets and
+         *  quotes, which are used to split it between the root's children. The
+         *  pieces are then parsed on separate threads and spliced together.
+         *
+         *  Known elements (e.g. <circle>) become instances of their classes and
+         *  others Generic ones. Stylesheets are read into SVG::Style if they'd be
+         *  written back out the same. Other elements with text directly inside
+         *  them (including <text>) keep their content as is. Comments are dropped,
+         *  and entities aren't decoded.
+         *
+         *  @param[in] threads Number of threads, or 0 for one per core (each
+         *                     parsing at least 1 MiB)
+         *  @returns   The document, or nullptr if it is malformed or its
+         *             root isn't an <svg>
+         */
+        const char* data = markup.data();
+        const size_t size = markup.size();
+        if (threads == 0)
+            threads = std::min((size_t)std::max(1u, std::thread::hardware_concurrency()), size >> 20);
+        threads = std::max((size_t)1, threads);
+
+        // Index in ranges of at most 1 GiB, so that offsets fit in 32 bits
+        const size_t ranges = std::max(threads, (size >> 30) + 1);
+        auto range_start = [size, ranges](const size_t i) { return (size_t)((double)size * i / ranges); };
+        std::vector<std::vector<uint32_t>> index(ranges);
+        util::parallel_for(ranges, threads, [&](const size_t i) {
+            util::structural_index(data + range_start(i), range_start(i + 1) - range_start(i), index[i]);
+        });
+
+        // Find the root's start tag, content and the ends of its children
+        std::vector<size_t> cuts;
+        size_t root_start {0}, content_begin {0}, content_end {0}, tag_start {0}, skip_to {0};
+        size_t depth {0};
+        bool in_tag {false}, found_root {false}, closed_root {false};
+        char quote {0};
+
+        for (size_t r {0}; r < ranges; r++) {
+            for (const uint32_t offset : index[r]) {
+                const size_t k = range_start(r) + offset;
+                const char c = data[k];
+                if (k < skip_to) continue;
+                if (quote) {
+                    if (c == quote) quote = 0;
+                    continue;
+                }
+
+                if (in_tag) {
+                    if (c == '"' || c == '\'') quote = c;
+                    else if (c == '>') {
+                        in_tag = false;
+                        if (data[tag_start + 1] == '/') {
+                            if (depth == 0) return nullptr;
+                            if (--depth == 0) {
+                                content_end = tag_start;
+                                closed_root = true;
+                            }
+                            else if (depth == 1) cuts.push_back(k + 1);
+                        }
+                        else if (closed_root) return nullptr; // A second root
+                        else if (depth == 0) {
+                            root_start = tag_start;
+                            content_begin = content_end = k + 1;
+                            found_root = true;
+                            if (data[k - 1] == '/') closed_root = true;
+                            else depth++;
+                        }
+                        else if (data[k - 1] != '/') depth++;
+                        else if (depth == 1) cuts.push_back(k + 1);
+                    }
+                }
+                else if (c == '<') {
+                    if (data[k + 1] == '!' || data[k + 1] == '?') {
+                        const char* next = util::skip_markup(data + k, data + size);
+                        if (!next) return nullptr;
+                        skip_to = (size_t)(next - data);
+                    }
+                    else {
+                        in_tag = true;
+                        tag_start = k;
+                    }
+                }
+            }
+        }
+        if (!found_root || !closed_root || in_tag) return nullptr;
+
+        std::string name;
+        SVGAttrib attr;
+        bool closed;
+        if (!util::parse_tag(data + root_start, data + size, name, attr, closed) || name != "svg")
+            return nullptr;
+        auto root = std::make_unique<SVG>(std::move(attr));
+
+        // Split the content into pieces of similar size at the end of a child
+        std::vector<size_t> bounds = { content_begin };
+        for (size_t i {1}; i < threads; i++) {
+            auto cut = std::lower_bound(cuts.begin(), cuts.end(),
+                content_begin + (content_end - content_begin) * i / threads);
+            if (cut != cuts.end() && *cut > bounds.back() && *cut < content_end) bounds.push_back(*cut);
+        }
+        bounds.push_back(content_end);
+
+        const size_t pieces = bounds.size() - 1;
+        std::vector<std::vector<std::unique_ptr<Element>>> subtrees(pieces);
+        std::vector<char> parsed(pieces);
+        util::parallel_for(pieces, threads, [&](const size_t i) {
+            parsed[i] = util::parse_fragment(data + bounds[i], data + bounds[i + 1], subtrees[i]);
+        });
+
+        for (size_t i {0}; i < pieces; i++) {
+            if (!parsed[i]) return nullptr;
+            for (auto& subtree : subtrees[i]) root->insert_before(std::move(subtree));
+        }
+
+        // Find each SVG's stylesheet and definitions, as for copies
+        for (Element* node = root.get(); node; node = node->next_in_subtree(root.get())) node->cloned();
+        return root;
+    }
+
+    inline std::unique_ptr<SVG> parse_lazy(std::shared_ptr<const std::string> markup) {
+        /** Read an SVG document's root, leaving the rest to be read as it is
+         *  traversed (e.g. by get_children(), get_element_by_id() or autoscale())
+         *
+         *  The document keeps a reference to the markup. Children are read one
+         *  level at a time, and subtrees which are never traversed are written
+         *  back out exactly as they were. Unlike parse(), errors inside the root
+         *  are only found once the affected content is read.
+         *
+         *  @returns The document, or nullptr if its root is malformed or isn't an <svg>
+         */
+        const char *p = markup->data(), *end = p + markup->size();
+        auto skip_space = [&end](const char* q) {
+            /** Skip whitespace, comments, declarations and processing instructions */
+            while (q && q < end) {
+                if (isspace((unsigned char)*q)) q++;
+                else if (util::starts_with(q, end, "<!") || util::starts_with(q, end, "<?")) q = util::skip_markup(q, end);
+                else break;
+            }
+            return q;
+        };
+
+        std::string name;
+        SVGAttrib attr;
+        bool closed;
+        p = skip_space(p);
+        if (!p || p == end || !(p = util::parse_tag(p, end, name, attr, closed)) || name != "svg") return nullptr;
+        auto root = std::make_unique<SVG>(std::move(attr));
+        if (closed) return skip_space(p) == end ? std::move(root) : nullptr;
+
+        // Look for the end tag at the very end before scanning for it
+        const char* last = end;
+        while (last > p && isspace((unsigned char)last[-1])) last--;
+        const char* close = last;
+        while (close > p && *close != '<') close--;
+        bool text {false};
+        if (!util::starts_with(close, end, "</") || util::end_tag(close, end, name) != last)
+            close = util::find_close(p, end, &text);
+
+        const char* next = close ? util::end_tag(close, end, name) : nullptr;
+        if (!next || text || skip_space(next) != end) return nullptr;
+        if (close != p) root->deferred.reset(new Element::Deferred{ markup, p, close });
+        return root;
+    }
+
+    inline std::unique_ptr<SVG> load(const std::string& filename, const size_t threads = 0) {
+        /** Read an SVG file, see parse() */
+        std::ifstream infile(filename, std::ios::binary);
+        if (!infile) return nullptr;
+
+        std::string markup;
+        infile.seekg(0, std::ios::end);
+        markup.resize((size_t)infile.tellg());
+        infile.seekg(0, std::ios::beg);
+        infile.read(&markup[0], (std::streamsize)markup.size());
+        return parse(markup, threads);
+    }
+
+    inline std::unique_ptr<SVG> load_lazy(const std::string& filename) {
+        /** Read an SVG file's root, see parse_lazy() */
+        std::ifstream infile(filename, std::ios::binary);
+        if (!infile) return nullptr;
+
+        auto markup = std::make_shared<std::string>();
+        infile.seekg(0, std::ios::end);
+        markup->resize((size_t)infile.tellg());
+        infile.seekg(0, std::ios::beg);
+        infile.read(&(*markup)[0], (std::streamsize)markup->size());
+        return parse_lazy(std::move(markup));
+    }
+
+    namespace util {
+        /** @class FlatTable
+         *  @brief Bounds-checked access to a table in a FlatBuffers message,
+         *  as used by Arrow's metadata
+         */
+        class FlatTable {
+        public:
+            FlatTable() = default;
+
+            static FlatTable root(const char* begin, const char* end) {
+                /** Return the root table of the message in [begin, end) */
+                uint32_t offset;
+                if (end - begin < 4) return FlatTable();
+                std::memcpy(&offset, begin, 4);
+                return FlatTable(begin, end, begin + offset);
+            }
+
+            explicit operator bool() const { return this->start != nullptr; }
+
+            template<typename T>
+            T scalar(const int field, const T fallback = T()) const {
+                /** Return a scalar field, or fallback if it's absent */
+                const char* p = this->field(field, sizeof(T));
+                if (!p) return fallback;
+                T value;
+                std::memcpy(&value, p, sizeof(T));
+                return value;
+            }
+
+            FlatTable table(const int field) const {
+                /** Return a table field, which is false if it's absent */
+                const char* p = this->indirect(field);
+                return p ? FlatTable(this->begin, this->end, p) : FlatTable();
+            }
+
+            const char* vector(const int field, const size_t element_size, uint32_t& count) const {
+                /** Return the elements of a vector field, or nullptr if it's absent */
+                const char* p = this->indirect(field);
+                count = 0;
+                if (!p || this->end - p < 4) return nullptr;
+                std::memcpy(&count, p, 4);
+                if ((size_t)(this->end - p - 4) / element_size >= count) return p + 4;
+                count = 0;
+                return nullptr;
+            }
+
+            FlatTable element(const char* elements, const uint32_t i) const {
+                /** Return element i of a vector of tables */
+                uint32_t offset;
+                std::memcpy(&offset, elements + 4 * i, 4);
+                return FlatTable(this->begin, this->end, elements + 4 * i + offset);
+            }
+
+            std::string string(const int field) const {
+                uint32_t length;
+                const char* p = this->vector(field, 1, length);
+                return p ? std::string(p, length) : std::string();
+            }
+
+        protected:
+            FlatTable(const char* _begin, const char* _end, const char* _table) {
+                int32_t vtable_offset;
+                uint16_t vtable_size;
+                if (_table < _begin || _end - _table < 4) return;
+                std::memcpy(&vtable_offset, _table, 4);
+                const char* vtable = _table - vtable_offset;
+                if (vtable < _begin || _end - vtable < 4) return;
+                std::memcpy(&vtable_size, vtable, 2);
+                if (vtable_size < 4 || _end - vtable < vtable_size) return;
+
+                this->begin = _begin;
+                this->end = _end;
+                this->start = _table;
+                this->vtable = vtable;
+            }
+
+            const char* field(const int field, const size_t size) const {
+                /** Return the position of a field's value, or nullptr if it's absent */
+                uint16_t vtable_size, offset;
+                if (!this->start) return nullptr;
+                std::memcpy(&vtable_size, this->vtable, 2);
+                if (4 + 2 * field + 2 > vtable_size) return nullptr;
+                std::memcpy(&offset, this->vtable + 4 + 2 * field, 2);
+                if (!offset || (size_t)(this->end - this->start) < offset + size) return nullptr;
+                return this->start + offset;
+            }
+
+            const char* indirect(const int field) const {
+                /** Follow the offset stored in a field */
+                const char* p = this->field(field, 4);
+                uint32_t offset;
+                if (!p) return nullptr;
+                std::memcpy(&offset, p, 4);
+                return (size_t)(this->end - p) > offset ? p + offset : nullptr;
+            }
+
+            const char *begin {nullptr}, *end {nullptr};
+            const char *start {nullptr}, *vtable {nullptr}; /**< The table and its vtable */
+        };
+    }
+
+    inline std::unique_ptr<ArrowFile> ArrowFile::read(const char* data, const size_t size, std::shared_ptr<const void> owner) {
+        /** Read the schema and record batches of an Arrow IPC file in memory
+         *
+         *  The columns point into data, which must stay valid for as long as they
+         *  are used. Passing its owner keeps it alive until then.
+         *
+         *  @returns The file, or nullptr if it's malformed, compressed or big-endian
+         */
+        using util::FlatTable;
+        const char* end = data + size;
+        int32_t footer_size;
+        if (size < 24 || std::memcmp(data, "ARROW1", 6) != 0 || std::memcmp(end - 6, "ARROW1", 6) != 0) return nullptr;
+        std::memcpy(&footer_size, end - 10, 4);
+        if (footer_size <= 0 || (size_t)footer_size > size - 18) return nullptr;
+
+        // Footer: version, schema, dictionaries, record batches
+        FlatTable footer = FlatTable::root(end - 10 - footer_size, end - 10);
+        FlatTable schema = footer.table(1);
+        if (!schema || schema.scalar<int16_t>(0) != 0) return nullptr;
+
+        // Find where each top-level field's nodes and buffers are in a record batch
+        struct Layout {
+            Column::Type type;
+            size_t nodes, buffers;
+        };
+        std::function<bool(const FlatTable&, Layout&)> count = [&count](const FlatTable& field, Layout& layout) {
+            /** Count a field's nodes and buffers, including those of its children
+             *
+             *  Field: name, nullable, type type, type, dictionary, children
+             */
+            static const int buffers[] = { -1, 0, 2, 2, 3, 3, 2, 2, 2, 2, 2, 2, 2, 1, -1, 2, 1, 2, 2, 3, 3, 2 };
+            uint8_t type = field.scalar<uint8_t>(2);
+            if (field.table(4)) type = 2; // Dictionary-encoded fields hold integer indices
+            if (!field || type >= sizeof(buffers) / sizeof(int) || buffers[type] < 0) return false;
+            if (++layout.nodes > (1 << 20)) return false; // Malformed files can refer to a table from itself
+            layout.buffers += buffers[type];
+
+            uint32_t n;
+            const char* children = field.vector(5, 4, n);
+            for (uint32_t i {0}; i < n; i++)
+                if (!count(field.element(children, i), layout)) return false;
+            return true;
+        };
+
+        auto result = std::unique_ptr<ArrowFile>(new ArrowFile());
+        std::vector<Layout> layouts;
+        uint32_t n_fields, n_children;
+        const char* fields = schema.vector(1, 4, n_fields);
+        for (uint32_t i {0}; i < n_fields; i++) {
+            FlatTable field = schema.element(fields, i), type = field.table(3);
+            Layout layout { Column::NONE, 0, 0 };
+            if (!count(field, layout)) return nullptr;
+
+            // Plain numeric columns: Int (bit width, signedness) and FloatingPoint (precision)
+            field.vector(5, 4, n_children);
+            const bool plain = !field.table(4) && !n_children;
+            if (plain && type && field.scalar<uint8_t>(2) == 2) {
+                const bool is_signed = type.scalar<uint8_t>(1);
+                switch (type.scalar<int32_t>(0)) {
+                case 8: layout.type = is_signed ? Column::INT8 : Column::UINT8; break;
+                case 16: layout.type = is_signed ? Column::INT16 : Column::UINT16; break;
+                case 32: layout.type = is_signed ? Column::INT32 : Column::UINT32; break;
+                case 64: layout.type = is_signed ? Column::INT64 : Column::UINT64; break;
+                }
+            }
+            else if (plain && type && field.scalar<uint8_t>(2) == 3) {
+                const int16_t precision = type.scalar<int16_t>(0);
+                if (precision == 1) layout.type = Column::FLOAT32;
+                else if (precision == 2) layout.type = Column::FLOAT64;
+            }
+
+            result->fields.push_back(field.string(0));
+            layouts.push_back(layout);
+        }
+
+        // Record batches, each referred to by a block of its offset, metadata size and body size
+        static const size_t widths[] = { 0, 1, 1, 2, 2, 4, 4, 8, 8, 4, 8 };
+        uint32_t n_blocks;
+        const char* blocks = footer.vector(3, 24, n_blocks);
+        for (uint32_t b {0}; b < n_blocks; b++) {
+            int64_t offset, body_size;
+            int32_t meta_size;
+            uint32_t marker;
+            std::memcpy(&offset, blocks + 24 * b, 8);
+            std::memcpy(&meta_size, blocks + 24 * b + 8, 4);
+            std::memcpy(&body_size, blocks + 24 * b + 16, 8);
+            if (offset < 8 || (size_t)offset > size || meta_size < 8 || size - (size_t)offset < (size_t)meta_size)
+                return nullptr;
+
+            // Message: version, header type, header (a RecordBatch is type 3), body size
+            const char* message = data + offset;
+            const char* body = message + meta_size;
+            std::memcpy(&marker, message, 4);
+            FlatTable header = FlatTable::root(message + (marker == 0xFFFFFFFF ? 8 : 4), body);
+            FlatTable batch = header.table(2);
+            if (header.scalar<uint8_t>(1) != 3 || !batch || body_size < 0 || end - body < body_size) return nullptr;
+
+            // RecordBatch: length, nodes, buffers, compression
+            uint32_t n_nodes, n_buffers;
+            const char* nodes = batch.vector(1, 16, n_nodes);
+            const char* buffers = batch.vector(2, 16, n_buffers);
+            if (batch.table(3)) return nullptr;
+
+            std::vector<Column> columns;
+            size_t node {0}, buffer {0};
+            for (auto& layout : layouts) {
+                if (node + layout.nodes > n_nodes || buffer + layout.buffers > n_buffers) return nullptr;
+                columns.emplace_back();
+
+                if (layout.type != Column::NONE) {
+                    int64_t rows, nulls, bits_offset, bits_size, values_offset, values_size;
+                    std::memcpy(&rows, nodes + 16 * node, 8);
+                    std::memcpy(&nulls, nodes + 16 * node + 8, 8);
+                    std::memcpy(&bits_offset, buffers + 16 * buffer, 8);
+                    std::memcpy(&bits_size, buffers + 16 * buffer + 8, 8);
+                    std::memcpy(&values_offset, buffers + 16 * buffer + 16, 8);
+                    std::memcpy(&values_size, buffers + 16 * buffer + 24, 8);
+
+                    auto inside = [body_size](const int64_t from, const int64_t length) {
+                        return from >= 0 && length >= 0 && from <= body_size && length <= body_size - from;
+                    };
+                    if (rows < 0 || !inside(values_offset, values_size) ||
+                        (size_t)values_size / widths[layout.type] < (size_t)rows) return nullptr;
+
+                    const uint8_t* validity {nullptr};
+                    if (nulls > 0) {
+                        if (!inside(bits_offset, bits_size) || bits_size < (rows + 7) / 8) return nullptr;
+                        validity = (const uint8_t*)(body + bits_offset);
+                    }
+                    columns.back() = Column(layout.type, body + values_offset, (size_t)rows, validity, owner);
+                }
+
+                node += layout.nodes;
+                buffer += layout.buffers;
+            }
+
+            result->columns.push_back(std::move(columns));
+            result->batch_rows.push_back((size_t)std::max<int64_t>(0, batch.scalar<int64_t>(0)));
+        }
+
+        return result;
+    }
+
+    inline std::unique_ptr<ArrowFile> ArrowFile::open(const std::string& filename) {
+        /** Map an Arrow IPC file into memory and read it, see read() */
+#if defined(_WIN32)
+        std::ifstream infile(filename, std::ios::binary);
+        if (!infile) return nullptr;
+
+        auto contents = std::make_shared<std::string>();
+        infile.seekg(0, std::ios::end);
+        contents->resize((size_t)infile.tellg());
+        infile.seekg(0, std::ios::beg);
+        infile.read(&(*contents)[0], (std::streamsize)contents->size());
+        return read(contents->data(), contents->size(), contents);
+#else
+        const int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) return nullptr;
+
+        struct stat info;
+        void* mapped = MAP_FAILED;
+        if (fstat(fd, &info) == 0 && info.st_size > 0)
+            mapped = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (mapped == MAP_FAILED) return nullptr;
+
+        const size_t size = (size_t)info.st_size;
+        std::shared_ptr<const void> owner(mapped, [size](const void* p) { munmap(const_cast<void*>(p), size); });
+        return read((const char*)mapped, size, owner);
+#endif
+    }
+
+    /** @struct StreamTag
+     *  @brief An element's start tag as seen by a rewrite() filter
+     */
+    struct StreamTag {
+        std::string name;   /**< Tag name, e.g. "circle" */
+        SVGAttrib attr;     /**< Attributes, which may be modified */
+        size_t depth {0};   /**< Number of enclosing elements */
+        bool drop {false};  /**< Set to leave out this element and its descendants */
+    };
+
+    using StreamFilter = std::function<void(StreamTag&)>;
+
+    inline bool rewrite(std::istream& in, std::ostream& out, const StreamFilter& filter,
+        const size_t chunk_size = 1 << 20) {
+        /** Copy an SVG document from in to out, passing every start tag
+         *  through filter without building a tree
+         *
+         *  Memory use is bounded by chunk_size and twice the largest single tag.
+         *  Text, comments and end tags are copied as is, and so are start
+         *  tags whose attributes filter left alone. Modified tags are written
+         *  with their attributes in the same order as the rest of the library.
+         *
+         *  @returns Whether the whole document was read and written. Output
+         *           written before an error is found is left in place.
+         */
+        using namespace util;
+        std::string buffer, name;
+        const size_t chunk = chunk_size ? chunk_size : 1;
+        StreamTag tag;
+        SVGAttrib original;
+        std::vector<std::pair<size_t, std::string>> renamed; // Depth and new name of renamed open elements
+        size_t pos {0}, depth {0}, drop_depth {0};
+        bool dropping {false}, eof {false};
+
+        auto refill = [&](const size_t size) {
+            /** Discard what has been handled and read up to size more bytes */
+            buffer.erase(0, pos);
+            pos = 0;
+            const size_t kept = buffer.size();
+            buffer.resize(kept + size);
+            in.read(&buffer[kept], (std::streamsize)size);
+            buffer.resize(kept + (size_t)in.gcount());
+            eof = !in;
+            return in.gcount() > 0;
+        };
+        auto emit = [&](const char* from, const char* to) {
+            if (!dropping) out.write(from, to - from);
+        };
+
+        while (pos < buffer.size() || refill(chunk)) {
+            const char *begin = buffer.data() + pos, *end = buffer.data() + buffer.size();
+            const char* lt = (const char*)std::memchr(begin, '<', end - begin);
+            if (!lt) {
+                emit(begin, end);
+                pos = buffer.size();
+                continue;
+            }
+
+            emit(begin, lt);
+            pos = lt - buffer.data();
+
+            // Find the end of the markup at lt, reading more if it isn't all here
+            const char* next {nullptr};
+            bool closed {false};
+            const bool start = !starts_with(lt, end, "</") && !starts_with(lt, end, "<!") && !starts_with(lt, end, "<?");
+            if (end - lt >= 9 || eof) {
+                if (start) next = skip_tag(lt, end, closed);
+                else if (lt[1] != '/') next = skip_markup(lt, end);
+                else if ((next = (const char*)std::memchr(lt, '>', end - lt))) next++;
+            }
+            if (!next) {
+                // At least double what is kept, so a long tag is scanned a logarithmic number of times
+                if (eof) return false;
+                refill(std::max(chunk, (size_t)(end - lt)));
+                continue;
+            }
+
+            if (!start) {
+                if (lt[1] == '/') {
+                    if (depth-- == 0) return false;
+                    if (dropping && depth == drop_depth) {
+                        dropping = false;
+                        pos = next - buffer.data();
+                        continue;
+                    }
+                    if (!renamed.empty() && renamed.back().first == depth) {
+                        out << "</" << renamed.back().second << '>';
+                        renamed.pop_back();
+                        pos = next - buffer.data();
+                        continue;
+                    }
+                }
+                emit(lt, next);
+            }
+            else if (dropping) {
+                if (!closed) depth++;
+            }
+            else {
+                tag.attr.clear();
+                if (parse_tag(lt, next, tag.name, tag.attr, closed) != next) return false;
+                name = tag.name;
+                original = tag.attr;
+                tag.depth = depth;
+                tag.drop = false;
+                filter(tag);
+
+                if (tag.drop) {
+                    if (!closed) {
+                        dropping = true;
+                        drop_depth = depth;
+                    }
+                }
+                else if (tag.name == name && tag.attr == original) emit(lt, next);
+                else {
+                    out << '<' << tag.name;
+                    for (auto& pair : tag.attr) {
+                        const char quote = pair.second.find('"') == std::string::npos ? '"' : '\'';
+                        out << ' ' << pair.first << '=' << quote << pair.second << quote;
+                    }
+                    out << (closed ? " />" : ">");
+                    if (!closed && tag.name != name) renamed.emplace_back(depth, tag.name);
+                }
+                if (!closed) depth++;
+            }
+            pos = next - buffer.data();
+        }
+
+        return depth == 0 && !in.bad() && bool(out);
+    }
+
+    inline bool rewrite(const std::string& input, const std::string& output, const StreamFilter& filter) {
+        /** Rewrite the SVG file input into output, see rewrite() */
+        std::ifstream infile(input, std::ios::binary);
+        std::ofstream outfile(output, std::ios::binary);
+        return infile && outfile && rewrite(infile, outfile, filter);
+    }
+
+    /** @class CsvReader
+     *  @brief Reads numeric columns from CSV data one chunk at a time
+     *
+     *  The first record is the header. Fields may be quoted as in RFC 4180.
+     *  Empty or non-numeric values are read as NAN.
+     */
+    class CsvReader {
+    public:
+        CsvReader(std::istream& _in, const char _delimiter = ',', const size_t _chunk_size = 1 << 20) :
+            in(_in), delimiter(_delimiter), chunk(std::max<size_t>(_chunk_size, 1)) {};
+
+        bool good() const { return !this->malformed; } /**< False if a quoted field isn't terminated */
+
+        const std::vector<std::string>& header() {
+            /** Return the names of the columns */
+            if (!this->read_header) {
+                this->read_header = true;
+                while (this->names.empty() && !this->malformed && this->fill()) {
+                    if (!this->record([this](size_t, const char* begin, const char* end, bool quoted) {
+                        this->names.push_back(quoted ? unquote(begin, end) : std::string(begin, end));
+                    })) this->names.clear();
+                }
+            }
+            return this->names;
+        }
+
+        bool select(const std::vector<std::string>& columns) {
+            /** Choose the columns which next() returns, in that order,
+             *  returning false if one of them is missing
+             */
+            const auto& fields = this->header();
+            this->slots.assign(fields.size(), -1);
+            for (size_t i {0}; i < columns.size(); i++) {
+                auto it = std::find(fields.begin(), fields.end(), columns[i]);
+                if (it == fields.end()) return false;
+                this->slots[it - fields.begin()] = (int)i;
+            }
+            this->selected = columns.size();
+            return true;
+        }
+
+        size_t next(std::vector<std::vector<double>>& columns) {
+            /** Read the selected columns of the next chunk of records,
+             *  returning the number of records or 0 at the end
+             */
+            this->header();
+            columns.resize(this->selected);
+            for (auto& column : columns) column.clear();
+
+            size_t rows {0};
+            while (!rows && !this->malformed && this->fill()) {
+                while (this->pos < this->buffer.size()) {
+                    const size_t mark = this->pos;
+                    size_t fields {0};
+                    for (auto& column : columns) column.push_back(NAN);
+                    const bool complete = this->record([this, &columns, &fields](size_t i, const char* begin, const char* end, bool) {
+                        fields++;
+                        if (i >= this->slots.size() || this->slots[i] < 0) return;
+                        double value;
+                        while (begin < end && *begin == ' ') begin++;
+                        const char* stop = util::parse_number(begin, end, value);
+                        while (stop && stop < end && *stop == ' ') stop++;
+                        if (stop == end) columns[this->slots[i]].back() = value;
+                    });
+
+                    if (!complete || !fields) {
+                        for (auto& column : columns) column.pop_back();
+                        if (complete) continue; // Blank line
+                        if (!this->malformed) this->pos = mark;
+                        break;
+                    }
+                    rows++;
+                }
+            }
+            return rows;
+        }
+
+    protected:
+        std::istream& in;
+        char delimiter;
+        size_t chunk;
+        std::string buffer;
+        size_t pos {0};           /**< Start of the first record which hasn't been read */
+        bool eof {false}, malformed {false}, read_header {false};
+        std::vector<std::string> names;
+        std::vector<int> slots;   /**< Output column of each field, or -1 */
+        size_t selected {0};
+
+        bool fill() {
+            /** Make sure there is data to read, returning false at the end */
+            if (this->pos < this->buffer.size() && this->eof) return true;
+            if (this->malformed) return false;
+
+            // Keep any incomplete record, followed by the next chunk
+            this->buffer.erase(0, this->pos);
+            this->pos = 0;
+            if (!this->eof) {
+                const size_t size = this->buffer.size();
+                this->buffer.resize(size + this->chunk);
+                this->in.read(&this->buffer[size], (std::streamsize)this->chunk);
+                this->buffer.resize(size + (size_t)this->in.gcount());
+                this->eof = !this->in;
+            }
+            return !this->buffer.empty();
+        }
+
+        template<typename Field>
+        bool record(Field field) {
+            /** Pass each field of the record at pos to field(index, begin, end, quoted),
+             *  returning false (and reading more) if it may continue past the buffer
+             */
+            const char *p = this->buffer.data() + this->pos, *end = this->buffer.data() + this->buffer.size();
+            for (size_t i {0}; ; i++) {
+                const char *begin = p, *stop;
+                bool quoted = (p < end && *p == '"');
+                if (quoted) {
+                    // Find the closing quote, skipping escaped ones ("")
+                    for (stop = ++begin; ; stop += 2) {
+                        stop = (const char*)std::memchr(stop, '"', end - stop);
+                        if (stop && (stop + 1 < end ? stop[1] != '"' : this->eof)) break;
+                        if (!stop && this->eof) {
+                            this->malformed = true;
+                            this->pos = this->buffer.size();
+                        }
+                        if (!stop || stop + 1 == end) return false;
+                    }
+                    p = stop + 1;
+                }
+                while (p < end && *p != this->delimiter && *p != '\n') p++;
+                if (p == end && !this->eof) return false;
+                if (!quoted) stop = p;
+                if (stop > begin && stop[-1] == '\r' && (p == end || *p == '\n')) stop--;
+
+                // Skip blank lines
+                if (i || stop != begin || quoted || (p < end && *p == this->delimiter)) field(i, begin, stop, quoted);
+                if (p == end || *p++ == '\n') break;
+            }
+            this->pos = p - this->buffer.data();
+            return true;
+        }
+
+        static std::string unquote(const char* begin, const char* end) {
+            std::string ret;
+            for (; begin < end; begin++) {
+                ret += *begin;
+                if (*begin == '"') begin++;
+            }
+            return ret;
+        }
+    };
+
+    enum class Chart { SCATTER, LINE };
+
+    inline std::unique_ptr<SVG> csv_chart(std::istream& in, const std::string& x, const std::string& y,
+        const Chart type = Chart::SCATTER, const char delimiter = ',') {
+        /** Plot two columns of CSV data as a scatter plot or line chart
+         *
+         *  The data is read one chunk at a time. Each chunk becomes a batch of
+         *  the Scatter (skipping rows with a missing coordinate) or is appended
+         *  to the Path (leaving gaps), and the extents of both are kept as they
+         *  grow, so the final autoscale() doesn't read the points again.
+         *
+         *  @returns The chart, or nullptr if a column is missing or a quoted field isn't terminated
+         */
+        CsvReader reader(in, delimiter);
+        if (!reader.select({ x, y })) return nullptr;
+
+        auto root = std::make_unique<SVG>();
+        Scatter* scatter {nullptr};
+        Path* path {nullptr};
+        if (type == Chart::SCATTER) scatter = root->add_child<Scatter>();
+        else {
+            path = root->add_child<Path>();
+            path->set_attr("fill", "none").set_attr("stroke", "black");
+        }
+
+        std::vector<std::vector<double>> columns;
+        while (reader.next(columns)) {
+            auto &xs = columns[0], &ys = columns[1];
+            if (path) {
+                path->line_through(xs.data(), ys.data(), xs.size());
+                continue;
+            }
+
+            size_t n {0};
+            for (size_t i {0}; i < xs.size(); i++) {
+                if (isnan(xs[i]) || isnan(ys[i])) continue;
+                xs[n] = xs[i];
+                ys[n++] = ys[i];
+            }
+            xs.resize(n);
+            ys.resize(n);
+            auto batch = std::make_shared<std::vector<std::vector<double>>>(std::move(columns));
+            scatter->add(Column((*batch)[0].data(), n, batch), Column((*batch)[1].data(), n, batch));
+        }
+
+        if (!reader.good()) return nullptr;
+        root->autoscale();
         return root;
     }
+
+    inline bool csv_chart(std::istream& in, std::ostream& out, const std::string& x, const std::string& y,
+        const Chart type = Chart::SCATTER, const char delimiter = ',') {
+        /** Write a chart of two columns of CSV data straight to out, in constant memory
+         *
+         *  The result is the same as writing the other csv_chart() (apart from
+         *  padding in the <svg> tag), but points are written as they are read.
+         *  The root's size is filled in afterwards, so out must be seekable.
+         *
+         *  @returns Whether the chart was written
+         */
+        const size_t HEADER_SIZE {256}; // Room for the root's attributes
+        CsvReader reader(in, delimiter);
+        const std::streampos start = out.tellp();
+        if (start == std::streampos(-1) || !reader.select({ x, y })) return false;
+
+        std::string buffer = "<svg" + std::string(HEADER_SIZE, ' ') + ">\n";
+        if (type == Chart::LINE) buffer += "\t<path d=\"";
+
+        Element::BoundingBox box(INFINITY, -INFINITY, INFINITY, -INFINITY);
+        std::vector<std::vector<double>> columns;
+        bool gap {true};
+        while (reader.next(columns)) {
+            const auto &xs = columns[0], &ys = columns[1];
+            for (size_t i {0}; i < xs.size(); i++) {
+                if (isnan(xs[i]) || isnan(ys[i])) {
+                    gap = true;
+                    continue;
+                }
+
+                if (type == Chart::SCATTER) {
+                    if (box.x1 > box.x2) buffer += "\t<g>\n";
+                    buffer += "\t\t<circle cx=\"";
+                    util::append_short(buffer, xs[i]);
+                    buffer += "\" cy=\"";
+                    util::append_short(buffer, ys[i]);
+                    buffer += "\" r=\"1\" />\n";
+                }
+                else {
+                    // Same as Path::line_through()
+                    if (gap || !i) buffer += gap ? 'M' : 'L';
+                    util::append_compact(buffer, xs[i]);
+                    util::append_compact(buffer, ys[i]);
+                    gap = false;
+                }
+
+                box.x1 = std::min(box.x1, xs[i]); box.x2 = std::max(box.x2, xs[i]);
+                box.y1 = std::min(box.y1, ys[i]); box.y2 = std::max(box.y2, ys[i]);
+            }
+
+            out.write(buffer.data(), (std::streamsize)buffer.size());
+            buffer.clear();
+        }
+
+        if (!reader.good()) return false;
+        if (type == Chart::SCATTER && box.x1 <= box.x2) {
+            buffer += "\t</g>\n";
+            box = Element::BoundingBox(box.x1 - 1, box.x2 + 1, box.y1 - 1, box.y2 + 1); // Radius
+        }
+        else if (type == Chart::SCATTER) {
+            buffer += "\t<g />\n";
+            box = Element::BoundingBox(NAN, NAN, NAN, NAN); // Like Scatter::get_bbox()
+        }
+        else buffer += "\" fill=\"none\" stroke=\"black\" />\n";
+        buffer += "</svg>";
+        out.write(buffer.data(), (std::streamsize)buffer.size());
+
+        // Size the root like autoscale()
+        SVG root;
+        if (box.x1 <= box.x2 || type == Chart::SCATTER) root.fit_to(box);
+        else root.fit_to(Element::BoundingBox(0, 0, 0, 0)); // Like Path::get_bbox()
+        std::string attrs;
+        for (auto& pair : root.attr) attrs += " " + pair.first + "=\"" + pair.second + "\"";
+        if (attrs.size() > HEADER_SIZE) return false;
+
+        const std::streampos finish = out.tellp();
+        out.seekp(start + std::streamoff(4));
+        out.write(attrs.data(), (std::streamsize)attrs.size());
+        out.seekp(finish);
+        return bool(out);
+    }
+
+    enum class Contour { LINES, BANDS };
+
+    inline std::vector<std::unique_ptr<Path>> contours(const double* values, const size_t width, const size_t height,
+        std::vector<double> levels, const Contour type = Contour::LINES, size_t threads = 0) {
+        /** Trace the contours of a grid of values by marching squares
+         *
+         *  Every cell is visited once, and only the levels between its smallest
+         *  and largest corner are traced through it, so many levels cost little
+         *  more than one. Bands of rows are traced on separate threads, and the
+         *  segments of each level are then joined end to end through a hash
+         *  table keyed by the grid edge they cross. Saddles are resolved by the
+         *  average of the cell's corners.
+         *
+         *  For LINES there is a path of isolines per level, which may be open
+         *  where they meet the edge of the grid or a NAN. For BANDS there is a
+         *  path per pair of consecutive levels, filling the values between
+         *  them with closed rings (using fill-rule="evenodd"). Outside the grid,
+         *  and at NANs, values count as lower than any level.
+         *
+         *  @param[in] values  A row-major grid of width x height values, where
+         *                     the value at (x, y) is values[y * width + x]
+         *  @param[in] threads Number of threads, or 0 for one per core
+         *  @returns   The paths in ascending order of level
+         */
+        std::sort(levels.begin(), levels.end());
+        const size_t count = type == Contour::LINES ? levels.size() : std::max(levels.size(), (size_t)1) - 1;
+        std::vector<std::unique_ptr<Path>> ret;
+        for (size_t i {0}; i < count; i++) {
+            ret.push_back(std::make_unique<Path>());
+            if (type == Contour::LINES) ret.back()->set_attr("fill", "none").set_attr("stroke", "black");
+            else ret.back()->set_attr("fill-rule", "evenodd");
+        }
+        if (!values || !width || !height || !count) return ret;
+
+        // Vertices (x, y) for -1 <= x <= width and -1 <= y <= height, so bands
+        // can close around the grid. Edge ids are twice the id of the vertex at
+        // their top left, plus one if they are vertical.
+        const bool padded = type == Contour::BANDS;
+        const size_t stride = width + 2;
+        auto value = [=](const long x, const long y) -> double {
+            if (x < 0 || y < 0 || x >= (long)width || y >= (long)height) return -INFINITY;
+            const double v = values[y * width + x];
+            return isnan(v) ? -INFINITY : v;
+        };
+        auto vertex = [stride](const long x, const long y) { return (uint64_t)(y + 1) * stride + (uint64_t)(x + 1); };
+
+        // Segments from the edge where the cell's boundary (walked clockwise)
+        // leaves the level's region to the edge where it enters, so they join up
+        using Segment = std::pair<uint64_t, uint64_t>;
+        const long first = padded ? -1 : 0, last_x = (long)width - (padded ? 0 : 1), last_y = (long)height - (padded ? 0 : 1);
+        if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+        const size_t rows = (size_t)std::max(0L, last_y - first), bands = std::max((size_t)1, std::min(threads, rows));
+        std::vector<std::vector<std::vector<Segment>>> found(bands, std::vector<std::vector<Segment>>(levels.size()));
+
+        util::parallel_for(bands, threads, [&](const size_t band) {
+            const long y_begin = first + (long)(rows * band / bands), y_end = first + (long)(rows * (band + 1) / bands);
+            for (long y {y_begin}; y < y_end; y++) {
+                for (long x {first}; x < last_x; x++) {
+                    const double corner[4] = { value(x, y), value(x + 1, y), value(x + 1, y + 1), value(x, y + 1) };
+                    const double lo = std::min({ corner[0], corner[1], corner[2], corner[3] }),
+                        hi = std::max({ corner[0], corner[1], corner[2], corner[3] });
+                    if (!padded && lo == -INFINITY) continue; // Isolines stop at NANs
+
+                    // Levels with some corners below them and some at or above them
+                    auto level = std::upper_bound(levels.begin(), levels.end(), lo);
+                    const auto level_end = std::upper_bound(level, levels.end(), hi);
+                    if (level == level_end) continue;
+
+                    const uint64_t edges[4] = { 2 * vertex(x, y), 2 * vertex(x + 1, y) + 1,
+                        2 * vertex(x, y + 1), 2 * vertex(x, y) + 1 }; // Top, right, bottom, left
+                    double center {0};
+                    for (const double v : corner) center += v / 4;
+
+                    for (; level != level_end; level++) {
+                        // Crossings in clockwise order, and whether each one leaves the region
+                        uint64_t crossing[4];
+                        bool leaves[4];
+                        int n {0};
+                        for (int k {0}; k < 4; k++) {
+                            const bool in = corner[k] >= *level, next_in = corner[(k + 1) & 3] >= *level;
+                            if (in == next_in) continue;
+                            crossing[n] = edges[k];
+                            leaves[n++] = in;
+                        }
+
+                        // At saddles, join the corners inside the region if the center is too
+                        auto& out = found[band][level - levels.begin()];
+                        const int step = center >= *level ? 1 : n - 1;
+                        for (int k {0}; k < n; k++)
+                            if (leaves[k]) out.emplace_back(crossing[k], crossing[(k + step) % n]);
+                    }
+                }
+            }
+        });
+
+        // Join each level's segments into polylines, open ones first
+        std::vector<std::unique_ptr<Path>> rings;
+        for (size_t l {0}; padded && l < levels.size(); l++) rings.push_back(std::make_unique<Path>());
+        util::parallel_for(levels.size(), threads, [&](const size_t l) {
+            std::vector<Segment> segments;
+            for (auto& band : found) {
+                segments.insert(segments.end(), band[l].begin(), band[l].end());
+                std::vector<Segment>().swap(band[l]);
+            }
+
+            // An open-addressed table of the edges segments start at (each edge
+            // starts at most one), used to find the segment after each one
+            const size_t n = segments.size();
+            int bits {1};
+            while (((size_t)1 << bits) < 2 * n) bits++;
+            const size_t mask = ((size_t)1 << bits) - 1;
+            std::vector<uint64_t> keys(mask + 1, UINT64_MAX);
+            std::vector<size_t> starting(mask + 1);
+            auto slot = [&](const uint64_t edge) {
+                size_t s = (size_t)((edge * 0x9E3779B97F4A7C15ull) >> (64 - bits));
+                while (keys[s] != UINT64_MAX && keys[s] != edge) s = (s + 1) & mask;
+                return s;
+            };
+            for (size_t i {0}; i < n; i++) {
+                const size_t s = slot(segments[i].first);
+                keys[s] = segments[i].first;
+                starting[s] = i;
+            }
+
+            std::vector<size_t> after(n);
+            std::vector<bool> joined(n), continued(n);
+            for (size_t i {0}; i < n; i++) {
+                const size_t s = slot(segments[i].second);
+                after[i] = keys[s] == segments[i].second ? starting[s] : n;
+                if (after[i] < n) continued[after[i]] = true;
+            }
+            keys = std::vector<uint64_t>();
+            starting = std::vector<size_t>();
+
+            auto position = [&](const uint64_t edge, double& px, double& py) {
+                // Interpolate along the edge, or use its end in the grid if the other isn't
+                const uint64_t v = edge >> 1;
+                const long x = (long)(v % stride) - 1, y = (long)(v / stride) - 1,
+                    x2 = x + !(edge & 1), y2 = y + (edge & 1);
+                const double a = value(x, y), b = value(x2, y2);
+                const double t = std::isinf(a) ? 1 : std::isinf(b) ? 0 : (levels[l] - a) / (b - a);
+                px = x + t * (x2 - x);
+                py = y + t * (y2 - y);
+            };
+            Path& path = padded ? *rings[l] : *ret[l];
+            std::vector<double> xs, ys;
+            auto add = [&](const uint64_t edge) {
+                double px, py;
+                position(edge, px, py);
+                if (!xs.empty() && xs.back() == px && ys.back() == py) return;
+                xs.push_back(px);
+                ys.push_back(py);
+            };
+            auto trace = [&](size_t i, const bool closed) {
+                xs.clear();
+                ys.clear();
+                for (; i < n && !joined[i]; i = after[i]) {
+                    joined[i] = true;
+                    add(segments[i].first);
+                    if (!closed && after[i] == n) add(segments[i].second);
+                }
+                path.add_polyline(xs.data(), ys.data(), xs.size(), closed);
+            };
+
+            for (size_t i {0}; i < n; i++)
+                if (!continued[i]) trace(i, false);
+            for (size_t i {0}; i < n; i++)
+                if (!joined[i]) trace(i, true);
+        });
+
+        // Each band is bounded by the rings of the levels on either side
+        if (padded) {
+            util::parallel_for(count, threads, [&](const size_t i) {
+                ret[i]->add_path(*rings[i]);
+                ret[i]->add_path(*rings[i + 1]);
+            });
+        }
+        return ret;
+    }
 }
 
 #endif //_SVG_H_
\ No newline at end of file
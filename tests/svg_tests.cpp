@@ -1,6 +1,7 @@
 #define CATCH_CONFIG_MAIN
 #include "catch.hpp"
 #include "svg.hpp"
+#include <pthread.h>
 
 SVG::SVG two_circles(int x = 0, int y = 0, int r = 0);
 
@@ -26,8 +27,8 @@ TEST_CASE("Proper Indentation - Nested", "[indent_nest_test]") {
     SVG::SVG root = two_circles();
     std::string correct = "<svg xmlns=\"http://www.w3.org/2000/svg\">\n"
         "\t<g>\n"
-        "\t\t<circle cx=\"0.0\" cy=\"0.0\" r=\"0.0\" />\n"
-        "\t\t<circle cx=\"0.0\" cy=\"0.0\" r=\"0.0\" />\n"
+        "\t\t<circle cx=\"0.00\" cy=\"0.00\" r=\"0.00\" />\n"
+        "\t\t<circle cx=\"0.00\" cy=\"0.00\" r=\"0.00\" />\n"
         "\t</g>\n"
         "</svg>";
 
@@ -47,8 +48,8 @@ TEST_CASE("CSS Styling", "[test_css]") {
         "\t\t]]>\n"
         "\t</style>\n"
         "\t<g>\n"
-        "\t\t<circle cx=\"0.0\" cy=\"0.0\" r=\"0.0\" />\n"
-        "\t\t<circle cx=\"0.0\" cy=\"0.0\" r=\"0.0\" />\n"
+        "\t\t<circle cx=\"0.00\" cy=\"0.00\" r=\"0.00\" />\n"
+        "\t\t<circle cx=\"0.00\" cy=\"0.00\" r=\"0.00\" />\n"
         "\t</g>\n"
         "</svg>";
 
@@ -59,7 +60,7 @@ TEST_CASE("One Decimal Place", "[decimal_place_test]") {
     SVG::SVG root;
     root.add_child<SVG::Line>(0.0, 0.0, PI, PI);
     std::string correct = "<svg xmlns=\"http://www.w3.org/2000/svg\">\n"
-        "\t<line x1=\"0.0\" x2=\"0.0\" y1=\"3.1\" y2=\"3.1\" />\n"
+        "\t<line x1=\"0.00\" x2=\"0.00\" y1=\"3.14\" y2=\"3.14\" />\n"
         "</svg>";
 
     REQUIRE(std::string(root) == correct);
@@ -69,10 +70,11 @@ TEST_CASE("get_children() Test - Basic", "[test_get_children]") {
     SVG::SVG root;
     auto circ_ptr = root.add_child<SVG::Circle>();
     SVG::Element::ChildMap correct = {
-        { "style", std::vector<SVG::Element*>{root.css} },
         { "circle", std::vector<SVG::Element*>{circ_ptr} }
     };
 
+    // Stylesheets are only created when used
+    REQUIRE(root.css == nullptr);
     REQUIRE(root.get_children() == correct);
 }
 
@@ -118,8 +120,8 @@ TEST_CASE("autoscale() Test - Nested", "[test_autoscale_nested]") {
     REQUIRE(c2_ptr->get_bbox().y2 == 200);
 
     // Make sure final results are correct
-    REQUIRE(root.attr["width"] == "400.0");
-    REQUIRE(root.attr["height"] == "400.0");
+    REQUIRE(root.attr["width"] == "400.00mm");
+    REQUIRE(root.attr["height"] == "400.00mm");
     REQUIRE(root.attr["viewBox"] == "-200.0 -200.0 400.0 400.0");
 }
 
@@ -162,4 +164,1281 @@ TEST_CASE("Points Along a Circle Test", "[polar_points]") {
 
     REQUIRE(APPROX_EQUALS(points[3].first, 0, 1));
     REQUIRE(APPROX_EQUALS(points[3].second, -100, 1));
-}
\ No newline at end of file
+}
+
+TEST_CASE("Extents of Flat Point Arrays", "[extents]") {
+    std::vector<double> xs = { 3, -1, 4, 1, -5, 9, 2 },
+        ys = { 6, 5, -3, 5, 8, 9, -7 };
+    auto ext = SVG::util::extents(xs.data(), ys.data(), xs.size());
+
+    REQUIRE(ext.x1 == -5);
+    REQUIRE(ext.x2 == 9);
+    REQUIRE(ext.y1 == -7);
+    REQUIRE(ext.y2 == 9);
+}
+
+TEST_CASE("Bounding Polygon Test", "[bounding_polygon]") {
+    SVG::SVG root;
+    std::vector<SVG::Shape*> shapes;
+    std::vector<SVG::Point> points;
+    unsigned int seed = 42;
+    auto random = [&seed]() { seed = seed * 1103515245 + 12345; return (double)(seed % 100000) / 100; };
+
+    for (int i = 0; i < 500; i++) {
+        auto circ = root.add_child<SVG::Circle>(random(), random(), random() / 100);
+        auto circ_points = circ->points();
+        points.insert(points.end(), circ_points.begin(), circ_points.end());
+        shapes.push_back(circ);
+    }
+
+    // Should agree with gift wrapping over the same points
+    auto hull = SVG::bounding_polygon(shapes);
+    REQUIRE(hull.size() >= 3);
+    REQUIRE(hull == SVG::util::convex_hull(points));
+
+    // Points of subclasses are used as well
+    struct Triangle : public SVG::Circle {
+        using SVG::Circle::Circle;
+        std::vector<SVG::Point> points() override { return { { 0, -1e5 }, { 1e5, 1e5 }, { -1e5, 1e5 } }; }
+        void append_points(SVG::util::PointBuffer& buffer) override {
+            for (auto& pt : this->points()) buffer.push_back(pt.first, pt.second);
+        }
+    };
+    Triangle triangle(0, 0, 1);
+    shapes.push_back(&triangle);
+    REQUIRE(SVG::bounding_polygon(shapes).size() == 3);
+}
+
+TEST_CASE("Incremental Convex Hull", "[convex_hull]") {
+    SVG::SVG root;
+    auto hull = root.add_child<SVG::ConvexHull>();
+    SVG::util::PointBuffer all_points;
+    unsigned int seed = 7;
+    auto random = [&seed]() { seed = seed * 1103515245 + 12345; return (double)(seed % 100000) / 100; };
+
+    // Add points in batches and make sure hull matches a hull of all points so far
+    for (int batch = 0; batch < 20; batch++) {
+        std::vector<SVG::Point> points;
+        for (int i = 0; i < 100; i++) points.push_back(SVG::Point(random(), random()));
+        for (auto& pt : points) all_points.push_back(pt.first, pt.second);
+
+        hull->add_points(points);
+        auto copy = all_points;
+        REQUIRE(hull->points() == SVG::util::convex_hull(copy));
+    }
+
+    // Adding an interior point shouldn't change anything
+    std::string before = root;
+    hull->add_points({ SVG::Point(500, 500) });
+    REQUIRE(std::string(root) == before);
+
+    hull->add_points({ SVG::Point(2000, 2000) });
+    REQUIRE(std::string(root) != before);
+    REQUIRE(std::string(root).find("2000.00,2000.00") != std::string::npos);
+}
+
+TEST_CASE("Spatial Grid Queries", "[spatial_grid]") {
+    SVG::SVG root;
+    unsigned int seed = 11;
+    auto random = [&seed]() { seed = seed * 1103515245 + 12345; return (double)(seed % 100000) / 100; };
+    for (int i = 0; i < 2000; i++) root.add_child<SVG::Circle>(random(), random(), 1);
+
+    auto circles = root.get_children<SVG::Circle>();
+    SVG::SpatialGrid<SVG::Circle> grid(circles);
+    REQUIRE(grid.size() == 2000);
+
+    // Compare against a linear scan, including points outside of the grid
+    for (int i = 0; i < 50; i++) {
+        double x = random() * 1.5 - 250, y = random() * 1.5 - 250;
+        auto dist = [x, y](SVG::Circle* c) {
+            return std::pow(c->x() - x, 2) + std::pow(c->y() - y, 2);
+        };
+
+        SVG::Circle* closest = circles[0];
+        size_t in_radius = 0;
+        for (auto& circ : circles) {
+            if (dist(circ) < dist(closest)) closest = circ;
+            if (dist(circ) <= 50 * 50) in_radius++;
+        }
+
+        REQUIRE(dist(grid.nearest(x, y)) == dist(closest));
+        REQUIRE(grid.within(x, y, 50).size() == in_radius);
+    }
+
+    // Non-finite queries find nothing, far away ones still find the closest edge
+    REQUIRE(grid.nearest(NAN, 0) == nullptr);
+    REQUIRE(grid.nearest(0, INFINITY) == nullptr);
+    REQUIRE(grid.within(-INFINITY, 0, 10).empty());
+    REQUIRE(grid.within(0, 0, NAN).empty());
+    REQUIRE(grid.within(0, 0, INFINITY).size() == grid.size());
+    REQUIRE(grid.nearest(1e300, -1e300) != nullptr);
+    REQUIRE(grid.within(1e300, 1e300, 1e301).size() == grid.size());
+
+    REQUIRE(SVG::SpatialGrid<SVG::Circle>().nearest(0, 0) == nullptr);
+}
+
+TEST_CASE("Spatial Sort Test", "[spatial_sort]") {
+    SVG::SVG root;
+    auto group = root.add_child<SVG::Group>();
+    for (int x = 3; x >= 0; x--)
+        for (int y = 0; y < 4; y++)
+            group->add_child<SVG::Circle>(x * 10, y * 10, 5);
+
+    // Non-overlapping circles are reordered along the curve
+    auto before = group->get_children<SVG::Circle>();
+    root.spatial_sort();
+    auto after = group->get_children<SVG::Circle>();
+    REQUIRE(after.size() == 16);
+    REQUIRE(after != before);
+    REQUIRE(after[0]->x() == 0);
+    REQUIRE(after[0]->y() == 0);
+    REQUIRE(after[15]->x() == 30);
+    REQUIRE(after[15]->y() == 0);
+
+    // Consecutive circles on a Hilbert curve are neighbors
+    for (size_t i = 1; i < after.size(); i++)
+        REQUIRE(std::abs(after[i]->x() - after[i - 1]->x()) + std::abs(after[i]->y() - after[i - 1]->y()) == 10);
+
+    // Overlapping shapes keep their stacking order unless forced
+    group->add_child<SVG::Circle>(0, 0, 100);
+    before = group->get_children<SVG::Circle>();
+    root.spatial_sort();
+    REQUIRE(group->get_children<SVG::Circle>() == before);
+    root.spatial_sort(true);
+    REQUIRE(group->get_children<SVG::Circle>() != before);
+
+    // Strokes widen shapes, and transformed shapes end a run
+    REQUIRE(SVG::util::identity_transform("rotate(0, 5, 5) translate(0) scale(1 1)"));
+    REQUIRE_FALSE(SVG::util::identity_transform("rotate(45)"));
+    REQUIRE_FALSE(SVG::util::identity_transform("translate(0"));
+    for (const bool stroked : { false, true }) {
+        SVG::SVG doc;
+        auto strokes = doc.add_child<SVG::Group>();
+        if (stroked) strokes->set_attr("stroke", "black").set_attr("stroke-width", "3");
+        for (int x = 3; x >= 0; x--)
+            for (int y = 0; y < 4; y++)
+                strokes->add_child<SVG::Circle>(x * 10, y * 10, 4);
+        before = strokes->get_children<SVG::Circle>();
+        doc.spatial_sort();
+        REQUIRE((strokes->get_children<SVG::Circle>() == before) == stroked);
+    }
+
+    // The rotated square reaches over the circle next to it
+    SVG::SVG doc;
+    doc.add_child<SVG::Circle>(100, 100, 1);
+    auto rotated = doc.add_child<SVG::Rect>(0, 0, 10, 10, 45);
+    doc.add_child<SVG::Circle>(11, 5, 0.5);
+    doc.spatial_sort();
+    REQUIRE(doc.first_child()->next_sibling() == rotated);
+}
+
+TEST_CASE("Overlap Detection", "[any_overlap]") {
+    using SVG::QuadCoord;
+    REQUIRE(!SVG::util::any_overlap({ QuadCoord{ 0, 1, 0, 1 }, QuadCoord{ 1, 2, 0, 1 }, QuadCoord{ 0, 1, 1, 2 } }));
+    REQUIRE(SVG::util::any_overlap({ QuadCoord{ 0, 2, 0, 2 }, QuadCoord{ 1, 3, 1, 3 } }));
+    REQUIRE(SVG::util::any_overlap({ QuadCoord{ 0, 10, 0, 10 }, QuadCoord{ 5, 5, 2, 8 } }));
+    REQUIRE(SVG::util::any_overlap({ QuadCoord{ 0, 10, 0, 1 }, QuadCoord{ 20, 30, 0, 1 }, QuadCoord{ 25, 26, -5, 5 } }));
+}
+
+TEST_CASE("Quantization Test", "[quantize]") {
+    SVG::SVG root;
+    root.add_child<SVG::Circle>(-100.25, 50.5, 10.75);
+    root.add_child<SVG::Rect>(1.5, 2.25, 3, 4, 45);
+    auto path = root.add_child<SVG::Path>();
+    path->start(0.5, 0.5);
+    path->curve_to(2.5, 2.5, 30.0, 0, 1, 10.25, 10.25);
+    root.autoscale(SVG::NO_MARGINS);
+    std::string viewbox = root.attr["viewBox"], width = root.attr["width"];
+
+    // Tolerances which don't give a usable scale are ignored
+    const std::string original = root;
+    for (const double tolerance : { 0.0, -1.0, (double)NAN, (double)INFINITY, 1e-320 }) {
+        root.quantize(tolerance);
+        REQUIRE(std::string(root) == original);
+    }
+
+    root.quantize(0.01);
+    auto circ = root.get_children<SVG::Circle>()[0];
+    REQUIRE(circ->attr["cx"] == "-10025");
+    REQUIRE(circ->attr["cy"] == "5050");
+    REQUIRE(circ->attr["r"] == "1075");
+
+    // Rotation angle is left alone, but the center is scaled
+    auto rect = root.get_children<SVG::Rect>()[0];
+    REQUIRE(rect->attr["transform"] == "rotate(45.00,300,425 )");
+
+    // Arc radii and end points are scaled, rotation and flags aren't
+    REQUIRE(path->attr["d"] == "M 50 50 A 250 250 30.00 0 1 1025 1025");
+
+    // The document keeps its size
+    REQUIRE(root.attr["width"] == width);
+    REQUIRE(viewbox == "-111.0 0.0 121.2 61.2");
+    REQUIRE(root.attr["viewBox"] == "-11100 0 12120 6120");
+
+    REQUIRE(SVG::util::quantize_numbers("10% 2.5e1mm", 10, [](const std::string&, size_t i) { return i == 1; }) == "10% 250mm");
+}
+
+TEST_CASE("Integer Formatting", "[append_int]") {
+    std::string out;
+    for (long long value : { 0LL, 7LL, -7LL, 42LL, 100LL, -12345LL, 9876543210LL }) {
+        out.clear();
+        SVG::util::append_int(out, value);
+        REQUIRE(out == std::to_string(value));
+    }
+}
+
+TEST_CASE("Deduplicated Definitions", "[define]") {
+    SVG::SVG root;
+    auto bars = root.add_child<SVG::Group>();
+    for (int i = 0; i < 100; i++) {
+        auto bar = bars->add_child<SVG::Rect>(i * 10, 0, 8, 50, 0);
+        bar->set_attr("fill", root.define(SVG::LinearGradient(0, 0, 0, 1)
+            .add_stop(0, i % 2 ? "red" : "blue").add_stop(1, "white")));
+    }
+
+    auto fill = root.define(SVG::RadialGradient(0.5, 0.5, 0.5).add_stop(0, "red"));
+    auto blur = root.define(SVG::Filter().add_effect("feGaussianBlur", { { "stdDeviation", "2" } }));
+    REQUIRE(fill != blur);
+    REQUIRE(root.define(SVG::Filter().add_effect("feGaussianBlur", { { "stdDeviation", "2" } })) == blur);
+
+    // Only unique definitions are kept
+    REQUIRE(root.get_children<SVG::Defs>().size() == 1);
+    REQUIRE(root.get_children<SVG::LinearGradient>().size() == 2);
+    REQUIRE(root.get_children<SVG::Stop>().size() == 5);
+    REQUIRE(root.get_children<SVG::Filter>().size() == 1);
+
+    auto rects = root.get_children<SVG::Rect>();
+    REQUIRE(rects[0]->attr["fill"] == rects[2]->attr["fill"]);
+    REQUIRE(rects[0]->attr["fill"] != rects[1]->attr["fill"]);
+
+    auto id = rects[0]->attr["fill"].substr(5, rects[0]->attr["fill"].size() - 6);
+    REQUIRE(root.get_element_by_id(id) != nullptr);
+    REQUIRE(std::string(root).find("<feGaussianBlur stdDeviation=\"2\" />") != std::string::npos);
+}
+
+TEST_CASE("Stylesheet Hoisting", "[test_hoist_styles]") {
+    std::vector<SVG::SVG> frames(3);
+    for (size_t i = 0; i < frames.size(); i++) {
+        frames[i].add_child<SVG::Circle>(0, 0, 10);
+        frames[i].style("circle").set_attr("fill", "red");
+        frames[i].style("rect, line").set_attr("stroke-width", (double)i);
+    }
+
+    auto root = SVG::frame_animate(frames, 1);
+    REQUIRE(root.get_children<SVG::SVG::Style>().size() == 1);
+    for (auto& frame : root.get_immediate_children<SVG::SVG>())
+        REQUIRE(frame->css == nullptr);
+
+    // Identical rules are written once, differing ones are scoped
+    REQUIRE(root.css->css["circle"].attr["fill"] == "red");
+    REQUIRE(root.css->css["#frame_1 rect, #frame_1 line"].attr["stroke-width"] == "1.00");
+    REQUIRE(root.css->css.count("rect, line") == 0);
+    REQUIRE(root.css->css["#frame_0"].attr["animation-name"] == "anim_0");
+
+    // Rules which disagree with the outer stylesheet are scoped too, and
+    // renamed animations are renamed in inline styles as well
+    SVG::SVG outer, left, right;
+    outer.style("circle").set_attr("fill", "red").set_attr("stroke", "none");
+    outer.style("rect").set_attr("fill", "green");
+    outer.keyframes("spin")[0].set_attr("opacity", 0);
+    left.style("rect").set_attr("fill", "green");
+    right.style("circle").set_attr("fill", "blue").set_attr("stroke", "none");
+    right.keyframes("spin")[0].set_attr("opacity", 1);
+    right.add_child<SVG::Circle>(0, 0, 10)->set_attr("style", "fill: red; animation: spin 1s;");
+    outer << std::move(left) << std::move(right);
+    outer.hoist_styles();
+
+    REQUIRE(outer.css->css["circle"].attr["fill"] == "red");
+    REQUIRE(outer.css->css["#svg_1 circle"].attr["fill"] == "blue");
+    REQUIRE(outer.css->css["rect"].attr["fill"] == "green");
+    REQUIRE(outer.css->css.count("#svg_0 rect") == 0);
+    REQUIRE(outer.css->keyframes.count("spin_svg_1") == 1);
+    REQUIRE(outer.get_children<SVG::Circle>()[0]->attr["style"] == "fill: red; animation: spin_svg_1 1s;");
+}
+
+TEST_CASE("Keyframe Ordering", "[test_keyframes]") {
+    SVG::Keyframes anim;
+    anim["100%"].set_attr("opacity", 0);
+    anim[12.5].set_attr("opacity", 1);
+    anim["from"].set_attr("opacity", 0);
+    anim[12.5].set_attr("fill", "red");
+
+    // Stops are ordered numerically and set at most once per offset
+    std::vector<double> offsets;
+    for (auto& stop : anim) offsets.push_back(stop.first);
+    REQUIRE(offsets == std::vector<double>{ 0, 12.5, 100 });
+    REQUIRE(anim.find(12.5)->attr["fill"] == "red");
+    REQUIRE(anim.find(50) == nullptr);
+
+    REQUIRE(SVG::Keyframes::format_offset(100) == "100%");
+    REQUIRE(SVG::Keyframes::format_offset(100.0 / 3) == "33.3333%");
+
+    // Stops with the same properties share a rule
+    SVG::SVG root;
+    root.keyframes("fade") = anim;
+    const std::string css = root;
+    REQUIRE(css.find("0%, 100% {") != std::string::npos);
+    REQUIRE(css.find("12.5% {") != std::string::npos);
+
+    // Literal zero is an offset, and close stops are told apart
+    SVG::Keyframes close;
+    close[0].set_attr("opacity", 0);
+    close[0.00001].set_attr("opacity", 1);
+    close[0.00002].set_attr("opacity", 0.5);
+    REQUIRE(close.size() == 3);
+    REQUIRE(close.decimals() == 5);
+    root.keyframes("close") = close;
+    const std::string labels = root;
+    REQUIRE(labels.find("0.00001% {") != std::string::npos);
+    REQUIRE(labels.find("0.00002% {") != std::string::npos);
+}
+
+// Count heap allocations while a CountAllocations is in scope, to check
+// that attribute lookups don't allocate. Other tests allocate on worker
+// threads, so both counters are atomic.
+static std::atomic<bool> counting {false};
+static std::atomic<size_t> allocations {0};
+
+struct CountAllocations {
+    CountAllocations() { allocations = 0; counting = true; }
+    ~CountAllocations() { counting = false; }
+    size_t count() const { return allocations; }
+};
+
+void* operator new(size_t size) {
+    if (counting.load(std::memory_order_relaxed)) allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* ptr = std::malloc(size ? size : 1)) return ptr;
+    throw std::bad_alloc();
+}
+
+void* operator new[](size_t size) { return operator new(size); }
+
+// Not inlined, or GCC sees free() called on memory from operator new
+#if defined(__GNUC__)
+#define NOINLINE __attribute__((noinline))
+#else
+#define NOINLINE
+#endif
+
+NOINLINE void operator delete(void* ptr) noexcept { std::free(ptr); }
+NOINLINE void operator delete(void* ptr, size_t) noexcept { std::free(ptr); }
+NOINLINE void operator delete[](void* ptr) noexcept { std::free(ptr); }
+NOINLINE void operator delete[](void* ptr, size_t) noexcept { std::free(ptr); }
+
+TEST_CASE("Allocation-Free Attribute Updates", "[test_heterogeneous_lookup]") {
+    SVG::SVG root;
+    auto rect = root.add_child<SVG::Rect>(0, 0, 10, 10, 0);
+    rect->set_attr("fill", "none");
+    root.style("rect").set_attr("fill", "red");
+    root.keyframes("fade")["50%"].set_attr("opacity", "0.5");
+    const std::string color = "blue";
+
+    // Once keys exist, updating them shouldn't touch the heap
+    size_t allocated;
+    double width = 0;
+    {
+        CountAllocations counter;
+        for (int i = 0; i < 1000; i++) {
+            rect->set_attr("fill", "red").set_attr("fill", color);
+            root.style("rect").set_attr("fill", "green");
+            root.keyframes("fade")[50.0].set_attr("opacity", "1");
+            width += rect->width();
+        }
+        allocated = counter.count();
+    }
+    REQUIRE(allocated == 0);
+    REQUIRE(width == 10000);
+
+    // Moved values are taken over
+    std::string stroke(64, 'x');
+    const char* data = stroke.data();
+    rect->set_attr("stroke", std::move(stroke));
+    REQUIRE(rect->attr["stroke"].data() == data);
+}
+
+TEST_CASE("In-Place Value Appends", "[test_append_fixed]") {
+    SVG::Path path;
+    path.start(0, 0);
+
+    // Appending grows the path data geometrically instead of allocating per segment
+    size_t allocated;
+    {
+        CountAllocations counter;
+        for (int i = 1; i <= 10000; i++) path.line_to(i * 0.5, -i * 0.25);
+        allocated = counter.count();
+    }
+    REQUIRE(allocated < 100);
+    REQUIRE(path.attr["d"].substr(0, 30) == "M 0.00 0.00 L 0.50 -0.25 L 1.0");
+
+    SVG::Rect rect;
+    rect.set_attr("transform") << "translate(" << SVG::Point(1, 2.345) << ") scale(" << 2 << ")";
+    REQUIRE(rect.attr["transform"] == "translate(1.00,2.35) scale(2.00)");
+    REQUIRE(SVG::to_string(1e30).size() == 34);
+}
+
+TEST_CASE("Detaching and Reparenting", "[test_reparent]") {
+    SVG::SVG root;
+    auto left = root.add_child<SVG::Group>(), right = root.add_child<SVG::Group>();
+    auto a = left->add_child<SVG::Circle>(0, 0, 1),
+        b = left->add_child<SVG::Circle>(1, 1, 1),
+        c = left->add_child<SVG::Circle>(2, 2, 1);
+
+    REQUIRE(b->parent() == left);
+    REQUIRE(a->next_sibling() == b);
+    REQUIRE(c->prev_sibling() == b);
+
+    // Move the middle circle to the front of the other group
+    auto d = right->add_child<SVG::Circle>(3, 3, 1);
+    REQUIRE(b->reparent(right, d) == b);
+    REQUIRE(left->get_immediate_children<SVG::Circle>() == std::vector<SVG::Circle*>{ a, c });
+    REQUIRE(right->get_immediate_children<SVG::Circle>() == std::vector<SVG::Circle*>{ b, d });
+    REQUIRE(right->first_child() == b);
+    REQUIRE(b->parent() == right);
+
+    // Elements can't be moved into their own descendants
+    REQUIRE(left->reparent(a) == nullptr);
+    REQUIRE(left->parent() == &root);
+
+    // Detaching transfers ownership
+    auto removed = left->detach();
+    REQUIRE(removed.get() == left);
+    REQUIRE(root.first_child() == right);
+    REQUIRE(root.get_children<SVG::Circle>().size() == 2);
+    removed.reset();
+
+    right->insert_before(std::make_unique<SVG::Rect>(0, 0, 1, 1, 0), b);
+    REQUIRE(std::string(*right->first_child()).find("<rect") == 0);
+    REQUIRE(root.detach() == nullptr);
+}
+
+TEST_CASE("Generational Handles", "[test_handles]") {
+    static_assert(sizeof(SVG::Handle<>) == 4, "Handles should be 32 bits");
+
+    SVG::SVG root;
+    auto group = root.add_child<SVG::Group>();
+    auto circle = group->add_child<SVG::Circle>(0, 0, 1);
+    auto h_group = root.handle(group);
+    auto h_circle = root.handle(circle);
+
+    REQUIRE(root.resolve(h_group) == group);
+    REQUIRE(root.resolve(h_circle) == circle);
+    REQUIRE(root.handle(circle) == h_circle);
+    REQUIRE(root.get_handles<SVG::Circle>() == std::vector<SVG::Handle<SVG::Circle>>{ h_circle });
+
+    // Handles follow elements when they are moved
+    SVG::Group moved(std::move(*group));
+    REQUIRE(root.resolve(h_group) == &moved);
+    REQUIRE(root.resolve(h_circle) == circle);
+    REQUIRE(circle->parent() == &moved);
+
+    // Destroying an element invalidates its handle, and the reused slot gets a new generation
+    root.first_child()->detach();
+    REQUIRE(root.resolve(h_group) == &moved);
+    auto rect = root.add_child<SVG::Rect>(0, 0, 1, 1, 0);
+    {
+        SVG::Group temp;
+        temp << SVG::Circle(0, 0, 1);
+        auto h_temp = root.handle(temp.first_child());
+        REQUIRE(root.resolve(h_temp) != nullptr);
+    }
+    auto h_rect = root.handle(rect);
+    REQUIRE(h_rect.index() < 3);
+    REQUIRE(h_rect.generation() == 2);
+    REQUIRE(root.resolve(SVG::Handle<SVG::Rect>(h_rect.index() | (1 << 24))) == nullptr);
+
+    // Moved-from documents no longer resolve their handles
+    SVG::SVG left, right;
+    auto h_left = left.handle(left.add_child<SVG::Circle>(0, 0, 1));
+    auto merged = SVG::merge(left, right);
+    REQUIRE(left.resolve(h_left) == nullptr);
+}
+
+TEST_CASE("Full Handle Table", "[test_handles]") {
+    // A table with a single slot, which is retired after 255 reuses
+    struct SmallTable : SVG::NodeTable {
+        SmallTable() { this->capacity = 1; }
+    };
+
+    SVG::Circle first, second;
+    SmallTable table;
+    uint32_t key = table.insert(&first);
+    REQUIRE_THROWS_AS(table.insert(&second), std::length_error);
+    REQUIRE(table.get(key) == &first);
+
+    for (int i = 1; i < 255; i++) {
+        table.erase(key);
+        key = table.insert(&first);
+    }
+    REQUIRE(SVG::Handle<>(key).generation() == 255);
+    table.erase(key);
+    REQUIRE(table.size() == 0);
+    REQUIRE_THROWS_AS(table.insert(&first), std::length_error);
+    REQUIRE(table.get(key) == nullptr);
+}
+
+static void run_with_stack(const size_t stack_size, void (*function)()) {
+    // Run a function on a thread with a small stack, like a worker thread
+    pthread_attr_t attr;
+    pthread_t thread;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, stack_size);
+    pthread_create(&thread, &attr, [](void* arg) -> void* { ((void (*)())arg)(); return nullptr; }, (void*)function);
+    pthread_join(thread, nullptr);
+    pthread_attr_destroy(&attr);
+}
+
+static SVG::Element* deep_tree(SVG::SVG& root, const size_t depth) {
+    // Nest groups depth levels deep and return the innermost one
+    SVG::Element* node = &root;
+    for (size_t i = 0; i < depth; i++) node = node->add_child<SVG::Group>();
+    return node;
+}
+
+TEST_CASE("Deeply Nested Documents", "[test_deep_nesting]") {
+    static bool finished = false;
+    run_with_stack(1 << 16, []() {
+        SVG::SVG root;
+        deep_tree(root, 1000000)->add_child<SVG::Circle>(5, 5, 5);
+        root.autoscale(SVG::NO_MARGINS);
+        const bool sized = (root.attr["width"] == "10.00mm"),
+            found = (root.get_children<SVG::Circle>().size() == 1);
+
+        SVG::SVG shallower;
+        deep_tree(shallower, 5000)->add_child<SVG::Circle>();
+        const std::string markup = shallower;
+        finished = sized && found &&
+            markup.find(std::string(5001, '\t') + "<circle />\n" + std::string(5000, '\t') + "</g>") != std::string::npos;
+    }); // Destroying both documents shouldn't overflow either
+
+    REQUIRE(finished);
+}
+
+TEST_CASE("Transactions and the Id Index", "[test_transaction]") {
+    SVG::SVG root;
+    auto group = root.add_child<SVG::Group>();
+    std::vector<SVG::Circle*> circles;
+    for (int i = 0; i < 100; i++)
+        circles.push_back(group->add_child<SVG::Circle>(i, i, 1));
+    circles[10]->set_attr("id", "ten");
+
+    // The index is built on first use and then maintained
+    REQUIRE(root.get_element_by_id("ten") == circles[10]);
+    circles[10]->set_attr("id", "TEN");
+    circles[20]->set_attr("id", "ten");
+    REQUIRE(root.get_element_by_id("ten") == circles[20]);
+    REQUIRE(root.get_element_by_id("TEN") == circles[10]);
+    circles[20]->detach();
+    REQUIRE(root.get_element_by_id("ten") == nullptr);
+
+    {
+        auto transaction = root.transaction();
+        for (int i = 30; i < 60; i++) circles[i]->set_attr("id", "circle_" + std::to_string(i));
+        group->add_child<SVG::Rect>("box");
+        circles[40]->detach();
+        REQUIRE(root.pending_changes() == 32);
+
+        // Lookups remain correct while changes are pending
+        REQUIRE(root.get_element_by_id("circle_50") == circles[50]);
+        REQUIRE(root.get_element_by_id("circle_40") == nullptr);
+    }
+
+    REQUIRE(root.pending_changes() == 0);
+    REQUIRE(root.get_element_by_id("circle_59") == circles[59]);
+    REQUIRE(root.get_element_by_id("box") == group->last_child());
+    REQUIRE(root.get_element_by_id("circle_40") == nullptr);
+
+    // Duplicate ids resolve to the first in document order, as after a rebuild
+    circles[80]->set_attr("id", "dup");
+    circles[70]->set_attr("id", "dup");
+    circles[90]->set_attr("id", "dup");
+    REQUIRE(root.get_element_by_id("dup") == circles[70]);
+    group->insert_before(std::make_unique<SVG::Rect>("dup"), circles[0]);
+    REQUIRE(root.get_element_by_id("dup") == group->first_child());
+    {
+        auto transaction = root.transaction();
+        circles[95]->set_attr("id", "ninety-five"); // Rebuilds the index on commit
+    }
+    REQUIRE(root.get_element_by_id("dup") == group->first_child());
+
+    // Moving an indexed document keeps its index and log
+    root.start_log();
+    SVG::SVG moved(std::move(root));
+    REQUIRE(moved.get_element_by_id("circle_59") == circles[59]);
+    REQUIRE(moved.mutations()->size() == 0);
+    circles[59]->set_attr("id", "fifty-nine");
+    REQUIRE(moved.get_element_by_id("fifty-nine") == circles[59]);
+    REQUIRE(moved.undo());
+    REQUIRE(moved.get_element_by_id("circle_59") == circles[59]);
+    REQUIRE(root.get_element_by_id("circle_59") == nullptr);
+}
+
+TEST_CASE("Mutation Journal", "[test_mutation_log]") {
+    SVG::SVG root;
+    auto group = root.add_child<SVG::Group>();
+    auto circle = group->add_child<SVG::Circle>(0, 0, 5);
+    root.start_log();
+    auto replica = root.clone();
+    const std::string before = std::string(root);
+
+    circle->set_attr("fill", "red");
+    circle->set_attr("r", 10.0);
+    auto rect = group->add_child<SVG::Rect>(0, 0, 10, 10, 0);
+    rect->set_attr("stroke", "blue");
+    REQUIRE(root.changed_since(3) == std::vector<SVG::Element*>{ rect });
+    REQUIRE(root.remove(circle) == nullptr);
+    REQUIRE(root.mutations()->size() == 5);
+
+    const std::string after = std::string(root);
+    REQUIRE(root.replay(*replica));
+    REQUIRE(std::string(*replica) == after);
+    REQUIRE(root.changed_since(0) == std::vector<SVG::Element*>{ group });
+    REQUIRE(root.changed_since(5).empty());
+
+    // Undoing everything restores the original document
+    while (root.undo());
+    REQUIRE(root.mutations()->position() == 0);
+    REQUIRE(std::string(root) == before);
+    REQUIRE(circle->attr.find("fill") == circle->attr.end());
+
+    while (root.redo());
+    REQUIRE(std::string(root) == after);
+
+    // New changes discard undone ones
+    REQUIRE(root.undo());
+    REQUIRE(root.undo());
+    group->set_attr("opacity", 0.5);
+    REQUIRE(root.mutations()->size() == 4);
+    REQUIRE_FALSE(root.redo());
+    REQUIRE(group->first_child() == circle);
+    REQUIRE(rect->attr.find("stroke") == rect->attr.end());
+
+    // Paths drawn in place are logged by what was appended
+    auto path = group->add_child<SVG::Path>();
+    path->start(0, 0);
+    const std::string started = path->attr["d"];
+    const size_t logged = root.mutations()->bytes();
+    for (int i = 1; i <= 1000; i++) path->line_to(i, i);
+    path->to_origin();
+    const std::string drawn = path->attr["d"];
+    REQUIRE(root.mutations()->bytes() - logged < 40 * 1000);
+
+    REQUIRE(root.undo());
+    REQUIRE(path->attr["d"] == drawn.substr(0, drawn.size() - 3));
+    int undone {0};
+    while (undone < 1000 && root.undo()) undone++;
+    REQUIRE(undone == 1000);
+    REQUIRE(path->attr["d"] == started);
+    while (root.redo());
+    REQUIRE(path->attr["d"] == drawn);
+
+    auto outline = group->add_child<SVG::Path>();
+    outline->add_rect(0, 0, 10, 10);
+    outline->add_circle(5, 5, 5);
+    REQUIRE(root.undo());
+    REQUIRE(root.undo());
+    REQUIRE(outline->attr.find("d") == outline->attr.end());
+}
+
+TEST_CASE("Optimization Passes", "[test_optimize]") {
+    SVG::SVG root;
+    auto outer = root.add_child<SVG::Group>();
+    outer->set_attr("fill", "red");
+
+    // Wrapper without attributes
+    auto wrapper = outer->add_child<SVG::Group>();
+    auto circle = wrapper->add_child<SVG::Circle>(0, 0, 5);
+    circle->set_attr("opacity", 1.0).set_attr("stroke-width", "1");
+
+    // Chained transforms around a single rectangle
+    auto shift = outer->add_child<SVG::Group>();
+    shift->set_attr("transform", "translate(10,0)");
+    auto scale = shift->add_child<SVG::Group>();
+    scale->set_attr("transform", "scale(2)");
+    scale->add_child<SVG::Circle>(1, 1, 1);
+
+    // Defaults which are inherited from a non-default value must stay
+    auto thick = outer->add_child<SVG::Group>();
+    thick->set_attr("stroke-width", 2.0);
+    thick->add_child<SVG::Line>(0, 10, 0, 10)->set_attr("stroke-width", 1.0);
+    outer->add_child<SVG::Group>()->set_attr("class", "empty");
+    root.style("rect").set_attr("fill", "blue"); // Unused
+
+    const size_t size = std::string(root).size();
+    auto reports = root.optimize();
+    REQUIRE(reports.size() == 5);
+
+    long long saved {0};
+    for (auto& report : reports) {
+        REQUIRE(report.bytes_saved > 0);
+        REQUIRE(report.milliseconds >= 0);
+        saved += report.bytes_saved;
+    }
+    REQUIRE(saved == (long long)(size - std::string(root).size()));
+
+    std::string expected = "<svg xmlns=\"http://www.w3.org/2000/svg\">\n"
+        "\t<g fill=\"red\">\n"
+        "\t\t<circle cx=\"0.00\" cy=\"0.00\" r=\"5.00\" />\n"
+        "\t\t<circle cx=\"1.00\" cy=\"1.00\" r=\"1.00\" transform=\"translate(10,0) scale(2)\" />\n"
+        "\t\t<g stroke-width=\"2.00\">\n"
+        "\t\t\t<line stroke-width=\"1.00\" x1=\"0.00\" x2=\"10.00\" y1=\"0.00\" y2=\"10.00\" />\n"
+        "\t\t</g>\n"
+        "\t</g>\n"
+        "</svg>";
+    REQUIRE(std::string(root) == expected);
+
+    // Custom pipelines
+    SVG::SVG::Optimizer only_groups;
+    only_groups.add("drop_empty_groups", SVG::SVG::Optimizer::drop_empty_groups);
+    SVG::SVG doc;
+    doc.add_child<SVG::Group>("kept");
+    REQUIRE(doc.optimize(only_groups)[0].bytes_saved == 0);
+}
+
+TEST_CASE("Merging Shapes into Compound Paths", "[test_merge_shapes]") {
+    SVG::SVG root;
+    for (int i = 1; i <= 3; i++)
+        root.add_child<SVG::Circle>(10 * i, 10, 2)->set_attr("fill", "red");
+    root.add_child<SVG::Rect>(40, 40, 5, 10, 0)->set_attr("fill", "red");
+    root.add_child<SVG::Line>(50, 60, 50, 70)->set_attr("fill", "red");
+    root.add_child<SVG::Circle>(0, 0, 1)->set_attr("fill", "blue"); // Different style
+    root.add_child<SVG::Circle>(5, 5, 1)->set_attr("fill", "red");
+    root.add_child<SVG::Rect>(0, 0, 5, 5, 45)->set_attr("fill", "red"); // Rotated
+    root.add_child<SVG::Rect>(0, 0, 5, 5, 45)->set_attr("fill", "red");
+
+    auto original = root.clone();
+    SVG::SVG::Optimizer pass;
+    pass.add("merge_shapes", SVG::SVG::Optimizer::merge_shapes);
+    REQUIRE(root.optimize(pass)[0].bytes_saved > 0);
+
+    auto paths = root.get_immediate_children<SVG::Path>();
+    REQUIRE(paths.size() == 2);
+    REQUIRE(paths[0]->attr["fill"] == "red");
+    REQUIRE(paths[0]->attr["d"] ==
+        "M8 10a2 2 0 1 0 4 0a2 2 0 1 0-4 0z"
+        "M18 10a2 2 0 1 0 4 0a2 2 0 1 0-4 0z"
+        "M28 10a2 2 0 1 0 4 0a2 2 0 1 0-4 0z"
+        "M40 40h5v10h-5zM50 50L60 70");
+    REQUIRE(root.get_immediate_children<SVG::Circle>().size() == 2);
+
+    // Only identical transforms may be shared
+    REQUIRE(paths[1]->attr["transform"] == "rotate(45.00,2.50,2.50 )");
+    REQUIRE(root.get_immediate_children<SVG::Rect>().empty());
+
+    // The bounding box is unchanged
+    root.autoscale(SVG::NO_MARGINS);
+    original->autoscale(SVG::NO_MARGINS);
+    REQUIRE(root.attr["viewBox"] == original->attr["viewBox"]);
+
+    std::string data = "M";
+    for (const double value : { 1.5, -0.001, 2.0, -12.25, 0.05 }) SVG::util::append_compact(data, value);
+    REQUIRE(data == "M1.5 0 2-12.25 0.05");
+}
+
+TEST_CASE("Pruning Stylesheets", "[test_prune_styles]") {
+    SVG::SVG root;
+    root.add_child<SVG::Circle>(0, 0, 1)->set_attr("class", "dot big");
+    root.add_child<SVG::Group>("a");
+    root.add_child<SVG::Group>("b");
+    root.add_child<SVG::Group>("c");
+
+    root.style("circle").set_attr("fill", "red");
+    root.style("rect").set_attr("fill", "blue");          // No rectangles
+    root.style(".dot, .missing").set_attr("stroke", "black");
+    root.style("svg .big:hover").set_attr("stroke", "red");
+    root.style("#a").set_attr("opacity", "0.5").set_attr("animation-name", "pulse");
+    root.style("#c").set_attr("opacity", "0.5").set_attr("animation-name", "pulse");
+    root.style("#b").set_attr("fill", "green");
+    root.style("#missing g").set_attr("fill", "green");
+    root.keyframes("pulse")["from"].set_attr("opacity", 0);
+    root.keyframes("unused")["from"].set_attr("opacity", 0);
+
+    SVG::SVG::Optimizer pass;
+    pass.add("prune_styles", SVG::SVG::Optimizer::prune_styles);
+    REQUIRE(root.optimize(pass)[0].bytes_saved > 0);
+
+    auto& css = root.css->css;
+    std::vector<std::string> selectors;
+    for (auto& rule : css) selectors.push_back(rule.first);
+    REQUIRE(selectors == std::vector<std::string>{ "#a, #c", "#b", ".dot", "circle", "svg .big:hover" });
+    REQUIRE(root.css->keyframes.size() == 1);
+    REQUIRE(root.css->keyframes.count("pulse"));
+
+    // Identical rules aren't merged across others which set their properties differently
+    SVG::SVG doc;
+    doc.add_child<SVG::Group>("a");
+    doc.add_child<SVG::Group>("b");
+    doc.add_child<SVG::Group>("c");
+    doc.style("#a").set_attr("fill", "red");
+    doc.style("#b").set_attr("fill", "blue");
+    doc.style("#c").set_attr("fill", "red");
+    doc.optimize(pass);
+    REQUIRE(doc.css->css.size() == 3);
+}
+
+TEST_CASE("Parsing Documents", "[test_parse]") {
+    const std::string markup = "<?xml version=\"1.0\"?>\n"
+        "<!DOCTYPE svg>\n"
+        "<svg width=\"100\" xmlns=\"http://www.w3.org/2000/svg\">\n"
+        "  <!-- <circle> in a comment -->\n"
+        "  <style><![CDATA[ circle > g { fill: red; } ]]></style>\n"
+        "  <g id='outer' data-note=\"a > b\">\n"
+        "    <circle cx=\"1\" cy=\"2\" r=\"3\"/>\n"
+        "    <g><rect x=\"0\" y=\"0\" width=\"5\" height=\"5\" /></g>\n"
+        "  </g>\n"
+        "  <text x=\"0\">Hello <tspan>world</tspan>!</text>\n"
+        "  <circle cx=\"4\" cy=\"5\" r=\"6\"></circle>\n"
+        "  <foreignObject><div>&amp;</div></foreignObject>\n"
+        "</svg>\n";
+
+    auto doc = SVG::parse(markup, 3);
+    REQUIRE(doc);
+    REQUIRE(doc->attr["width"] == "100");
+    REQUIRE(doc->get_children<SVG::Circle>().size() == 2);
+    REQUIRE(doc->get_children<SVG::Rect>().size() == 1);
+    REQUIRE(doc->get_element_by_id("outer")->attr["data-note"] == "a > b");
+
+    const std::string expected = "<svg width=\"100\" xmlns=\"http://www.w3.org/2000/svg\">\n"
+        "\t<style type=\"text/css\">\n"
+        "\t\t<![CDATA[\n"
+        "\t\t\tcircle > g {\n"
+        "\t\t\t\tfill: red;\n"
+        "\t\t\t}\n"
+        "\t\t]]>\n"
+        "\t</style>\n"
+        "\t<g data-note=\"a > b\" id=\"outer\">\n"
+        "\t\t<circle cx=\"1\" cy=\"2\" r=\"3\" />\n"
+        "\t\t<g>\n"
+        "\t\t\t<rect height=\"5\" width=\"5\" x=\"0\" y=\"0\" />\n"
+        "\t\t</g>\n"
+        "\t</g>\n"
+        "\t<text x=\"0\">Hello <tspan>world</tspan>!</text>\n"
+        "\t<circle cx=\"4\" cy=\"5\" r=\"6\" />\n"
+        "\t<foreignObject>\n"
+        "\t\t<div>&amp;</div>\n"
+        "\t</foreignObject>\n"
+        "</svg>";
+    REQUIRE(std::string(*doc) == expected);
+
+    // The result doesn't depend on how the input is split
+    for (size_t threads : { 1, 2, 8 })
+        REQUIRE(std::string(*SVG::parse(markup, threads)) == expected);
+    REQUIRE(std::string(*SVG::parse(expected)) == expected);
+
+    REQUIRE(SVG::parse("<svg><g></svg>") == nullptr);
+    REQUIRE(SVG::parse("<svg><g></h></svg>", 2) == nullptr);
+    REQUIRE(SVG::parse("<svg /><svg />") == nullptr);
+    REQUIRE(SVG::parse("<html></html>") == nullptr);
+    REQUIRE(SVG::parse("<svg><g attr=\"></g></svg>") == nullptr);
+    REQUIRE(std::string(*SVG::parse("<svg/>")) == "<svg />");
+
+    // Paths know their extents, and stylesheets are the document's own
+    auto drawing = SVG::parse("<svg><path d=\"M100 100L200 200\"/><path d=\"m 50,300 h10 v-10 z\"/></svg>");
+    auto paths = drawing->get_children<SVG::Path>();
+    REQUIRE(paths.size() == 2);
+    auto line_box = static_cast<SVG::Element*>(paths[0])->get_bbox();
+    auto tick_box = static_cast<SVG::Element*>(paths[1])->get_bbox();
+    REQUIRE((line_box.x1 == 100 && line_box.x2 == 200 && line_box.y1 == 100 && line_box.y2 == 200));
+    REQUIRE((tick_box.x1 == 50 && tick_box.x2 == 60 && tick_box.y1 == 290 && tick_box.y2 == 300));
+    drawing->autoscale(SVG::NO_MARGINS);
+    REQUIRE(drawing->attr["width"] == "250.00mm");
+    REQUIRE(std::string(*SVG::parse(std::string(*drawing))) == std::string(*drawing));
+
+    doc->style(".b").set_attr("fill", "blue");
+    REQUIRE(doc->get_children<SVG::SVG::Style>().size() == 1);
+    REQUIRE(doc->css->css.at("circle > g").attr.at("fill") == "red");
+    REQUIRE(std::string(*SVG::parse(std::string(*doc))) == std::string(*doc));
+
+    // Stylesheets which wouldn't be written back the same are kept as is
+    const std::string unordered = "<svg>\n\t<style>.b { fill: red; } .a { fill: blue; }</style>\n</svg>";
+    REQUIRE(std::string(*SVG::parse(unordered)) == unordered);
+    auto animated = SVG::parse("<svg><style>@keyframes pulse { from, 50% { r: 1; } to { r: 2; } }"
+        " circle { animation: pulse 1s; }</style></svg>");
+    REQUIRE(animated->keyframes("pulse").find(50)->attr.at("r") == "1");
+    REQUIRE(animated->keyframes("pulse").find(100)->attr.at("r") == "2");
+    REQUIRE(std::string(*SVG::parse(std::string(*animated))) == std::string(*animated));
+
+    std::vector<uint32_t> index;
+    const std::string tag = "<a b=\"c\">'text with > and a long run of characters'</a>";
+    SVG::util::structural_index(tag.data(), tag.size(), index);
+    REQUIRE(index == std::vector<uint32_t>{ 0, 5, 7, 8, 9, 20, 50, 51, 54 });
+}
+
+TEST_CASE("Lazy Loading", "[test_parse_lazy]") {
+    const std::string markup = "<svg height=\"10\" width=\"10\">\n"
+        "  <g id=\"first\"><rect id=\"target\" x=\"1\" y=\"1\" width=\"2\" height=\"2\"/></g>\n"
+        "  <g id=\"second\">  <circle cx=\"5\" cy=\"5\" r=\"1\"/> </g>\n"
+        "</svg>";
+    auto source = std::make_shared<std::string>(markup);
+
+    // Nothing has been read, so the document is written as it was
+    auto doc = SVG::parse_lazy(source);
+    REQUIRE(doc);
+    REQUIRE(std::string(*doc) == markup);
+
+    // Looking up an id only reads the subtrees containing it
+    auto target = doc->get_element_by_id("target");
+    REQUIRE(target);
+    REQUIRE(dynamic_cast<SVG::Rect*>(target));
+    target->set_attr("x", "3");
+    const std::string expected = "<svg height=\"10\" width=\"10\">\n"
+        "\t<g id=\"first\">\n"
+        "\t\t<rect height=\"2\" id=\"target\" width=\"2\" x=\"3\" y=\"1\" />\n"
+        "\t</g>\n"
+        "\t<g id=\"second\">  <circle cx=\"5\" cy=\"5\" r=\"1\"/> </g>\n"
+        "</svg>";
+    REQUIRE(std::string(*doc) == expected);
+    REQUIRE(std::string(*doc->clone()) == expected);
+
+    // Traversals read whatever they need
+    REQUIRE(doc->get_children<SVG::Circle>().size() == 1);
+    REQUIRE(doc->get_element_by_id("missing") == nullptr);
+
+    auto lazy = SVG::parse_lazy(source);
+    auto eager = SVG::parse(markup);
+    lazy->autoscale();
+    eager->autoscale();
+    REQUIRE(lazy->attr["viewBox"] == eager->attr["viewBox"]);
+
+    // Malformed content is only found when it is read, and then kept as is
+    auto broken = SVG::parse_lazy(std::make_shared<std::string>("<svg><g><x></g></svg>"));
+    REQUIRE(broken);
+    REQUIRE(broken->get_children().empty());
+    REQUIRE(std::string(*broken) == "<svg><g><x></g></svg>");
+
+    // Children added to malformed content are written after it
+    broken->add_child<SVG::Circle>(1, 2, 3);
+    REQUIRE(std::string(*broken) == "<svg><g><x></g>\n\t<circle cx=\"1.00\" cy=\"2.00\" r=\"3.00\" />\n</svg>");
+    auto partly = SVG::parse_lazy(std::make_shared<std::string>("<svg><g id=\"a\"><x></y></g></svg>"));
+    partly->get_element_by_id("a")->add_child<SVG::Circle>(1, 2, 3);
+    REQUIRE(std::string(*partly) == "<svg>\n"
+        "\t<g id=\"a\"><x></y>\n"
+        "\t\t<circle cx=\"1.00\" cy=\"2.00\" r=\"3.00\" />\n"
+        "\t</g>\n"
+        "</svg>");
+
+    REQUIRE(SVG::parse_lazy(std::make_shared<std::string>("<html></html>")) == nullptr);
+    REQUIRE(SVG::parse_lazy(std::make_shared<std::string>("<svg><g></g>")) == nullptr);
+    REQUIRE(std::string(*SVG::parse_lazy(std::make_shared<std::string>("<?xml?><svg/>\n"))) == "<svg />");
+}
+
+TEST_CASE("Streaming Rewrite", "[test_rewrite]") {
+    const std::string markup = "<?xml version=\"1.0\"?>\n"
+        "<svg width=\"100\">\n"
+        "  <!-- <g id=\"layer\"> -->\n"
+        "  <g id=\"hidden\" data-note='a > b'><circle cx=\"1\" cy=\"1\" r=\"1\"/><g><rect /></g></g>\n"
+        "  <circle cx=\"2\" cy=\"4\" fill=\"red\" r=\"1\"/>\n"
+        "  <text x=\"1\">Hello <tspan fill=\"red\">world</tspan></text>\n"
+        "  <g id=\"kept\"><line x1=\"0\" y1=\"0\" x2=\"1\" y2=\"1\" /></g>\n"
+        "</svg>\n";
+
+    // Recolor, rescale and drop a layer
+    auto filter = [](SVG::StreamTag& tag) {
+        if (tag.attr["id"] == "hidden") tag.drop = true;
+        auto fill = tag.attr.find("fill");
+        if (fill != tag.attr.end() && fill->second == "red") fill->second = "blue";
+        if (tag.name == "circle") tag.attr["cx"] = SVG::to_string(std::stod(tag.attr["cx"]) * 2);
+        if (tag.name == "g") tag.name = "a";
+        if (tag.attr["id"].empty()) tag.attr.erase("id");
+    };
+
+    const std::string expected = "<?xml version=\"1.0\"?>\n"
+        "<svg width=\"100\">\n"
+        "  <!-- <g id=\"layer\"> -->\n"
+        "  \n"
+        "  <circle cx=\"4.00\" cy=\"4\" fill=\"blue\" r=\"1\" />\n"
+        "  <text x=\"1\">Hello <tspan fill=\"blue\">world</tspan></text>\n"
+        "  <a id=\"kept\"><line x1=\"0\" y1=\"0\" x2=\"1\" y2=\"1\" /></a>\n"
+        "</svg>\n";
+
+    // Output doesn't depend on where chunks end
+    for (size_t chunk : { 1, 7, 64, 1 << 20 }) {
+        std::stringstream in(markup), out;
+        REQUIRE(SVG::rewrite(in, out, filter, chunk));
+        REQUIRE(out.str() == expected);
+    }
+
+    // Untouched documents are copied exactly
+    std::stringstream in(markup), out;
+    REQUIRE(SVG::rewrite(in, out, [](SVG::StreamTag&) {}, 16));
+    REQUIRE(out.str() == markup);
+
+    // A tag much longer than a chunk is read in growing steps rather than rescanned per chunk
+    std::string long_path = "<svg><path d=\"M0 0";
+    while (long_path.size() < (1 << 22)) long_path += " L1 2 3 4 5 6 7 8";
+    long_path += "\" /></svg>";
+    std::stringstream long_in(long_path), long_out;
+    REQUIRE(SVG::rewrite(long_in, long_out, [](SVG::StreamTag&) {}, 256));
+    REQUIRE(long_out.str() == long_path);
+
+    for (const std::string bad : { "<svg><g></svg>", "<svg></g></svg>", "<svg><g attr=\"></g></svg>", "<svg><!-- </svg>" }) {
+        std::stringstream bad_in(bad), bad_out;
+        REQUIRE_FALSE(SVG::rewrite(bad_in, bad_out, [](SVG::StreamTag&) {}, 4));
+    }
+}
+
+TEST_CASE("Columnar Ingestion", "[test_columns]") {
+    // Written by pyarrow.feather.write_feather() with chunksize=2: x (double),
+    // y (float), label (string), size (int32) and color (uint32), two rows per batch
+    const std::string feather(
+        "\x41\x52\x52\x4f\x57\x31\x00\x00\xff\xff\xff\xff\x40\x01\x00\x00\x10\x00\x00\x00\x00\x00\x0a\x00\x0c\x00\x06\x00\x05\x00\x08\x00"
+        "\x0a\x00\x00\x00\x00\x01\x04\x00\x0c\x00\x00\x00\x08\x00\x08\x00\x00\x00\x04\x00\x08\x00\x00\x00\x04\x00\x00\x00\x05\x00\x00\x00"
+        "\xe0\x00\x00\x00\xa4\x00\x00\x00\x74\x00\x00\x00\x38\x00\x00\x00\x04\x00\x00\x00\x44\xff\xff\xff\x00\x00\x01\x02\x10\x00\x00\x00"
+        "\x1c\x00\x00\x00\x04\x00\x00\x00\x00\x00\x00\x00\x05\x00\x00\x00\x63\x6f\x6c\x6f\x72\x00\x06\x00\x08\x00\x04\x00\x06\x00\x00\x00"
+        "\x20\x00\x00\x00\x74\xff\xff\xff\x00\x00\x01\x02\x10\x00\x00\x00\x20\x00\x00\x00\x04\x00\x00\x00\x00\x00\x00\x00\x04\x00\x00\x00"
+        "\x73\x69\x7a\x65\x00\x00\x00\x00\x08\x00\x0c\x00\x08\x00\x07\x00\x08\x00\x00\x00\x00\x00\x00\x01\x20\x00\x00\x00\xac\xff\xff\xff"
+        "\x00\x00\x01\x05\x10\x00\x00\x00\x1c\x00\x00\x00\x04\x00\x00\x00\x00\x00\x00\x00\x05\x00\x00\x00\x6c\x61\x62\x65\x6c\x00\x00\x00"
+        "\x04\x00\x04\x00\x04\x00\x00\x00\xd8\xff\xff\xff\x00\x00\x01\x03\x10\x00\x00\x00\x14\x00\x00\x00\x04\x00\x00\x00\x00\x00\x00\x00"
+        "\x01\x00\x00\x00\x79\x00\x00\x00\xca\xff\xff\xff\x00\x00\x01\x00\x10\x00\x14\x00\x08\x00\x06\x00\x07\x00\x0c\x00\x00\x00\x10\x00"
+        "\x10\x00\x00\x00\x00\x00\x01\x03\x10\x00\x00\x00\x18\x00\x00\x00\x04\x00\x00\x00\x00\x00\x00\x00\x01\x00\x00\x00\x78\x00\x06\x00"
+        "\x08\x00\x06\x00\x06\x00\x00\x00\x00\x00\x02\x00\x00\x00\x00\x00\xff\xff\xff\xff\x58\x01\x00\x00\x14\x00\x00\x00\x00\x00\x00\x00"
+        "\x0c\x00\x16\x00\x06\x00\x05\x00\x08\x00\x0c\x00\x0c\x00\x00\x00\x00\x03\x04\x00\x18\x00\x00\x00\x70\x00\x00\x00\x00\x00\x00\x00"
+        "\x00\x00\x0a\x00\x18\x00\x0c\x00\x04\x00\x08\x00\x0a\x00\x00\x00\xcc\x00\x00\x00\x10\x00\x00\x00\x02\x00\x00\x00\x00\x00\x00\x00"
+        "\x00\x00\x00\x00\x0b\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00"
+        "\x20\x00\x00\x00\x00\x00\x00\x00\x20\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x20\x00\x00\x00\x00\x00\x00\x00"
+        "\x10\x00\x00\x00\x00\x00\x00\x00\x30\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x30\x00\x00\x00\x00\x00\x00\x00"
+        "\x0c\x00\x00\x00\x00\x00\x00\x00\x40\x00\x00\x00\x00\x00\x00\x00\x04\x00\x00\x00\x00\x00\x00\x00\x48\x00\x00\x00\x00\x00\x00\x00"
+        "\x01\x00\x00\x00\x00\x00\x00\x00\x50\x00\x00\x00\x00\x00\x00\x00\x10\x00\x00\x00\x00\x00\x00\x00\x60\x00\x00\x00\x00\x00\x00\x00"
+        "\x00\x00\x00\x00\x00\x00\x00\x00\x60\x00\x00\x00\x00\x00\x00\x00\x10\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x05\x00\x00\x00"
+        "\x02\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x02\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00"
+        "\x02\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x02\x00\x00\x00\x00\x00\x00\x00\x01\x00\x00\x00\x00\x00\x00\x00"
+        "\x02\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\xf0\x3f\x00\x00\x00\x00\x00\x00\x00\x40"
+        "\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x12\x40\x00\x00\x40\x40\x00\x00\xa0\x40\x00\x00\x80\x3f\x00\x00\xc0\x3f"
+        "\x00\x00\x00\x00\x01\x00\x00\x00\x02\x00\x00\x00\x00\x00\x00\x00\x61\x62\x63\x64\x00\x00\x00\x00\x0d\x00\x00\x00\x00\x00\x00\x00"
+        "\x01\x00\x00\x00\x00\x00\x00\x00\x03\x00\x00\x00\x02\x00\x00\x00\xff\x00\x00\xff\x80\x00\xff\x00\xff\xff\x00\x00\xff\x30\x20\x10"
+        "\xff\xff\xff\xff\x58\x01\x00\x00\x14\x00\x00\x00\x00\x00\x00\x00\x0c\x00\x16\x00\x06\x00\x05\x00\x08\x00\x0c\x00\x0c\x00\x00\x00"
+        "\x00\x03\x04\x00\x18\x00\x00\x00\x48\x00\x00\x00\x00\x00\x00\x00\x00\x00\x0a\x00\x18\x00\x0c\x00\x04\x00\x08\x00\x0a\x00\x00\x00"
+        "\xcc\x00\x00\x00\x10\x00\x00\x00\x02\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x0b\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00"
+        "\x01\x00\x00\x00\x00\x00\x00\x00\x08\x00\x00\x00\x00\x00\x00\x00\x10\x00\x00\x00\x00\x00\x00\x00\x18\x00\x00\x00\x00\x00\x00\x00"
+        "\x00\x00\x00\x00\x00\x00\x00\x00\x18\x00\x00\x00\x00\x00\x00\x00\x08\x00\x00\x00\x00\x00\x00\x00\x20\x00\x00\x00\x00\x00\x00\x00"
+        "\x00\x00\x00\x00\x00\x00\x00\x00\x20\x00\x00\x00\x00\x00\x00\x00\x0c\x00\x00\x00\x00\x00\x00\x00\x30\x00\x00\x00\x00\x00\x00\x00"
+        "\x02\x00\x00\x00\x00\x00\x00\x00\x38\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x38\x00\x00\x00\x00\x00\x00\x00"
+        "\x08\x00\x00\x00\x00\x00\x00\x00\x40\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x40\x00\x00\x00\x00\x00\x00\x00"
+        "\x08\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x05\x00\x00\x00\x02\x00\x00\x00\x00\x00\x00\x00\x01\x00\x00\x00\x00\x00\x00\x00"
+        "\x02\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x02\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00"
+        "\x02\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x02\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00"
+        "\x02\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x12\x40\x00\x00\x80\x3f\x00\x00\xc0\x3f"
+        "\x00\x00\x00\x00\x01\x00\x00\x00\x02\x00\x00\x00\x00\x00\x00\x00\x63\x64\x00\x00\x00\x00\x00\x00\x03\x00\x00\x00\x02\x00\x00\x00"
+        "\xff\xff\x00\x00\xff\x30\x20\x10\xff\xff\xff\xff\x00\x00\x00\x00\x10\x00\x00\x00\x0c\x00\x14\x00\x06\x00\x08\x00\x0c\x00\x10\x00"
+        "\x0c\x00\x00\x00\x00\x00\x04\x00\x50\x00\x00\x00\x40\x00\x00\x00\x04\x00\x00\x00\x02\x00\x00\x00\x50\x01\x00\x00\x00\x00\x00\x00"
+        "\x60\x01\x00\x00\x00\x00\x00\x00\x70\x00\x00\x00\x00\x00\x00\x00\x20\x03\x00\x00\x00\x00\x00\x00\x60\x01\x00\x00\x00\x00\x00\x00"
+        "\x48\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x08\x00\x08\x00\x00\x00\x04\x00\x08\x00\x00\x00\x04\x00\x00\x00"
+        "\x05\x00\x00\x00\xe0\x00\x00\x00\xa4\x00\x00\x00\x74\x00\x00\x00\x38\x00\x00\x00\x04\x00\x00\x00\x44\xff\xff\xff\x00\x00\x01\x02"
+        "\x10\x00\x00\x00\x1c\x00\x00\x00\x04\x00\x00\x00\x00\x00\x00\x00\x05\x00\x00\x00\x63\x6f\x6c\x6f\x72\x00\x06\x00\x08\x00\x04\x00"
+        "\x06\x00\x00\x00\x20\x00\x00\x00\x74\xff\xff\xff\x00\x00\x01\x02\x10\x00\x00\x00\x20\x00\x00\x00\x04\x00\x00\x00\x00\x00\x00\x00"
+        "\x04\x00\x00\x00\x73\x69\x7a\x65\x00\x00\x00\x00\x08\x00\x0c\x00\x08\x00\x07\x00\x08\x00\x00\x00\x00\x00\x00\x01\x20\x00\x00\x00"
+        "\xac\xff\xff\xff\x00\x00\x01\x05\x10\x00\x00\x00\x1c\x00\x00\x00\x04\x00\x00\x00\x00\x00\x00\x00\x05\x00\x00\x00\x6c\x61\x62\x65"
+        "\x6c\x00\x00\x00\x04\x00\x04\x00\x04\x00\x00\x00\xd8\xff\xff\xff\x00\x00\x01\x03\x10\x00\x00\x00\x14\x00\x00\x00\x04\x00\x00\x00"
+        "\x00\x00\x00\x00\x01\x00\x00\x00\x79\x00\x00\x00\xca\xff\xff\xff\x00\x00\x01\x00\x10\x00\x14\x00\x08\x00\x06\x00\x07\x00\x0c\x00"
+        "\x00\x00\x10\x00\x10\x00\x00\x00\x00\x00\x01\x03\x10\x00\x00\x00\x18\x00\x00\x00\x04\x00\x00\x00\x00\x00\x00\x00\x01\x00\x00\x00"
+        "\x78\x00\x06\x00\x08\x00\x06\x00\x06\x00\x00\x00\x00\x00\x02\x00\x80\x01\x00\x00\x41\x52\x52\x4f\x57\x31", 1626);
+
+    auto file = SVG::ArrowFile::read(feather.data(), feather.size());
+    REQUIRE(file);
+    REQUIRE(file->names() == std::vector<std::string>{ "x", "y", "label", "size", "color" });
+    REQUIRE(file->batches() == 2);
+    REQUIRE(file->rows() == 4);
+    REQUIRE(file->column(0, "x").type() == SVG::Column::FLOAT64);
+    REQUIRE(file->column(1, "y")[1] == 1.5);
+    REQUIRE_FALSE(file->column(0, "label"));
+    REQUIRE_FALSE(file->column(0, "missing"));
+    REQUIRE_FALSE(file->column(1, "x").valid(0));
+
+    // Null coordinates are left out, and null sizes use the default radius
+    SVG::SVG root;
+    auto scatter = root.add_child<SVG::Scatter>();
+    REQUIRE(scatter->add(*file, "x", "y", "size", "color"));
+    REQUIRE(scatter->size() == 4);
+    const std::string expected = "<svg xmlns=\"http://www.w3.org/2000/svg\">\n"
+        "\t<g>\n"
+        "\t\t<circle cx=\"1\" cy=\"3\" fill=\"#ff0000\" r=\"1\" />\n"
+        "\t\t<circle cx=\"2\" cy=\"5\" fill=\"#00ff00\" fill-opacity=\"0.5\" r=\"1\" />\n"
+        "\t\t<circle cx=\"4.5\" cy=\"1.5\" fill=\"#102030\" r=\"2\" />\n"
+        "\t</g>\n"
+        "</svg>";
+    REQUIRE(std::string(root) == expected);
+    REQUIRE(std::string(*root.clone()) == expected);
+
+    auto box = scatter->get_bbox();
+    REQUIRE(box.x1 == 0);
+    REQUIRE(box.x2 == 6.5);
+    REQUIRE(box.y1 == -0.5);
+    REQUIRE(box.y2 == 6);
+
+    // Plain arrays aren't copied either
+    const std::vector<double> xs = { 0, 10 }, ys = { 0, 5 };
+    const std::vector<float> short_ys = { 0 };
+    SVG::Scatter points;
+    points.radius = 2;
+    REQUIRE(points.add(xs, ys));
+    REQUIRE_FALSE(points.add(xs, short_ys));
+    REQUIRE_FALSE(points.add(xs, SVG::Column()));
+    box = points.get_bbox();
+    REQUIRE((box.x1 == -2 && box.x2 == 12 && box.y1 == -2 && box.y2 == 7));
+
+    // Files are mapped into memory
+    {
+        std::ofstream out("columns_test.arrow", std::ios::binary);
+        out << feather;
+    }
+    auto mapped = SVG::ArrowFile::open("columns_test.arrow");
+    std::remove("columns_test.arrow");
+    REQUIRE(mapped);
+    REQUIRE(mapped->column(1, "size")[1] == 2);
+    REQUIRE(SVG::ArrowFile::open("missing.arrow") == nullptr);
+    REQUIRE(SVG::ArrowFile::read(feather.data(), feather.size() - 1) == nullptr);
+}
+
+TEST_CASE("Charts from CSV", "[test_csv]") {
+    double value;
+    const std::string numbers = "12345678.875 -0.5 .5 1e-5 2E+3 123456789012345678901 abc";
+    const char *p = numbers.data(), *end = p + numbers.size();
+    for (double expected : { 12345678.875, -0.5, 0.5, 1e-5, 2e3, 123456789012345678901.0 }) {
+        p = SVG::util::parse_number(p, end, value);
+        REQUIRE(p);
+        REQUIRE(value == expected);
+        p++;
+    }
+    REQUIRE(SVG::util::parse_number(p, end, value) == nullptr);
+
+    // Records may span chunks, and may be quoted, blank or incomplete
+    const std::string csv = "id,x,y\r\n\"a\",1,2\r\n\r\nb, 3.5 ,\"-1\"\r\n\"c,\"\"d\"\"\",,4\r\nd,x,5\r\ne,2e1,1.25";
+    std::stringstream in(csv);
+    SVG::CsvReader reader(in, ',', 3);
+    REQUIRE(reader.header() == std::vector<std::string>{ "id", "x", "y" });
+    REQUIRE(reader.select({ "y", "x" }));
+    std::vector<std::vector<double>> columns, all(2);
+    while (reader.next(columns)) {
+        for (size_t i : { 0, 1 }) all[i].insert(all[i].end(), columns[i].begin(), columns[i].end());
+    }
+    REQUIRE(reader.good());
+    REQUIRE(all[0] == std::vector<double>{ 2, -1, 4, 5, 1.25 });
+    REQUIRE(all[1].size() == 5);
+    REQUIRE((all[1][0] == 1 && all[1][1] == 3.5 && isnan(all[1][2]) && isnan(all[1][3]) && all[1][4] == 20));
+
+    // Rows with a missing coordinate are left out
+    in = std::stringstream(csv);
+    auto chart = SVG::csv_chart(in, "x", "y");
+    REQUIRE(chart);
+    REQUIRE(std::string(*chart) ==
+        "<svg height=\"25.00mm\" viewBox=\"-10.0 -12.0 41.0 25.0\" width=\"41.00mm\" xmlns=\"http://www.w3.org/2000/svg\">\n"
+        "\t<g>\n"
+        "\t\t<circle cx=\"1\" cy=\"2\" r=\"1\" />\n"
+        "\t\t<circle cx=\"3.5\" cy=\"-1\" r=\"1\" />\n"
+        "\t\t<circle cx=\"20\" cy=\"1.25\" r=\"1\" />\n"
+        "\t</g>\n"
+        "</svg>");
+
+    // Streaming gives the same result without keeping the points
+    for (auto type : { SVG::Chart::SCATTER, SVG::Chart::LINE }) {
+        std::stringstream in_memory(csv), streamed(csv), out;
+        const std::string expected(*SVG::csv_chart(in_memory, "x", "y", type));
+        REQUIRE(SVG::csv_chart(streamed, out, "x", "y", type));
+
+        std::string result = out.str();
+        const size_t padding = result.find("  ");
+        result.erase(padding, result.find('>') - padding);
+        REQUIRE(result == expected);
+    }
+
+    in = std::stringstream("x,y\n1,\"2\n");
+    REQUIRE(SVG::csv_chart(in, "x", "y") == nullptr);
+    in = std::stringstream("x,z\n1,2\n");
+    REQUIRE(SVG::csv_chart(in, "x", "y") == nullptr);
+}
+
+TEST_CASE("Colormaps", "[test_colormap]") {
+    REQUIRE(SVG::to_string(SVG::Color(0x0a, 0xb0, 0xff)) == "#0ab0ff");
+
+    // Opacity follows the alpha of fill and stroke colors
+    SVG::Rect rect;
+    rect.set_attr("fill", SVG::Color(0xff000080)).set_attr("stop-color", SVG::Color(0x00ff0000));
+    REQUIRE(rect.attr["fill"] == "#ff0000");
+    REQUIRE(rect.attr["fill-opacity"] == "0.5");
+    REQUIRE(rect.attr["stop-opacity"] == "0");
+    rect.set_attr("fill", SVG::Color(1, 2, 3)).set_attr("x", SVG::Color(0x12345678));
+    REQUIRE(rect.attr["fill"] == "#010203");
+    REQUIRE(rect.attr.find("fill-opacity") == rect.attr.end());
+    REQUIRE(rect.attr["x"] == "#123456");
+
+    auto viridis = SVG::Colormap::viridis();
+    REQUIRE(viridis(0) == SVG::Color(0x440154ff));
+    REQUIRE(viridis(-5) == SVG::Color(0x440154ff));
+    REQUIRE(viridis(1) == SVG::Color(0xfde725ff));
+    REQUIRE(viridis(INFINITY) == SVG::Color(0xfde725ff));
+    REQUIRE(viridis(0.5) == SVG::Color(0x21918cff));
+    REQUIRE(viridis(NAN) == viridis.missing);
+
+    // Vectorized lookups agree with one value at a time
+    std::vector<double> values(1001);
+    for (size_t i {0}; i < values.size(); i++) values[i] = (double)(i * 7919 % 1000) / 400 - 0.5;
+    values[3] = NAN; values[10] = INFINITY; values[11] = -INFINITY;
+    for (auto& map : { SVG::Colormap::magma(), SVG::Colormap::inferno(), SVG::Colormap::plasma(), SVG::Colormap::cividis() }) {
+        std::vector<uint32_t> colors(values.size());
+        map.map(values.data(), values.size(), colors.data());
+        size_t mismatches {0};
+        for (size_t i {0}; i < values.size(); i++) mismatches += colors[i] != map(values[i]).rgba;
+        REQUIRE(mismatches == 0);
+    }
+
+    viridis.range(1, 100, SVG::Colormap::LOG);
+    REQUIRE(viridis(10) == SVG::Color(0x21918cff));
+    REQUIRE(viridis(0) == SVG::Color(0x440154ff));
+    REQUIRE(viridis(-1) == viridis.missing);
+
+    // Log ranges must be positive: a lower bound of zero spans six decades
+    viridis.range(0, 1e6, SVG::Colormap::LOG);
+    REQUIRE(viridis(1e3) == SVG::Color(0x21918cff));
+    REQUIRE(viridis(0.5) == SVG::Color(0x440154ff));
+    viridis.range(-10, 0, SVG::Colormap::LOG);
+    REQUIRE(viridis(-5) == SVG::Color(0x21918cff));
+    viridis.range(1, 100, SVG::Colormap::LOG);
+
+    // Mapped columns color a scatter plot, with nulls in the missing color
+    const std::vector<double> xs = { 1, 2 }, ys = { 3, 4 };
+    const std::vector<int32_t> counts = { 1, 100 };
+    const uint8_t validity[] = { 0x2 };
+    viridis.missing = SVG::Color(0x80808080);
+    SVG::Scatter points;
+    REQUIRE(points.add(xs, ys, SVG::Column(), viridis.map(SVG::Column(SVG::Column::INT32, counts.data(), 2, validity))));
+    REQUIRE(std::string(points) ==
+        "<g>\n"
+        "\t<circle cx=\"1\" cy=\"3\" fill=\"#808080\" fill-opacity=\"0.5\" r=\"1\" />\n"
+        "\t<circle cx=\"2\" cy=\"4\" fill=\"#fde725\" r=\"1\" />\n"
+        "</g>");
+}
+
+TEST_CASE("Contours", "[test_contours]") {
+    // A peak in the middle of a 4 x 4 grid
+    const std::vector<double> peak = { 0, 0, 0, 0, 0, 2, 2, 0, 0, 2, 2, 0, 0, 0, 0, 0 };
+    auto lines = SVG::contours(peak.data(), 4, 4, { 3, 1 });
+    REQUIRE(lines.size() == 2);
+    REQUIRE(std::string(*lines[0]) == "<path d=\"M0.5 1L1 0.5 2 0.5 2.5 1 2.5 2 2 2.5 1 2.5 0.5 2z\" fill=\"none\" stroke=\"black\" />");
+    REQUIRE(std::string(*lines[1]) == "<path fill=\"none\" stroke=\"black\" />");
+    auto box = static_cast<SVG::Element&>(*lines[0]).get_bbox();
+    REQUIRE((box.x1 == 0.5 && box.x2 == 2.5 && box.y1 == 0.5 && box.y2 == 2.5));
+
+    // Bands are closed around the edges of the grid
+    auto bands = SVG::contours(peak.data(), 4, 4, { -1, 1, 3 }, SVG::Contour::BANDS);
+    REQUIRE(bands.size() == 2);
+    REQUIRE(std::string(*bands[0]) ==
+        "<path d=\"M0 0L1 0 2 0 3 0 3 1 3 2 3 3 2 3 1 3 0 3 0 2 0 1z"
+        "M0.5 1L1 0.5 2 0.5 2.5 1 2.5 2 2 2.5 1 2.5 0.5 2z\" fill-rule=\"evenodd\" />");
+    box = static_cast<SVG::Element&>(*bands[0]).get_bbox();
+    REQUIRE((box.x1 == 0 && box.x2 == 3 && box.y1 == 0 && box.y2 == 3));
+
+    // Saddles join the corners on the side of the average, and isolines stop at NANs
+    const std::vector<double> saddle = { 1, 0, 0, 1 }, gap = { 0, 1, 2, 0, 1, 2, 0, NAN, 2 };
+    REQUIRE(SVG::contours(saddle.data(), 2, 2, { 0.5 })[0]->attr["d"] == "M0.5 0L1 0.5M0.5 1L0 0.5");
+    REQUIRE(SVG::contours(saddle.data(), 2, 2, { 0.6 })[0]->attr["d"] == "M0.4 0L0 0.4M0.6 1L1 0.6");
+    REQUIRE(SVG::contours(gap.data(), 3, 3, { 0.5 })[0]->attr["d"] == "M0.5 1L0.5 0");
+
+    // The result doesn't depend on the number of threads
+    std::vector<double> wave(120 * 80);
+    for (size_t i {0}; i < wave.size(); i++) wave[i] = std::sin(i % 120 * 0.1) * std::cos(i / 120 * 0.13);
+    wave[500] = NAN;
+    for (auto type : { SVG::Contour::LINES, SVG::Contour::BANDS }) {
+        auto one = SVG::contours(wave.data(), 120, 80, { -0.5, 0, 0.5 }, type, 1),
+            many = SVG::contours(wave.data(), 120, 80, { -0.5, 0, 0.5 }, type, 7);
+        for (size_t i {0}; i < one.size(); i++) REQUIRE(one[i]->attr["d"] == many[i]->attr["d"]);
+    }
+}